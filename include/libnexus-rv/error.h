@@ -16,6 +16,8 @@ enum nexus_error {
     nexus_stream_bad_mseo,
     nexus_stream_truncate,
     nexus_stream_read_failed,
+    nexus_stream_seek_failed,
+    nexus_stream_write_failed,
     nexus_msg_invalid,
     nexus_msg_missing_field,
     nexus_msg_unsupported,
@@ -25,6 +27,8 @@ enum nexus_error {
     nexus_trace_icnt_overflow,
     nexus_trace_retstack_empty,
     nexus_trace_mismatch,
+    nexus_index_invalid,
+    nexus_evstream_invalid,
 };
 
 static inline const char *str_nexus_error(int err) {
@@ -43,6 +47,10 @@ static inline const char *str_nexus_error(int err) {
             return "nexus_stream_truncate";
         case nexus_stream_read_failed:
             return "nexus_stream_read_failed";
+        case nexus_stream_seek_failed:
+            return "nexus_stream_seek_failed";
+        case nexus_stream_write_failed:
+            return "nexus_stream_write_failed";
         case nexus_msg_invalid:
             return "nexus_msg_invalid";
         case nexus_msg_missing_field:
@@ -61,6 +69,10 @@ static inline const char *str_nexus_error(int err) {
             return "nexus_trace_retstack_empty";
         case nexus_trace_mismatch:
             return "nexus_trace_mismatch";
+        case nexus_index_invalid:
+            return "nexus_index_invalid";
+        case nexus_evstream_invalid:
+            return "nexus_evstream_invalid";
         default:
             return "(unknown)";
     }
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * event-stream.h - Binary stream of replayed trace events
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_EVENT_STREAM_H
+#define LIBNEXUS_RV_EVENT_STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file
+ * @brief Compact binary form of the events produced by a trace replayer
+ *
+ * The stream starts with an 8-byte header: the magic "NXRVEVS" followed
+ * by the version byte. Each record starts with a byte of type (low 4 bits)
+ * and flags (high 4 bits), followed by fields encoded as LEB128 varints.
+ * The timestamp and the address are encoded as zigzag deltas from the
+ * previous record, except in Sync records, which carry absolute values
+ * and reset the delta state. Thus, streams of trace segments starting
+ * with Sync can be concatenated.
+ */
+
+#define NEXUSRV_EVSTREAM_VERSION 1
+#define NEXUSRV_EVSTREAM_HEADER 8
+/** @brief Upper bound of the encoded size of any record */
+#define NEXUSRV_EVSTREAM_MAX_RECORD 64
+
+/** @brief Record types */
+enum nexusrv_evstream_type {
+    NEXUSRV_Evstream_Block = 1, /*!< Block of instructions retired */
+    NEXUSRV_Evstream_Partial,   /*!< Block stopped by the next record */
+    NEXUSRV_Evstream_Retire,    /*!< I-CNT retired without the program */
+    NEXUSRV_Evstream_TNT,       /*!< Direct branch without the program */
+    NEXUSRV_Evstream_Indirect,  /*!< Indirect branch, trap or interrupt */
+    NEXUSRV_Evstream_Sync,      /*!< Synchronization */
+    NEXUSRV_Evstream_Stop,      /*!< Trace stopped */
+    NEXUSRV_Evstream_Error,     /*!< Trace error */
+};
+
+/* Flags of Block records */
+#define NEXUSRV_EVSTREAM_TAKEN     (1 << 0) /*!< Cond branch taken */
+#define NEXUSRV_EVSTREAM_IMPLICIT  (1 << 1) /*!< Return from return stack */
+#define NEXUSRV_EVSTREAM_COSWAP    (1 << 2) /*!< Coroutine swap */
+#define NEXUSRV_EVSTREAM_TARGET    (1 << 3) /*!< Has target */
+/* Flags of Indirect records */
+#define NEXUSRV_EVSTREAM_INTERRUPT (1 << 0) /*!< Interrupt */
+#define NEXUSRV_EVSTREAM_EXCEPTION (1 << 1) /*!< Exception */
+#define NEXUSRV_EVSTREAM_OWNERSHIP (1 << 2) /*!< Ownership in code/data */
+/* Flags of TNT records: NEXUSRV_EVSTREAM_TAKEN */
+/* Flags of Sync records */
+#define NEXUSRV_EVSTREAM_SEEK      (1 << 0) /*!< Replay started by seek */
+
+/** @brief Decoded record
+ *
+ * Fields not used by the record type are zero.
+ */
+typedef struct nexusrv_evstream_rec {
+    uint8_t type;     /*!< NEXUSRV_Evstream_x */
+    uint8_t flags;    /*!< NEXUSRV_EVSTREAM_x, 4 bits */
+    uint8_t kind;     /*!< Block: NEXUSRV_ITYPE_x of the last instruction */
+    uint32_t icnt;    /*!< Block/Partial/Retire: I-CNT in half-words */
+    uint32_t stack;   /*!< Block: Return stack depth after the block */
+    uint32_t code;    /*!< Sync: SYNC type, Stop: EVCODE, Error: ETYPE,
+                           Indirect: ownership fmt | priv << 2 | v << 4 */
+    uint64_t data;    /*!< Error: ECODE, Indirect: ownership context */
+    uint64_t time;    /*!< Timestamp */
+    uint64_t addr;    /*!< Block/Partial: start address,
+                           Indirect: target, Sync: address */
+    uint64_t target;  /*!< Block with NEXUSRV_EVSTREAM_TARGET: next PC,
+                           e.g., of indirect jump/call, return or trap */
+} nexusrv_evstream_rec;
+
+/** @brief Delta encoding state, shared by the encoder and decoder
+ */
+typedef struct nexusrv_evstream_state {
+    uint64_t time;  /*!< Timestamp of the previous record */
+    uint64_t addr;  /*!< Address of the previous record */
+} nexusrv_evstream_state;
+
+/** @brief Initialize the delta encoding state
+ *
+ * @param [out] state The delta encoding state
+ */
+static inline void nexusrv_evstream_state_init(nexusrv_evstream_state *state) {
+    memset(state, 0, sizeof(*state));
+}
+
+/** @brief Fill the stream header into \p buffer
+ *
+ * @param [out] buffer Buffer of NEXUSRV_EVSTREAM_HEADER bytes
+ */
+void nexusrv_evstream_header(uint8_t *buffer);
+
+/** @brief Encode \p rec into \p buffer
+ *
+ * @param [in,out] state The delta encoding state
+ * @param [out] buffer The buffer that will hold the record
+ * @param limit Should be set to the number of bytes in \p buffer
+ * @param [in] rec The record to encode
+ * @retval >0: The number of bytes produced on success
+ * @retval -nexus_stream_truncate: if more bytes are required from \p buffer
+ * @retval -nexus_evstream_invalid: if the record type is invalid
+ */
+ssize_t nexusrv_evstream_encode(nexusrv_evstream_state *state,
+                                uint8_t *buffer, size_t limit,
+                                const nexusrv_evstream_rec *rec);
+
+/** @brief Decode a record from \p buffer
+ *
+ * @param [in,out] state The delta encoding state
+ * @param [in] buffer The buffer holding the records
+ * @param limit Should be set to the number of bytes in \p buffer
+ * @param [out] rec The decoded record
+ * @retval >0: The number of bytes consumed on success
+ * @retval -nexus_stream_truncate: if more bytes are required from \p buffer
+ * @retval -nexus_evstream_invalid: if the record is invalid
+ */
+ssize_t nexusrv_evstream_decode(nexusrv_evstream_state *state,
+                                const uint8_t *buffer, size_t limit,
+                                nexusrv_evstream_rec *rec);
+
+/** @brief Event stream reader context
+ *
+ * This should be initialized by nexusrv_evstream_reader_init
+ * before calling nexusrv_evstream_reader_next
+ */
+typedef struct nexusrv_evstream_reader {
+    int fd;             /*!< File descriptor of the event stream */
+    uint8_t *buffer;    /*!< Buffer to hold chunks read from the stream */
+    size_t bufsz;       /*!< Buffer size */
+    size_t filled;      /*!< Currently filled bytes in buffer */
+    size_t pos;         /*!< Currently consumed bytes in buffer */
+    bool eof;           /*!< Nothing more to read from fd */
+    nexusrv_evstream_state state; /*!< Delta encoding state */
+} nexusrv_evstream_reader;
+
+/** @brief Initialize the event stream reader, and check the header
+ *
+ * @param [out] reader The reader context
+ * @param fd File descriptor of the event stream
+ * @param buffer Caller allocated buffer
+ * @param bufsz Size of caller allocated buffer,
+ *   at least NEXUSRV_EVSTREAM_MAX_RECORD
+ * @retval ==0: Success
+ * @retval -nexus_buffer_too_small: if \p bufsz is too small
+ * @retval -nexus_stream_read_failed:
+ *   if read \p fd has failed, error can be retrieved from errno
+ * @retval -nexus_evstream_invalid: if the header or version mismatches
+ */
+int nexusrv_evstream_reader_init(nexusrv_evstream_reader *reader, int fd,
+                                 uint8_t *buffer, size_t bufsz);
+
+/** @brief Read the next record
+ *
+ * @param [in,out] reader The reader context
+ * @param [out] rec The record
+ * @retval >0: The number of bytes consumed on success
+ * @retval ==0: End of the stream
+ * @retval -nexus_stream_read_failed:
+ *   if read fd has failed, error can be retrieved from errno
+ * @retval -nexus_stream_truncate: if the stream ends in the middle of record
+ * @retval -nexus_evstream_invalid: if the record is invalid
+ */
+ssize_t nexusrv_evstream_reader_next(nexusrv_evstream_reader *reader,
+                                     nexusrv_evstream_rec *rec);
+
+#endif
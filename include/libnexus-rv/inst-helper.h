@@ -8,6 +8,10 @@
 #ifndef LIBNEXUS_RV_INST_HELPER_H
 #define LIBNEXUS_RV_INST_HELPER_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
 enum nexusrv_itypes {
     NEXUSRV_ITYPE_None,
     NEXUSRV_ITYPE_Exception,
@@ -18,6 +22,7 @@ enum nexusrv_itypes {
     NEXUSRV_ITYPE_Indirect_Call,
     NEXUSRV_ITYPE_Coroutine_Swap,
     NEXUSRV_ITYPE_Function_Return,
+    NEXUSRV_ITYPE_Trap_Return,
 };
 
 static inline bool nexurv_inst_link_reg(unsigned reg) {
@@ -59,4 +64,148 @@ static inline enum nexusrv_itypes
             NEXUSRV_ITYPE_Indirect_Jump;
 }
 
+/** @brief Control-flow classification of a RISC-V instruction
+ */
+typedef struct nexusrv_inst {
+    uint8_t len;        /*!< Length in bytes, 0 if unknown */
+    uint8_t itype;      /*!< NEXUSRV_ITYPE_x */
+    int64_t imm;        /*!< Offset of direct jump/branch */
+} nexusrv_inst;
+
+/** @brief Get the instruction length from the first 16-bit parcel
+ *
+ * @param parcel The first 16 bits of the instruction
+ * @return Length in bytes, 0 if the encoding is reserved (>= 80 bits)
+ */
+static inline unsigned nexusrv_inst_len(uint16_t parcel) {
+    if ((parcel & 0x3) != 0x3)
+        return 2;
+    if ((parcel & 0x1f) != 0x1f)
+        return 4;
+    if ((parcel & 0x3f) == 0x1f)
+        return 6;
+    if ((parcel & 0x7f) == 0x3f)
+        return 8;
+    return 0;
+}
+
+static inline int64_t nexusrv_inst_sext(uint64_t value, unsigned bits) {
+    return (int64_t)(value << (64 - bits)) >> (64 - bits);
+}
+
+static inline enum nexusrv_itypes nexusrv_inst_decode16(uint16_t i, bool rv64,
+                                                        int64_t *imm) {
+    unsigned funct3 = i >> 13;
+    unsigned rs1 = (i >> 7) & 0x1f;
+    unsigned rs2 = (i >> 2) & 0x1f;
+    switch (i & 0x3) {
+        case 0x1:
+            if (funct3 == 0x5 || (funct3 == 0x1 && !rv64)) {
+                // c.j, c.jal (RV32 only, c.addiw on RV64)
+                *imm = nexusrv_inst_sext(
+                        ((i >> 12) & 0x1) << 11 | ((i >> 11) & 0x1) << 4 |
+                        ((i >> 9) & 0x3) << 8 | ((i >> 8) & 0x1) << 10 |
+                        ((i >> 7) & 0x1) << 6 | ((i >> 6) & 0x1) << 7 |
+                        ((i >> 3) & 0x7) << 1 | ((i >> 2) & 0x1) << 5, 12);
+                return funct3 == 0x5 ? NEXUSRV_ITYPE_Direct_Jump :
+                                       NEXUSRV_ITYPE_Direct_Call;
+            }
+            if (funct3 == 0x6 || funct3 == 0x7) {
+                // c.beqz, c.bnez
+                *imm = nexusrv_inst_sext(
+                        ((i >> 12) & 0x1) << 8 | ((i >> 10) & 0x3) << 3 |
+                        ((i >> 5) & 0x3) << 6 | ((i >> 3) & 0x3) << 1 |
+                        ((i >> 2) & 0x1) << 5, 9);
+                return NEXUSRV_ITYPE_Cond_Branch;
+            }
+            return NEXUSRV_ITYPE_None;
+        case 0x2:
+            if (funct3 != 0x4 || rs2)
+                return NEXUSRV_ITYPE_None;
+            if (!(i & 0x1000))
+                // c.jr
+                return rs1 ? nexusrv_inst_cjr_types(rs1) : NEXUSRV_ITYPE_None;
+            // c.ebreak, c.jalr
+            return rs1 ? nexusrv_inst_cjalr_types(rs1) :
+                         NEXUSRV_ITYPE_Exception;
+        default:
+            return NEXUSRV_ITYPE_None;
+    }
+}
+
+static inline enum nexusrv_itypes nexusrv_inst_decode32(uint32_t i,
+                                                        int64_t *imm) {
+    unsigned rd = (i >> 7) & 0x1f;
+    unsigned funct3 = (i >> 12) & 0x7;
+    unsigned rs1 = (i >> 15) & 0x1f;
+    switch (i & 0x7f) {
+        case 0x63:
+            // BRANCH, funct3 2 and 3 are reserved
+            if (funct3 == 0x2 || funct3 == 0x3)
+                return NEXUSRV_ITYPE_None;
+            *imm = nexusrv_inst_sext(
+                    ((i >> 31) & 0x1) << 12 | ((i >> 7) & 0x1) << 11 |
+                    ((i >> 25) & 0x3f) << 5 | ((i >> 8) & 0xf) << 1, 13);
+            return NEXUSRV_ITYPE_Cond_Branch;
+        case 0x6f:
+            *imm = nexusrv_inst_sext(
+                    ((i >> 31) & 0x1) << 20 | ((i >> 12) & 0xff) << 12 |
+                    ((i >> 20) & 0x1) << 11 | ((i >> 21) & 0x3ff) << 1, 21);
+            return nexusrv_inst_jal_types(rd);
+        case 0x67:
+            if (funct3)
+                return NEXUSRV_ITYPE_None;
+            return nexusrv_inst_jalr_types(rd, rs1);
+        case 0x73:
+            switch (i) {
+                case 0x00000073: // ecall
+                case 0x00100073: // ebreak
+                    return NEXUSRV_ITYPE_Exception;
+                case 0x00200073: // uret
+                case 0x10200073: // sret
+                case 0x30200073: // mret
+                case 0x70200073: // mnret (Smrnmi)
+                case 0x7b200073: // dret (Sdext)
+                    return NEXUSRV_ITYPE_Trap_Return;
+            }
+            return NEXUSRV_ITYPE_None;
+        default:
+            return NEXUSRV_ITYPE_None;
+    }
+}
+
+/** @brief Decode the instruction length and control-flow type
+ *
+ * Only the bits relevant to control-flow are decoded, so instructions
+ * of any extension are handled, as long as the length encoding is
+ * standard. Instructions other than control-flow are NEXUSRV_ITYPE_None.
+ *
+ * @param [in] buf The instruction bytes
+ * @param len Bytes available in \p buf
+ * @param rv64 Is the instruction RV64?
+ * @param [out] inst Decoded instruction
+ * @return Length of the instruction, 0 if \p buf is truncated or
+ *   the length encoding is reserved
+ */
+static inline unsigned nexusrv_inst_decode(const uint8_t *buf, size_t len,
+                                           bool rv64, nexusrv_inst *inst) {
+    inst->len = 0;
+    inst->itype = NEXUSRV_ITYPE_None;
+    inst->imm = 0;
+    if (len < 2)
+        return 0;
+    uint16_t parcel = buf[0] | (uint16_t)buf[1] << 8;
+    unsigned ilen = nexusrv_inst_len(parcel);
+    if (!ilen || len < ilen)
+        return 0;
+    if (ilen == 2)
+        inst->itype = nexusrv_inst_decode16(parcel, rv64, &inst->imm);
+    else if (ilen == 4)
+        inst->itype = nexusrv_inst_decode32(
+                parcel | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24,
+                &inst->imm);
+    inst->len = ilen;
+    return ilen;
+}
+
 #endif
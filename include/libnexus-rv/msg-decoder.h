@@ -183,6 +183,23 @@ static inline size_t nexusrv_msg_decoder_offset(nexusrv_msg_decoder *decoder) {
 ssize_t nexusrv_msg_decoder_next(nexusrv_msg_decoder *decoder,
                                  nexusrv_msg *msg);
 
+/** @brief Reposition the Message decoder to \p offset of the trace file
+ *
+ * The \p offset is in the same unit as nexusrv_msg_decoder_offset, i.e.,
+ * relative to the file position when the decoder was initialized. The
+ * buffered bytes are discarded, and the next nexusrv_msg_decoder_next will
+ * start decoding from \p offset. The caller must ensure \p offset is at
+ * the beginning of a Message (e.g., previously obtained from
+ * nexusrv_msg_decoder_offset).
+ *
+ * @param [in] decoder The decoder context
+ * @param offset The byte offset to seek to
+ * @retval ==0: Success
+ * @retval -nexus_stream_seek_failed:
+ *   if \p decoder.fd is not seekable, error can be retrieved from errno
+ */
+int nexusrv_msg_decoder_seek(nexusrv_msg_decoder *decoder, size_t offset);
+
 /** @brief Get the pointer to the last successfully decoded Message bytes
  *
  * Returns the pointer to bytes of last Message. It must be called after
@@ -12,35 +12,64 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-#define NEXUS_RV_RETSTACK_DEFAULT 32
+/*
+ * The return stack is a linked list of fixed size chunks, from the top
+ * (newest) to the bottom (oldest). All chunks but the top one are full.
+ * Chunks are reference counted, and shared between snapshots. A shared
+ * chunk is never modified, and pushing to a shared top chunk copies it
+ * first. Thus, a snapshot is O(1), and the common bottom part of the
+ * stacks is not duplicated.
+ */
+#define NEXUS_RV_RETSTACK_CHUNK 30
+
+typedef struct nexusrv_retstack_chunk {
+    struct nexusrv_retstack_chunk *parent;
+    unsigned refcount;
+    uint64_t entries[NEXUS_RV_RETSTACK_CHUNK];
+} nexusrv_retstack_chunk;
 
 typedef struct nexusrv_return_stack {
-    uint64_t *entries;
-    unsigned size;
-    unsigned max;
+    nexusrv_retstack_chunk *top;
+    unsigned top_used;
     unsigned used;
-    unsigned end;
+    unsigned max;
 } nexusrv_return_stack;
 
+static inline void nexusrv_retstack_chunk_get(nexusrv_retstack_chunk *chunk) {
+    if (chunk)
+        __atomic_add_fetch(&chunk->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline void nexusrv_retstack_chunk_put(nexusrv_retstack_chunk *chunk) {
+    while (chunk &&
+           !__atomic_sub_fetch(&chunk->refcount, 1, __ATOMIC_ACQ_REL)) {
+        nexusrv_retstack_chunk *parent = chunk->parent;
+        free(chunk);
+        chunk = parent;
+    }
+}
+
 static inline int nexusrv_retstack_init(nexusrv_return_stack *stack,
                                         unsigned max) {
-    stack->end = stack->used = 0;
-    stack->max = stack->size = max;
-    if (max > NEXUS_RV_RETSTACK_DEFAULT)
-        stack->size = NEXUS_RV_RETSTACK_DEFAULT;
-    stack->entries = NULL;
-    if (!stack->size)
-        return 0;
-    stack->entries = (uint64_t*)malloc(
-            sizeof(stack->entries[0]) * stack->size);
-    if (!stack->entries)
-        return -nexus_no_mem;
+    stack->top = NULL;
+    stack->top_used = stack->used = 0;
+    stack->max = max;
     return 0;
 }
 
 static inline void nexusrv_retstack_fini(nexusrv_return_stack *stack) {
-    free(stack->entries);
-    stack->entries = NULL;
+    nexusrv_retstack_chunk_put(stack->top);
+    stack->top = NULL;
+}
+
+/*
+ * Make \p snapshot a copy of \p stack in O(1). The snapshot must be
+ * finalized by nexusrv_retstack_fini.
+ */
+static inline void nexusrv_retstack_snapshot(const nexusrv_return_stack *stack,
+                                             nexusrv_return_stack *snapshot) {
+    *snapshot = *stack;
+    nexusrv_retstack_chunk_get(stack->top);
 }
 
 static inline unsigned nexusrv_retstack_used(nexusrv_return_stack *stack) {
@@ -48,40 +77,41 @@ static inline unsigned nexusrv_retstack_used(nexusrv_return_stack *stack) {
 }
 
 static inline void nexusrv_retstack_clear(nexusrv_return_stack *stack) {
-    stack->used = 0;
-    stack->end = 0;
-}
-
-static inline int nexusrv_retstack_may_enlarge(nexusrv_return_stack *stack) {
-    if (stack->size == stack->max)
-        return 0;
-    assert(stack->used == stack->end);
-    if (stack->used != stack->size)
-        return 0;
-    unsigned newsize = stack->size * 2;
-    if (newsize > stack->max)
-        newsize = stack->max;
-    void *newptr = realloc(stack->entries,
-                           sizeof(stack->entries[0]) * newsize);
-    if (!newptr)
-        return -nexus_no_mem;
-    stack->size = newsize;
-    stack->entries = (uint64_t*)newptr;
-    return 0;
+    nexusrv_retstack_fini(stack);
+    stack->top_used = stack->used = 0;
 }
 
 static inline int nexusrv_retstack_push(nexusrv_return_stack *stack,
                                         uint64_t addr) {
     if (stack->used == stack->max)
         return 0;
-    int rc = nexusrv_retstack_may_enlarge(stack);
-    if (rc < 0)
-        return rc;
-    if (stack->end == stack->size)
-        stack->end = 0;
-    stack->entries[stack->end++] = addr;
-    if (stack->used < stack->size)
-        ++stack->used;
+    nexusrv_retstack_chunk *top = stack->top;
+    if (!top || stack->top_used == NEXUS_RV_RETSTACK_CHUNK) {
+        // Take over the reference of the old top
+        nexusrv_retstack_chunk *chunk = (nexusrv_retstack_chunk*)malloc(
+                sizeof(nexusrv_retstack_chunk));
+        if (!chunk)
+            return -nexus_no_mem;
+        chunk->parent = top;
+        chunk->refcount = 1;
+        stack->top = chunk;
+        stack->top_used = 0;
+    } else if (__atomic_load_n(&top->refcount, __ATOMIC_ACQUIRE) != 1) {
+        // Copy on write
+        nexusrv_retstack_chunk *chunk = (nexusrv_retstack_chunk*)malloc(
+                sizeof(nexusrv_retstack_chunk));
+        if (!chunk)
+            return -nexus_no_mem;
+        chunk->parent = top->parent;
+        chunk->refcount = 1;
+        for (unsigned i = 0; i < stack->top_used; ++i)
+            chunk->entries[i] = top->entries[i];
+        nexusrv_retstack_chunk_get(top->parent);
+        nexusrv_retstack_chunk_put(top);
+        stack->top = chunk;
+    }
+    stack->top->entries[stack->top_used++] = addr;
+    ++stack->used;
     return 0;
 }
 
@@ -89,14 +119,25 @@ static inline int nexusrv_retstack_pop(nexusrv_return_stack *stack,
                                        uint64_t *addr) {
     if (!stack->used)
         return -nexus_trace_retstack_empty;
-    assert(stack->end);
-    *addr = stack->entries[--stack->end];
+    nexusrv_retstack_chunk *top = stack->top;
+    assert(top && stack->top_used);
+    *addr = top->entries[--stack->top_used];
     --stack->used;
-    if (!stack->end && stack->used)
-        stack->end = stack->size;
+    if (stack->top_used)
+        return 0;
+    // Move down to the parent chunk, which is always full
+    stack->top = top->parent;
+    stack->top_used = stack->top ? NEXUS_RV_RETSTACK_CHUNK : 0;
+    if (__atomic_load_n(&top->refcount, __ATOMIC_ACQUIRE) == 1) {
+        // Take over the reference of the parent
+        free(top);
+        return 0;
+    }
+    nexusrv_retstack_chunk_get(stack->top);
+    nexusrv_retstack_chunk_put(top);
     return 0;
 }
 
-#undef NEXUS_RV_RETSTACK_DEFAULT
+#undef NEXUS_RV_RETSTACK_CHUNK
 
 #endif
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * time-base.h - NexusRV timestamp conversion and wraparound tracking
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_TIME_BASE_H
+#define LIBNEXUS_RV_TIME_BASE_H
+
+#include "msg-decoder.h"
+/** @file */
+
+/** @brief Timestamp to nanosecond conversion
+ *
+ * Built once from the HW configuration by nexusrv_time_base_init.
+ * The nanoseconds per tick (10^9 / timer_freq) is kept as an integer
+ * part and a 0.64 fixed-point fractional part, so the conversion is
+ * a multiply and a shift instead of a division.
+ */
+typedef struct nexusrv_time_base {
+    uint64_t mask;      /*!< Mask of TIMESTAMP bits */
+    uint64_t ns_int;    /*!< Integer part of nanoseconds per tick */
+    uint64_t ns_frac;   /*!< Fractional part of nanoseconds per tick */
+    bool normalize;     /*!< Convert ticks to nanoseconds? */
+} nexusrv_time_base;
+
+/** @brief Wraparound tracker of timestamps
+ *
+ * It extends the TIMESTAMP bits wide timestamps into a monotonic 64-bit
+ * timeline, and applies a constant offset (in ticks), e.g., to align the
+ * clocks of different SRCs.
+ */
+typedef struct nexusrv_time_tracker {
+    uint64_t last;      /*!< Last masked timestamp */
+    uint64_t epoch;     /*!< Accumulated wraparounds */
+    int64_t offset;     /*!< Offset in ticks */
+} nexusrv_time_tracker;
+
+/** @brief Initialize the time base from the HW configuration
+ *
+ * @param [out] tb The time base
+ * @param [in] hwcfg HW/Implementation configuration
+ */
+static inline void nexusrv_time_base_init(nexusrv_time_base *tb,
+                                          const nexusrv_hw_cfg *hwcfg) {
+    const uint64_t ns_per_sec = 1000UL * 1000 * 1000;
+    tb->mask = UINT64_MAX;
+    if (hwcfg->ts_bits < 64)
+        tb->mask = ((uint64_t)1 << hwcfg->ts_bits) - 1;
+    tb->normalize = hwcfg->timer_freq != 0;
+    tb->ns_int = tb->ns_frac = 0;
+    if (!tb->normalize)
+        return;
+    uint64_t freq = hwcfg->timer_freq;
+    tb->ns_int = ns_per_sec / freq;
+    // Round up, so whole ns are never lost to truncation
+    unsigned __int128 rem = ns_per_sec % freq;
+    tb->ns_frac = ((rem << 64) + freq - 1) / freq;
+}
+
+/** @brief Convert ticks to nanoseconds (or ticks if no timer frequency)
+ *
+ * The result can exceed the exact value by 1ns only if \p ticks is
+ * beyond 2^64 / timer_freq.
+ *
+ * @param [in] tb The time base
+ * @param ticks Ticks of the timer
+ * @return Nanoseconds
+ */
+static inline uint64_t nexusrv_time_base_ns(const nexusrv_time_base *tb,
+                                            uint64_t ticks) {
+    if (!tb->normalize)
+        return ticks;
+    unsigned __int128 frac = (unsigned __int128)ticks * tb->ns_frac;
+    return ticks * tb->ns_int + (uint64_t)(frac >> 64);
+}
+
+/** @brief Initialize the wraparound tracker
+ *
+ * @param [out] tracker The tracker
+ * @param offset Offset in ticks
+ */
+static inline void nexusrv_time_tracker_init(nexusrv_time_tracker *tracker,
+                                             int64_t offset) {
+    tracker->last = 0;
+    tracker->epoch = 0;
+    tracker->offset = offset;
+}
+
+/** @brief Feed the tracker with a timestamp, and get the extended one
+ *
+ * A timestamp going backward by more than half of the TIMESTAMP range is
+ * considered a wraparound. Smaller steps backward are returned as is.
+ *
+ * @param [in] tb The time base
+ * @param [in,out] tracker The tracker
+ * @param timestamp The timestamp, only the TIMESTAMP bits are used
+ * @return The extended timestamp in ticks, with offset applied
+ */
+static inline uint64_t nexusrv_time_tracker_update(
+        const nexusrv_time_base *tb,
+        nexusrv_time_tracker *tracker, uint64_t timestamp) {
+    timestamp &= tb->mask;
+    if (timestamp < tracker->last &&
+        tracker->last - timestamp > tb->mask / 2)
+        tracker->epoch += tb->mask + 1;
+    tracker->last = timestamp;
+    return tracker->epoch + timestamp + tracker->offset;
+}
+
+/** @brief Restore the tracker to an extended timestamp
+ *
+ * E.g., after repositioning the trace to a previously recorded point.
+ *
+ * @param [in] tb The time base
+ * @param [in,out] tracker The tracker
+ * @param ticks The extended timestamp in ticks, without offset
+ */
+static inline void nexusrv_time_tracker_set(const nexusrv_time_base *tb,
+                                            nexusrv_time_tracker *tracker,
+                                            uint64_t ticks) {
+    tracker->last = ticks & tb->mask;
+    tracker->epoch = ticks - tracker->last;
+}
+
+/** @brief Get the extended timestamp last fed to the tracker
+ *
+ * @param [in] tracker The tracker
+ * @return The extended timestamp in ticks, with offset applied
+ */
+static inline uint64_t nexusrv_time_tracker_ticks(
+        const nexusrv_time_tracker *tracker) {
+    return tracker->epoch + tracker->last + tracker->offset;
+}
+
+#endif
@@ -11,6 +11,7 @@
 #include "msg-decoder.h"
 #include "hist-array.h"
 #include "return-stack.h"
+#include "time-base.h"
 
 /**
  * @file
@@ -129,6 +130,17 @@ typedef struct nexusrv_trace_stop {
     uint8_t evcode : 4;   /*!< EVCODE from NexusRV Message */
 } nexusrv_trace_stop;
 
+/** @brief NexusRV Ownership Event
+ */
+typedef struct nexusrv_trace_ownership {
+    uint64_t context;           /*!< PROCESS.CONTEXT from NexusRV Message */
+    struct {
+        uint8_t fmt : 2;        /*!< PROCESS.FORMAT from NexusRV Message */
+        uint8_t priv : 2;       /*!< PROCESS.PRV from NexusRV Message */
+        uint8_t v : 1;          /*!< PROCESS.V from NexusRV Message */
+    };
+} nexusrv_trace_ownership;
+
 /** @brief NexusRV trace events
  */
 enum nexusrv_trace_events {
@@ -170,6 +182,22 @@ static inline const char
 }
 
 
+/** @brief Message source of the trace decoder
+ *
+ * By default, the trace decoder fetches Messages from its Message decoder.
+ * A custom source can be installed by nexusrv_trace_decoder_set_source to
+ * feed the trace decoder from elsewhere, e.g., Messages demultiplexed from
+ * a funnel stream. The callbacks must behave the same as
+ * nexusrv_msg_decoder_next and nexusrv_msg_decoder_rewind_last.
+ */
+typedef struct nexusrv_trace_msg_source {
+    ssize_t (*next)(void *opaque, nexusrv_msg *msg);
+    /*!< Fetch the next Message, same as nexusrv_msg_decoder_next */
+    void (*rewind_last)(void *opaque);
+    /*!< Return the last Message, same as nexusrv_msg_decoder_rewind_last */
+    void *opaque; /*!< Opaque pointer passed to callbacks */
+} nexusrv_trace_msg_source;
+
 /** @brief NexusRV Trace decoder context
  *
  * This should be initialized by nexusrv_trace_decoder_init
@@ -179,6 +207,8 @@ static inline const char
 typedef struct nexusrv_trace_decoder {
     nexusrv_msg_decoder *msg_decoder;
     /*!< Pointer to Message decoder context */
+    const nexusrv_trace_msg_source *source;
+    /*!< Custom Message source, or NULL to use msg_decoder */
     struct nexusrv_hist_array* res_hists;
     /*!< Accumulated HISTs in ResourceFull Messages */
     uint32_t res_icnt;      /*!< Accumulated I-CNT in ResourceFull Messages */
@@ -188,9 +218,14 @@ typedef struct nexusrv_trace_decoder {
     bool synced;            /*!< Has been synced by SYNC Message? */
     bool msg_present;       /*!< Indicator whether buffered Message is valid */
     nexusrv_msg msg;        /*!< The buffered Message */
+    nexusrv_msg lookahead;  /*!< The Message decoded ahead of msg */
+    ssize_t lookahead_len;  /*!< Length of lookahead, 0 if not present */
     uint64_t full_addr;     /*!< Address tracking */
     uint64_t timestamp;     /*!< Timestamp tracking */
+    nexusrv_time_base time_base;       /*!< Timestamp conversion */
+    nexusrv_time_tracker time_tracker; /*!< Timestamp wraparound tracking */
     nexusrv_return_stack return_stack; /*!< Return stack tracking */
+    uint64_t retired_icnt;  /*!< Total I-CNT retired so far */
 } nexusrv_trace_decoder;
 
 /** @brief Initialize the trace decoder
@@ -198,7 +233,9 @@ typedef struct nexusrv_trace_decoder {
  * The trace decoder will start using the Message decoder \p msg_decoder
  * It'll not keep state of the Message decoder, so the Message decoder
  * can still be invoked out of trace decoder context to handle non-standard
- * Messages or custom Messages the trace decoder can't handle.
+ * Messages or custom Messages the trace decoder can't handle. The trace
+ * decoder may decode one Message ahead, but it's always returned to the
+ * Message decoder before -nexus_msg_unsupported is reported.
  *
  * @param [out] decoder The decoder context
  * @param [in] msg_decoder The Message decoder context
@@ -208,6 +245,22 @@ typedef struct nexusrv_trace_decoder {
 int nexusrv_trace_decoder_init(nexusrv_trace_decoder* decoder,
                                nexusrv_msg_decoder *msg_decoder);
 
+/** @brief Install a custom Message source to the trace decoder
+ *
+ * Once installed, the trace decoder fetches Messages from \p source
+ * instead of its Message decoder. The Message decoder is still used for
+ * the HW configuration. Messages reported as unsupported should then be
+ * consumed from \p source by the caller.
+ *
+ * @param [in] decoder The decoder context
+ * @param [in] source The Message source, or NULL to restore the default
+ */
+static inline void nexusrv_trace_decoder_set_source(
+        nexusrv_trace_decoder* decoder,
+        const nexusrv_trace_msg_source *source) {
+    decoder->source = source;
+}
+
 /** @brief Finialize the trace decoder
  *
  * Memory allocated by the trace decoder will be free'ed
@@ -221,22 +274,43 @@ void nexusrv_trace_decoder_fini(nexusrv_trace_decoder* decoder);
  * Returns the current time tracked by the decoder. The time is the
  * timestamp the last Message was retired. For Messages with hrepeat,
  * effectively it'll be retired (hrepeat + 1) times, and the delta
- * time is divided by (hrepeat + 1).
+ * time is divided by (hrepeat + 1). Wraparounds of the TIMESTAMP bits
+ * are tracked, so the time is monotonic over long traces. The time is
+ * in nanoseconds if timer frequency is known, or in ticks otherwise.
  *
  * @param [in] decoder The decoder context
  * @return The timestamp
  */
 static inline uint64_t nexusrv_trace_time(nexusrv_trace_decoder* decoder) {
-    const nexusrv_hw_cfg *hwcfg = decoder->msg_decoder->hw_cfg;
-    uint64_t time = decoder->timestamp;
-    if (hwcfg->ts_bits < 64)
-        time &= (((uint64_t)1 << hwcfg->ts_bits) - 1);
-    if (hwcfg->timer_freq) {
-        unsigned __int128 normalized = time;
-        normalized *= 1000UL * 1000 * 1000;
-        time = normalized / hwcfg->timer_freq;
-    }
-    return time;
+    return nexusrv_time_base_ns(&decoder->time_base,
+            nexusrv_time_tracker_ticks(&decoder->time_tracker));
+}
+
+/** @brief Set the time offset of the decoder
+ *
+ * The offset is added to the timestamps of the hart, e.g., to align the
+ * timeline of harts with different clocks.
+ *
+ * @param [in] decoder The decoder context
+ * @param offset Offset in ticks
+ */
+static inline void nexusrv_trace_set_time_offset(
+        nexusrv_trace_decoder* decoder, int64_t offset) {
+    decoder->time_tracker.offset = offset;
+}
+
+/** @brief Get the total I-CNT retired by the decoder
+ *
+ * The count is in half-words, and includes the I-CNT retired by both the
+ * pull API and nexusrv_trace_run. I-CNT skipped before the decoder is
+ * synced is not counted.
+ *
+ * @param [in] decoder The decoder context
+ * @return Total I-CNT
+ */
+static inline uint64_t nexusrv_trace_retired_icnt(
+        nexusrv_trace_decoder* decoder) {
+    return decoder->retired_icnt;
 }
 
 /** @brief Get the available I-CNT before needing to fetch new messages
@@ -319,6 +393,27 @@ int nexusrv_trace_pop_ret(nexusrv_trace_decoder* decoder,
 
 unsigned nexusrv_trace_callstack_used(nexusrv_trace_decoder* decoder);
 
+/** @brief Take a snapshot of the return stack
+ *
+ * The snapshot shares the storage with the return stack, and costs O(1).
+ * It must be released by nexusrv_retstack_fini.
+ *
+ * @param [in] decoder The decoder context
+ * @param [out] snapshot The snapshot
+ */
+void nexusrv_trace_callstack_snapshot(nexusrv_trace_decoder* decoder,
+                                      nexusrv_return_stack *snapshot);
+
+/** @brief Restore the return stack from a snapshot
+ *
+ * The \p snapshot is left intact, and can be restored again.
+ *
+ * @param [in] decoder The decoder context
+ * @param [in] snapshot The snapshot
+ */
+void nexusrv_trace_callstack_restore(nexusrv_trace_decoder* decoder,
+                                     const nexusrv_return_stack *snapshot);
+
 /** @brief Get the next indirect branch
  *
  * @param [in] decoder The decoder context
@@ -371,4 +466,60 @@ int nexusrv_trace_next_stop(nexusrv_trace_decoder *decoder,
 void nexusrv_trace_add_timestamp(nexusrv_trace_decoder *decoder,
                                  uint64_t timestamp);
 
+/** @brief Callbacks of the push-style trace decoding
+ *
+ * Each callback is optional, and receives the opaque pointer passed to
+ * nexusrv_trace_run. A callback returns 0 to continue decoding, or any
+ * other value to stop nexusrv_trace_run, which then returns that value.
+ * The timestamp of a Message is retired before invoking the callbacks of
+ * that Message, so nexusrv_trace_time is up to date in the callbacks.
+ */
+typedef struct nexusrv_trace_callbacks {
+    int (*on_retire)(void *opaque, uint32_t icnt);
+    /*!< \p icnt (in half-words) retired without branch taken */
+    int (*on_tnt_bits)(void *opaque, uint32_t bits, unsigned nbits);
+    /*!< \p nbits of TNT, the oldest at bit \p nbits - 1, 1 for taken.
+     * A Direct branch Message is reported as a single taken bit */
+    int (*on_indirect)(void *opaque, const nexusrv_trace_indirect *indirect);
+    /*!< Indirect branch, or Trap. The ownership field is never set,
+     * as Ownership Messages are reported by on_ownership */
+    int (*on_sync)(void *opaque, const nexusrv_trace_sync *sync);
+    /*!< Sync event, the return stack is cleared before the callback */
+    int (*on_stop)(void *opaque, const nexusrv_trace_stop *stop);
+    /*!< Stop event, the decoder is unsynced after the callback */
+    int (*on_error)(void *opaque, const nexusrv_trace_error *error);
+    /*!< Error event, the decoder is unsynced after the callback */
+    int (*on_ownership)(void *opaque, const nexusrv_trace_ownership *owner);
+    /*!< Ownership Message */
+    int (*on_msg)(void *opaque, const nexusrv_msg *msg);
+    /*!< Message unsupported by the trace decoder. If not set, the
+     * Message is skipped with its timestamp retired */
+} nexusrv_trace_callbacks;
+
+/** @brief Run the trace decoder over the whole Message stream
+ *
+ * Push-style alternative to nexusrv_trace_try_retire and the
+ * nexusrv_trace_next_x functions, for callers that only need the events
+ * and do not step through the instructions. The decoder runs its own
+ * loop over the Messages and invokes the callbacks in \p cb. Before the
+ * decoder is synced, Messages other than SYNC are skipped. Without the
+ * knowledge of the program, I-CNT and TNT are reported in the order of
+ * Messages, and branches repeated by RepeatBranch are reported again as
+ * they were.
+ *
+ * The trace decoder must not have any Message pending, i.e., it's either
+ * freshly initialized, or all events have been consumed by the pull API.
+ *
+ * @param [in] decoder The decoder context
+ * @param [in] cb The callbacks
+ * @param [in] opaque Opaque pointer passed to the callbacks
+ * @retval ==0: All Messages have been decoded (EOF)
+ * @retval >0: The non-zero return value of the callback
+ * @retval <0: Error occurred, refer to common errors section, or
+ *   the negative return value of the callback
+ */
+int nexusrv_trace_run(nexusrv_trace_decoder *decoder,
+                      const nexusrv_trace_callbacks *cb,
+                      void *opaque);
+
 #endif
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * trace-index.h - NexusRV trace index and seeking
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_TRACE_INDEX_H
+#define LIBNEXUS_RV_TRACE_INDEX_H
+
+#include <string.h>
+#include "trace-decoder.h"
+
+/**
+ * @file
+ * @brief Index of SYNC Messages for seeking the trace
+ *
+ * The index records every SYNC Message of one SRC along with the
+ * extended timestamp and the total retired I-CNT after it. It's built by
+ * a Message level scan of the trace, which is much cheaper than running
+ * the trace decoder, and can be saved to a sidecar file for reuse.
+ *
+ * Seeking repositions the Message decoder to the closest SYNC before the
+ * target by binary search, then fast-forwards the trace decoder to the
+ * last Sync or Indirect event before the target. The return stack can't
+ * be reconstructed without the program, so if the HW configuration has
+ * a return stack (max_stack != 0), seeking stops at the SYNC instead.
+ */
+
+/** @brief NexusRV Trace index entry
+ */
+typedef struct nexusrv_trace_index_entry {
+    uint64_t offset; /*!< Byte offset of the SYNC Message */
+    uint64_t ticks;  /*!< Extended timestamp after the SYNC, in ticks */
+    uint64_t icnt;   /*!< Total I-CNT retired after the SYNC */
+} nexusrv_trace_index_entry;
+
+/** @brief NexusRV Trace index
+ *
+ * This should be initialized by nexusrv_trace_index_init, and finalized
+ * by nexusrv_trace_index_fini to release resources.
+ */
+typedef struct nexusrv_trace_index {
+    int16_t src;        /*!< SRC filter of the indexed Message decoder */
+    size_t size;        /*!< Number of entries */
+    size_t capacity;    /*!< Allocated entries */
+    nexusrv_trace_index_entry *entries; /*!< Entries sorted by offset */
+} nexusrv_trace_index;
+
+/** @brief Initialize an empty trace index
+ *
+ * @param [out] index The trace index
+ */
+static inline void nexusrv_trace_index_init(nexusrv_trace_index *index) {
+    memset(index, 0, sizeof(*index));
+}
+
+/** @brief Release the entries of the trace index
+ *
+ * @param [in] index The trace index
+ */
+void nexusrv_trace_index_fini(nexusrv_trace_index *index);
+
+/** @brief Build the trace index by scanning the Messages
+ *
+ * The scan starts from the current position of \p msg_decoder, which
+ * should be the beginning of the trace, and stops at EOF. Messages
+ * unsupported by the trace decoder are skipped.
+ *
+ * @param [in,out] index The trace index, entries are appended
+ * @param [in] msg_decoder The Message decoder
+ * @retval >=0: The number of entries in the index
+ * @retval <0: Error occurred, refer to errors of nexusrv_msg_decoder_next
+ */
+ssize_t nexusrv_trace_index_scan(nexusrv_trace_index *index,
+                                 nexusrv_msg_decoder *msg_decoder);
+
+/** @brief Save the trace index to file
+ *
+ * @param [in] index The trace index
+ * @param fd The file descriptor to write to
+ * @retval ==0: Success
+ * @retval -nexus_stream_write_failed:
+ *   if write \p fd has failed, error can be retrieved from errno
+ */
+int nexusrv_trace_index_save(const nexusrv_trace_index *index, int fd);
+
+/** @brief Load the trace index from file
+ *
+ * @param [out] index The trace index, previous entries are released
+ * @param fd The file descriptor to read from
+ * @retval ==0: Success
+ * @retval -nexus_no_mem: Out of memory
+ * @retval -nexus_stream_read_failed:
+ *   if read \p fd has failed, error can be retrieved from errno
+ * @retval -nexus_index_invalid: if the file is not a valid index
+ */
+int nexusrv_trace_index_load(nexusrv_trace_index *index, int fd);
+
+/** @brief Seek the trace decoder to time \p time
+ *
+ * The trace decoder is repositioned to the last Sync or Indirect event
+ * at or before \p time, or the first SYNC of the trace if \p time is
+ * before it. The decoder is then synced, and the next event retires
+ * I-CNT from \p addr. The decoder must use the Message decoder of the
+ * trace, not a custom Message source.
+ *
+ * @param [in] decoder The decoder context
+ * @param [in] index The trace index, or NULL to scan the trace first
+ * @param time Normalized timestamp, same unit as nexusrv_trace_time
+ * @param [out] addr The address to resume decoding from
+ * @retval ==0: Success
+ * @retval -nexus_trace_eof: No SYNC Message in the trace
+ * @retval -nexus_stream_seek_failed: The trace is not seekable
+ * @retval -nexus_index_invalid: \p index is not built for the decoder
+ * @retval <0: Other errors, refer to common errors of trace decoder
+ */
+int nexusrv_trace_seek_time(nexusrv_trace_decoder *decoder,
+                            const nexusrv_trace_index *index,
+                            uint64_t time, uint64_t *addr);
+
+/** @brief Seek the trace decoder to instruction number \p icnt
+ *
+ * Same as nexusrv_trace_seek_time, but the target is the total I-CNT
+ * retired, as reported by nexusrv_trace_retired_icnt.
+ *
+ * @param [in] decoder The decoder context
+ * @param [in] index The trace index, or NULL to scan the trace first
+ * @param icnt Total I-CNT in half-words
+ * @param [out] addr The address to resume decoding from
+ * @return Same as nexusrv_trace_seek_time
+ */
+int nexusrv_trace_seek_icnt(nexusrv_trace_decoder *decoder,
+                            const nexusrv_trace_index *index,
+                            uint64_t icnt, uint64_t *addr);
+
+#endif
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * trace-session.h - NexusRV multi-hart trace session
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_TRACE_SESSION_H
+#define LIBNEXUS_RV_TRACE_SESSION_H
+
+#include "trace-decoder.h"
+
+/**
+ * @file
+ * @brief Trace session for decoding multiple harts in one pass
+ *
+ * A trace session owns one Message decoder for the funnel stream, and one
+ * trace decoder per SRC. Messages read from the funnel are routed to the
+ * per-SRC queues as they are decoded, and never decoded twice. A trace
+ * decoder for a SRC is created when the first Message of that SRC shows
+ * up in the funnel.
+ *
+ * The events of all harts are reported by nexusrv_trace_session_next in
+ * the order of normalized timestamp, by merging the per-SRC event streams
+ * with a heap. The Messages of a SRC are only buffered while waiting for
+ * the next event of another SRC, so the buffering is bounded by the time
+ * skew of the funnel, not the size of the trace.
+ *
+ * The session has no knowledge of the program being traced. I-CNT is
+ * retired greedily, and reported along with the event that follows it.
+ */
+
+/** @brief NexusRV Trace session event
+ */
+typedef struct nexusrv_trace_session_event {
+    uint16_t src;      /*!< SRC (hart) of the event */
+    uint8_t event;     /*!< NEXUSRV_Trace_Event_x */
+    uint32_t icnt;     /*!< I-CNT retired before the event */
+    uint64_t time;     /*!< Normalized timestamp after the event */
+    union {
+        bool taken;    /*!< Direct: branch taken? */
+        nexusrv_trace_indirect indirect; /*!< Indirect, Trap */
+        nexusrv_trace_sync sync;         /*!< Sync */
+        nexusrv_trace_stop stop;         /*!< Stop */
+        nexusrv_trace_error error;       /*!< Error */
+    };
+} nexusrv_trace_session_event;
+
+struct nexusrv_trace_session;
+
+/** @brief Create a trace session
+ *
+ * The \p msg_decoder must not filter SRC, and must not be used by
+ * the caller while the session is alive.
+ *
+ * @param [in] msg_decoder The Message decoder of the funnel stream
+ * @return The trace session, or NULL if out of memory
+ */
+struct nexusrv_trace_session *nexusrv_trace_session_new(
+        nexusrv_msg_decoder *msg_decoder);
+
+/** @brief Free the trace session and its trace decoders
+ *
+ * @param [in] session The trace session
+ */
+void nexusrv_trace_session_free(struct nexusrv_trace_session *session);
+
+/** @brief Get the next event across all harts
+ *
+ * Events are ordered by normalized timestamp, and by SRC for events
+ * having the same timestamp. Messages unsupported by the trace decoder
+ * are skipped, with their timestamps retired. Indirect branches of type
+ * NEXUSRV_Trace_Event_Trap are reported as is, and DirectSync or
+ * IndirectSync are reported as the branch followed by a Sync event.
+ *
+ * @param [in] session The trace session
+ * @param [out] event The next event
+ * @retval >0: Successfully got the event
+ * @retval ==0: No more event in the trace
+ * @retval <0: Error occurred, refer to common errors of trace decoder
+ */
+int nexusrv_trace_session_next(struct nexusrv_trace_session *session,
+                               nexusrv_trace_session_event *event);
+
+/** @brief Get the trace decoder of \p src
+ *
+ * The trace decoder is owned by the session, and can be used to query
+ * the return stack or timestamp of the hart. It must not be used to
+ * consume events.
+ *
+ * @param [in] session The trace session
+ * @param src The SRC (hart)
+ * @return The trace decoder, or NULL if \p src hasn't appeared yet
+ */
+nexusrv_trace_decoder *nexusrv_trace_session_decoder(
+        struct nexusrv_trace_session *session, uint16_t src);
+
+/** @brief Set the time offset of \p src
+ *
+ * The offset is added to the timestamps of \p src before merging, to
+ * align the timeline of harts with different clocks. It should be set
+ * before getting the first event.
+ *
+ * @param [in] session The trace session
+ * @param src The SRC (hart)
+ * @param offset Offset in ticks
+ */
+void nexusrv_trace_session_set_time_offset(
+        struct nexusrv_trace_session *session, uint16_t src, int64_t offset);
+
+/** @brief Get the number of Messages buffered in the session
+ *
+ * @param [in] session The trace session
+ * @return The number of Messages routed, but not yet consumed
+ */
+size_t nexusrv_trace_session_buffered(struct nexusrv_trace_session *session);
+
+#endif
@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * event-stream.c - Binary stream of replayed trace events
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <assert.h>
+#include <libnexus-rv/error.h>
+#include <libnexus-rv/event-stream.h>
+#include "misc.h"
+
+static const char EVSTREAM_MAGIC[7] = "NXRVEVS";
+
+static inline uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+#define PUT_BYTE(VALUE)                         \
+do {                                            \
+    if (pos == limit)                           \
+        return -nexus_stream_truncate;          \
+    buffer[pos++] = (VALUE);                    \
+} while (0)
+
+#define PUT_VAR(VALUE)                          \
+do {                                            \
+    uint64_t value = (VALUE);                   \
+    while (value >= 0x80) {                     \
+        PUT_BYTE(value | 0x80);                 \
+        value >>= 7;                            \
+    }                                           \
+    PUT_BYTE(value);                            \
+} while (0)
+
+#define GET_BYTE(FIELD)                         \
+do {                                            \
+    if (pos == limit)                           \
+        return -nexus_stream_truncate;          \
+    FIELD = buffer[pos++];                      \
+} while (0)
+
+#define GET_VAR(FIELD)                          \
+do {                                            \
+    uint64_t value = 0;                         \
+    uint8_t byte;                               \
+    for (unsigned shift = 0;; shift += 7) {     \
+        if (shift >= 64)                        \
+            return -nexus_evstream_invalid;     \
+        GET_BYTE(byte);                         \
+        value |= (uint64_t)(byte & 0x7f) << shift; \
+        if (!(byte & 0x80))                     \
+            break;                              \
+    }                                           \
+    FIELD = value;                              \
+} while (0)
+
+void nexusrv_evstream_header(uint8_t *buffer) {
+    memcpy(buffer, EVSTREAM_MAGIC, sizeof(EVSTREAM_MAGIC));
+    buffer[sizeof(EVSTREAM_MAGIC)] = NEXUSRV_EVSTREAM_VERSION;
+}
+
+ssize_t nexusrv_evstream_encode(nexusrv_evstream_state *state,
+                                uint8_t *buffer, size_t limit,
+                                const nexusrv_evstream_rec *rec) {
+    size_t pos = 0;
+    if (!rec->type || rec->type > NEXUSRV_Evstream_Error || rec->flags > 0xf)
+        return -nexus_evstream_invalid;
+    PUT_BYTE(rec->type | rec->flags << 4);
+    if (rec->type == NEXUSRV_Evstream_Sync) {
+        PUT_VAR(rec->time);
+        PUT_VAR(rec->addr);
+        PUT_VAR(rec->code);
+        goto done;
+    }
+    PUT_VAR(zigzag(rec->time - state->time));
+    switch (rec->type) {
+        case NEXUSRV_Evstream_Block:
+            PUT_VAR(zigzag(rec->addr - state->addr));
+            PUT_VAR(rec->icnt);
+            PUT_BYTE(rec->kind);
+            PUT_VAR(rec->stack);
+            if (rec->flags & NEXUSRV_EVSTREAM_TARGET)
+                PUT_VAR(zigzag(rec->target - rec->addr));
+            break;
+        case NEXUSRV_Evstream_Partial:
+            PUT_VAR(zigzag(rec->addr - state->addr));
+            PUT_VAR(rec->icnt);
+            break;
+        case NEXUSRV_Evstream_Retire:
+            PUT_VAR(rec->icnt);
+            break;
+        case NEXUSRV_Evstream_TNT:
+            break;
+        case NEXUSRV_Evstream_Indirect:
+            PUT_VAR(zigzag(rec->addr - state->addr));
+            if (rec->flags & NEXUSRV_EVSTREAM_OWNERSHIP) {
+                PUT_VAR(rec->code);
+                PUT_VAR(rec->data);
+            }
+            break;
+        case NEXUSRV_Evstream_Stop:
+            PUT_VAR(rec->code);
+            break;
+        case NEXUSRV_Evstream_Error:
+            PUT_VAR(rec->code);
+            PUT_VAR(rec->data);
+            break;
+    }
+done:
+    state->time = rec->time;
+    switch (rec->type) {
+        case NEXUSRV_Evstream_Block:
+        case NEXUSRV_Evstream_Partial:
+        case NEXUSRV_Evstream_Indirect:
+        case NEXUSRV_Evstream_Sync:
+            state->addr = rec->addr;
+    }
+    return pos;
+}
+
+ssize_t nexusrv_evstream_decode(nexusrv_evstream_state *state,
+                                const uint8_t *buffer, size_t limit,
+                                nexusrv_evstream_rec *rec) {
+    size_t pos = 0;
+    uint8_t byte;
+    uint64_t delta;
+    memset(rec, 0, sizeof(*rec));
+    GET_BYTE(byte);
+    rec->type = byte & 0xf;
+    rec->flags = byte >> 4;
+    if (!rec->type || rec->type > NEXUSRV_Evstream_Error)
+        return -nexus_evstream_invalid;
+    if (rec->type == NEXUSRV_Evstream_Sync) {
+        GET_VAR(rec->time);
+        GET_VAR(rec->addr);
+        GET_VAR(rec->code);
+        goto done;
+    }
+    GET_VAR(delta);
+    rec->time = state->time + unzigzag(delta);
+    switch (rec->type) {
+        case NEXUSRV_Evstream_Block:
+            GET_VAR(delta);
+            rec->addr = state->addr + unzigzag(delta);
+            GET_VAR(rec->icnt);
+            GET_BYTE(rec->kind);
+            GET_VAR(rec->stack);
+            if (rec->flags & NEXUSRV_EVSTREAM_TARGET) {
+                GET_VAR(delta);
+                rec->target = rec->addr + unzigzag(delta);
+            }
+            break;
+        case NEXUSRV_Evstream_Partial:
+            GET_VAR(delta);
+            rec->addr = state->addr + unzigzag(delta);
+            GET_VAR(rec->icnt);
+            break;
+        case NEXUSRV_Evstream_Retire:
+            GET_VAR(rec->icnt);
+            break;
+        case NEXUSRV_Evstream_TNT:
+            break;
+        case NEXUSRV_Evstream_Indirect:
+            GET_VAR(delta);
+            rec->addr = state->addr + unzigzag(delta);
+            if (rec->flags & NEXUSRV_EVSTREAM_OWNERSHIP) {
+                GET_VAR(rec->code);
+                GET_VAR(rec->data);
+            }
+            break;
+        case NEXUSRV_Evstream_Stop:
+            GET_VAR(rec->code);
+            break;
+        case NEXUSRV_Evstream_Error:
+            GET_VAR(rec->code);
+            GET_VAR(rec->data);
+            break;
+    }
+done:
+    state->time = rec->time;
+    switch (rec->type) {
+        case NEXUSRV_Evstream_Block:
+        case NEXUSRV_Evstream_Partial:
+        case NEXUSRV_Evstream_Indirect:
+        case NEXUSRV_Evstream_Sync:
+            state->addr = rec->addr;
+    }
+    return pos;
+}
+
+int nexusrv_evstream_reader_init(nexusrv_evstream_reader *reader, int fd,
+                                 uint8_t *buffer, size_t bufsz) {
+    uint8_t header[NEXUSRV_EVSTREAM_HEADER];
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->buffer = buffer;
+    reader->bufsz = bufsz;
+    nexusrv_evstream_state_init(&reader->state);
+    if (bufsz < NEXUSRV_EVSTREAM_MAX_RECORD)
+        return -nexus_buffer_too_small;
+    ssize_t rc = read_all(fd, header, sizeof(header));
+    if (rc < 0)
+        return -nexus_stream_read_failed;
+    if ((size_t)rc != sizeof(header) ||
+        memcmp(header, EVSTREAM_MAGIC, sizeof(EVSTREAM_MAGIC)) ||
+        header[sizeof(EVSTREAM_MAGIC)] != NEXUSRV_EVSTREAM_VERSION)
+        return -nexus_evstream_invalid;
+    return 0;
+}
+
+ssize_t nexusrv_evstream_reader_next(nexusrv_evstream_reader *reader,
+                                     nexusrv_evstream_rec *rec) {
+    assert(reader->pos <= reader->filled);
+    assert(reader->filled <= reader->bufsz);
+    for (;;) {
+        if (reader->pos != reader->filled) {
+            ssize_t rc = nexusrv_evstream_decode(
+                    &reader->state, reader->buffer + reader->pos,
+                    reader->filled - reader->pos, rec);
+            if (rc >= 0) {
+                reader->pos += rc;
+                return rc;
+            }
+            if (rc != -nexus_stream_truncate || reader->eof)
+                return rc;
+        } else if (reader->eof)
+            return 0;
+        // Move the partial record to the front, and read more
+        size_t carry = reader->filled - reader->pos;
+        memmove(reader->buffer, reader->buffer + reader->pos, carry);
+        reader->pos = 0;
+        reader->filled = carry;
+        ssize_t rc = read_all(reader->fd, reader->buffer + carry,
+                              reader->bufsz - carry);
+        if (rc < 0)
+            return -nexus_stream_read_failed;
+        reader->filled += rc;
+        if ((size_t)rc < reader->bufsz - carry)
+            reader->eof = true;
+    }
+}
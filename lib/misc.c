@@ -24,4 +24,19 @@ ssize_t read_all(int fd, void *buf, size_t count) {
             break; // Short read
     }
     return buf - orig_buf;
-}
\ No newline at end of file
+}
+
+ssize_t write_all(int fd, const void *buf, size_t count) {
+    const void *orig_buf = buf;
+    while (count) {
+        size_t chunk = MAX_READ_SIZE;
+        if (chunk > count)
+            chunk = count;
+        ssize_t ret = write(fd, buf, chunk); // Chunk != 0
+        if (ret < 0)
+            return ret;
+        buf += ret;
+        count -= ret;
+    }
+    return buf - orig_buf;
+}
@@ -11,5 +11,6 @@
 #include <unistd.h>
 
 ssize_t read_all(int fd, void *buf, size_t count);
+ssize_t write_all(int fd, const void *buf, size_t count);
 
 #endif
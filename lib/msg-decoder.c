@@ -384,6 +384,25 @@ read_buffer:
     return 0;
 }
 
+int nexusrv_msg_decoder_seek(nexusrv_msg_decoder *decoder, size_t offset) {
+    assert(decoder->pos <= decoder->filled);
+    assert(decoder->filled <= decoder->bufsz);
+    // Bytes read from fd so far. pos == filled == bufsz indicates EOF,
+    // where nothing is left in the buffer
+    size_t consumed = decoder->nread;
+    if (decoder->pos != decoder->bufsz)
+        consumed += decoder->filled;
+    off_t cur = lseek(decoder->fd, 0, SEEK_CUR);
+    if (cur < 0 || (size_t)cur < consumed)
+        return -nexus_stream_seek_failed;
+    if (lseek(decoder->fd, cur - consumed + offset, SEEK_SET) < 0)
+        return -nexus_stream_seek_failed;
+    decoder->nread = offset;
+    decoder->filled = decoder->pos = 0;
+    decoder->lastmsg_len = 0;
+    return 0;
+}
+
 uint8_t *nexusrv_msg_decoder_lastmsg(nexusrv_msg_decoder *decoder) {
     assert(decoder->pos <= decoder->filled);
     assert(decoder->filled <= decoder->bufsz);
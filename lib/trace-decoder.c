@@ -10,6 +10,7 @@
 #include <libnexus-rv/error.h>
 #include <libnexus-rv/trace-decoder.h>
 #include <libnexus-rv/hist-array.h>
+#include "trace-internal.h"
 
 static const uint32_t MSG_ICNT_MAX = ((uint32_t)1 << 22) - 1;
 static const uint32_t MSG_HREPEAT_MAX = ((uint32_t)1 << 18) - 1;
@@ -22,10 +23,51 @@ static uint64_t extend_addr_bits(uint64_t addr, unsigned bits) {
     return addr;
 }
 
+static ssize_t nexusrv_trace_source_msg(nexusrv_trace_decoder *decoder,
+                                        nexusrv_msg *msg) {
+    if (decoder->source)
+        return decoder->source->next(decoder->source->opaque, msg);
+    return nexusrv_msg_decoder_next(decoder->msg_decoder, msg);
+}
+
+static ssize_t nexusrv_trace_next_msg(nexusrv_trace_decoder *decoder,
+                                      nexusrv_msg *msg) {
+    if (!decoder->lookahead_len)
+        return nexusrv_trace_source_msg(decoder, msg);
+    ssize_t len = decoder->lookahead_len;
+    *msg = decoder->lookahead;
+    decoder->lookahead_len = 0;
+    return len;
+}
+
+/*
+ * Decode the next Message into the lookahead slot, if not already there
+ * fetched => >0
+ * EOF => 0
+ * error => <0
+ */
+static ssize_t nexusrv_trace_peek_msg(nexusrv_trace_decoder *decoder) {
+    if (decoder->lookahead_len)
+        return decoder->lookahead_len;
+    ssize_t rc = nexusrv_trace_source_msg(decoder, &decoder->lookahead);
+    if (rc > 0)
+        decoder->lookahead_len = rc;
+    return rc;
+}
+
+static void nexusrv_trace_rewind_msg(nexusrv_trace_decoder *decoder) {
+    if (decoder->source)
+        decoder->source->rewind_last(decoder->source->opaque);
+    else
+        nexusrv_msg_decoder_rewind_last(decoder->msg_decoder);
+}
+
 int nexusrv_trace_decoder_init(nexusrv_trace_decoder* decoder,
                                nexusrv_msg_decoder *msg_decoder) {
     memset(decoder, 0, sizeof(*decoder));
     decoder->msg_decoder = msg_decoder;
+    nexusrv_time_base_init(&decoder->time_base, msg_decoder->hw_cfg);
+    nexusrv_time_tracker_init(&decoder->time_tracker, 0);
     decoder->res_hists = nexusrv_hist_array_new();
     if (!decoder->res_hists)
         return -nexus_no_mem;
@@ -41,7 +83,19 @@ void nexusrv_trace_decoder_fini(nexusrv_trace_decoder* decoder) {
     nexusrv_hist_array_free(decoder->res_hists);
 }
 
-static bool nexusrv_trace_check_msg(const nexusrv_msg *msg) {
+void nexusrv_trace_reset(nexusrv_trace_decoder *decoder) {
+    nexusrv_hist_array_clear(decoder->res_hists);
+    decoder->res_icnt = 0;
+    decoder->res_tnts = 0;
+    decoder->consumed_icnt = 0;
+    decoder->consumed_tnts = 0;
+    decoder->synced = 0;
+    decoder->msg_present = 0;
+    decoder->lookahead_len = 0;
+    nexusrv_retstack_clear(&decoder->return_stack);
+}
+
+bool nexusrv_trace_check_msg(const nexusrv_msg *msg) {
     if (!nexusrv_msg_known(msg))
         return false;
     if (nexusrv_msg_is_data_acq(msg))
@@ -63,39 +117,46 @@ static bool nexusrv_trace_check_msg(const nexusrv_msg *msg) {
 static int nexusrv_trace_fetch_msg(nexusrv_trace_decoder *decoder) {
     if (decoder->msg_present)
         return 0;
-    ssize_t rc = nexusrv_msg_decoder_next(decoder->msg_decoder, &decoder->msg);
+    ssize_t rc = nexusrv_trace_next_msg(decoder, &decoder->msg);
     if (rc < 0)
         return rc;
     if (!rc)
         return -nexus_trace_eof;
     if (!nexusrv_trace_check_msg(&decoder->msg)) {
-        nexusrv_msg_decoder_rewind_last(decoder->msg_decoder);
+        // Return it to the source, as the caller will handle it.
+        // The lookahead slot is empty, so it's the last decoded one.
+        nexusrv_trace_rewind_msg(decoder);
         return -nexus_msg_unsupported;
     }
     decoder->msg_present = 1;
     if (!nexusrv_msg_is_branch(&decoder->msg) || nexusrv_msg_is_sync(&decoder->msg))
         return 1;
     decoder->msg.hrepeat = 0;
-    // Try to fetch next msg and see if we have a RepeatBranch
-    nexusrv_msg msg2;
-    rc = nexusrv_msg_decoder_next(decoder->msg_decoder, &msg2);
+    // Peek the next msg and see if we have a RepeatBranch
+    rc = nexusrv_trace_peek_msg(decoder);
     if (rc < 0)
         return rc;
-    if (msg2.tcode != NEXUSRV_TCODE_RepeatBranch) {
-        nexusrv_msg_decoder_rewind_last(decoder->msg_decoder);
-        return 1;
+    if (rc && decoder->lookahead.tcode == NEXUSRV_TCODE_RepeatBranch) {
+        decoder->msg.hrepeat = decoder->lookahead.hrepeat;
+        decoder->lookahead_len = 0;
     }
-    decoder->msg.hrepeat = msg2.hrepeat;
     return 1;
 }
 
+static void nexusrv_trace_set_timestamp(nexusrv_trace_decoder *decoder,
+                                        uint64_t timestamp) {
+    decoder->timestamp = timestamp;
+    nexusrv_time_tracker_update(&decoder->time_base, &decoder->time_tracker,
+                                timestamp);
+}
+
 static void nexusrv_trace_retire_timestamp(nexusrv_trace_decoder *decoder,
                                            uint64_t *timestamp) {
     if (decoder->msg_decoder->hw_cfg->quirk_sifive) {
-        decoder->timestamp ^= *timestamp;
+        nexusrv_trace_set_timestamp(decoder, decoder->timestamp ^ *timestamp);
         *timestamp = 0;
     } else
-        decoder->timestamp += *timestamp;
+        nexusrv_trace_set_timestamp(decoder, decoder->timestamp + *timestamp);
 }
 
 static uint32_t nexusrv_trace_available_tnts(nexusrv_trace_decoder *decoder) {
@@ -170,6 +231,7 @@ static void nexusrv_trace_consume_icnt(nexusrv_trace_decoder *decoder, uint32_t
     assert(nexusrv_trace_available_icnt(decoder) >= icnt);
     // At least res_icnt or consumed_icnt needs to be 0
     assert(!decoder->res_icnt || !decoder->consumed_icnt);
+    decoder->retired_icnt += icnt;
     if (decoder->res_icnt >= icnt) {
         decoder->res_icnt -= icnt;
         return;
@@ -251,7 +313,7 @@ static void nexusrv_trace_retire_msg(nexusrv_trace_decoder *decoder) {
     if (nexusrv_msg_is_branch(&decoder->msg)) {
         if (nexusrv_msg_is_sync(&decoder->msg)) {
             assert(!decoder->msg.hrepeat);
-            decoder->timestamp = decoder->msg.timestamp;
+            nexusrv_trace_set_timestamp(decoder, decoder->msg.timestamp);
             // Downgrade to ProgTraceSync, but do not retire it yet
             decoder->msg.tcode = NEXUSRV_TCODE_ProgTraceSync;
             decoder->msg.icnt = 0;
@@ -266,7 +328,7 @@ static void nexusrv_trace_retire_msg(nexusrv_trace_decoder *decoder) {
         return;
     }
     if (nexusrv_msg_is_sync(&decoder->msg)) {
-        decoder->timestamp = decoder->msg.timestamp;
+        nexusrv_trace_set_timestamp(decoder, decoder->msg.timestamp);
         decoder->full_addr = decoder->msg.xaddr;
         nexusrv_retstack_clear(&decoder->return_stack);
     } else
@@ -401,30 +463,33 @@ unsigned nexusrv_trace_callstack_used(nexusrv_trace_decoder* decoder) {
     return nexusrv_retstack_used(&decoder->return_stack);
 }
 
-int nexusrv_trace_next_indirect(nexusrv_trace_decoder *decoder,
-                                nexusrv_trace_indirect *indir) {
-    if (!decoder->synced)
-        return -nexus_trace_not_synced;
-    int rc = nexusrv_trace_fetch_msg(decoder);
-    if (rc < 0)
-        return rc;
-    if (nexusrv_trace_available_icnt(decoder) ||
-        nexusrv_trace_available_tnts(decoder))
-        return -nexus_trace_mismatch;
-    if (!nexusrv_msg_is_branch(&decoder->msg) ||
-        !nexusrv_msg_is_indir_branch(&decoder->msg))
-        return -nexus_trace_mismatch;
-    if (nexusrv_msg_is_sync(&decoder->msg))
-        decoder->full_addr = decoder->msg.xaddr;
+void nexusrv_trace_callstack_snapshot(nexusrv_trace_decoder* decoder,
+                                      nexusrv_return_stack *snapshot) {
+    nexusrv_retstack_snapshot(&decoder->return_stack, snapshot);
+}
+
+void nexusrv_trace_callstack_restore(nexusrv_trace_decoder* decoder,
+                                     const nexusrv_return_stack *snapshot) {
+    nexusrv_return_stack stack;
+    nexusrv_retstack_snapshot(snapshot, &stack);
+    nexusrv_retstack_fini(&decoder->return_stack);
+    decoder->return_stack = stack;
+}
+
+static void nexusrv_trace_update_indirect(nexusrv_trace_decoder *decoder,
+                                          nexusrv_msg *msg,
+                                          nexusrv_trace_indirect *indir) {
+    if (nexusrv_msg_is_sync(msg))
+        decoder->full_addr = msg->xaddr;
     else {
-        decoder->full_addr ^= decoder->msg.xaddr;
-        decoder->msg.xaddr = 0;
+        decoder->full_addr ^= msg->xaddr;
+        msg->xaddr = 0;
     }
     indir->target = extend_addr_bits(decoder->full_addr << 1,
                                      decoder->msg_decoder->hw_cfg->addr_bits);
     indir->exception = 0;
     indir->interrupt = 0;
-    switch (decoder->msg.branch_type) {
+    switch (msg->branch_type) {
         case 1:
             indir->interrupt = 1;
             __attribute__((fallthrough));
@@ -435,22 +500,36 @@ int nexusrv_trace_next_indirect(nexusrv_trace_decoder *decoder,
             indir->interrupt = 1;
             break;
     }
+}
+
+int nexusrv_trace_next_indirect(nexusrv_trace_decoder *decoder,
+                                nexusrv_trace_indirect *indir) {
+    if (!decoder->synced)
+        return -nexus_trace_not_synced;
+    int rc = nexusrv_trace_fetch_msg(decoder);
+    if (rc < 0)
+        return rc;
+    if (nexusrv_trace_available_icnt(decoder) ||
+        nexusrv_trace_available_tnts(decoder))
+        return -nexus_trace_mismatch;
+    if (!nexusrv_msg_is_branch(&decoder->msg) ||
+        !nexusrv_msg_is_indir_branch(&decoder->msg))
+        return -nexus_trace_mismatch;
+    nexusrv_trace_update_indirect(decoder, &decoder->msg, indir);
     nexusrv_trace_retire_msg(decoder);
     indir->ownership = 0;
-    // Try if the next msg is ownership
-    nexusrv_msg msg2;
-    rc = nexusrv_msg_decoder_next(decoder->msg_decoder, &msg2);
+    // Peek if the next msg is ownership
+    rc = nexusrv_trace_peek_msg(decoder);
     if (rc < 0)
         return rc;
-    if (msg2.tcode != NEXUSRV_TCODE_Ownership) {
-        nexusrv_msg_decoder_rewind_last(decoder->msg_decoder);
+    if (!rc || decoder->lookahead.tcode != NEXUSRV_TCODE_Ownership)
         return 1;
-    }
+    decoder->lookahead_len = 0;
     indir->ownership = 1;
-    indir->ownership_fmt = msg2.ownership_fmt;
-    indir->ownership_priv = msg2.ownership_priv;
-    indir->ownership_v = msg2.ownership_v;
-    indir->context = msg2.context;
+    indir->ownership_fmt = decoder->lookahead.ownership_fmt;
+    indir->ownership_priv = decoder->lookahead.ownership_priv;
+    indir->ownership_v = decoder->lookahead.ownership_v;
+    indir->context = decoder->lookahead.context;
     return 1;
 }
 
@@ -522,4 +601,204 @@ int nexusrv_trace_next_stop(nexusrv_trace_decoder *decoder, nexusrv_trace_stop *
 void nexusrv_trace_add_timestamp(nexusrv_trace_decoder *decoder,
                                  uint64_t timestamp) {
     nexusrv_trace_retire_timestamp(decoder, &timestamp);
-}
\ No newline at end of file
+}
+
+#define NEXUSRV_TRACE_CALLBACK(cb, fn, ...) \
+    ((cb)->fn ? (cb)->fn(__VA_ARGS__) : 0)
+
+static bool nexusrv_trace_run_supported(const nexusrv_msg *msg) {
+    if (!nexusrv_trace_check_msg(msg))
+        return false;
+    switch (msg->tcode) {
+        case NEXUSRV_TCODE_Idle:
+        case NEXUSRV_TCODE_ICT:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static int nexusrv_trace_run_unsupported(nexusrv_trace_decoder *decoder,
+                                         const nexusrv_trace_callbacks *cb,
+                                         void *opaque,
+                                         const nexusrv_msg *msg) {
+    if (cb->on_msg)
+        return cb->on_msg(opaque, msg);
+    nexusrv_trace_add_timestamp(decoder, msg->timestamp);
+    return 0;
+}
+
+static int nexusrv_trace_run_retire(nexusrv_trace_decoder *decoder,
+                                    const nexusrv_trace_callbacks *cb,
+                                    void *opaque, uint32_t icnt) {
+    decoder->retired_icnt += icnt;
+    return NEXUSRV_TRACE_CALLBACK(cb, on_retire, opaque, icnt);
+}
+
+static int nexusrv_trace_run_tnts(const nexusrv_trace_callbacks *cb,
+                                  void *opaque, uint32_t hist) {
+    unsigned nbits = nexusrv_msg_hist_bits(hist);
+    return NEXUSRV_TRACE_CALLBACK(cb, on_tnt_bits, opaque,
+                                  hist & ((1U << nbits) - 1), nbits);
+}
+
+static int nexusrv_trace_run_sync(nexusrv_trace_decoder *decoder,
+                                  const nexusrv_trace_callbacks *cb,
+                                  void *opaque,
+                                  const nexusrv_msg *msg) {
+    nexusrv_trace_sync sync = {};
+    nexusrv_trace_set_timestamp(decoder, msg->timestamp);
+    decoder->full_addr = msg->xaddr;
+    nexusrv_retstack_clear(&decoder->return_stack);
+    sync.sync = msg->sync_type;
+    sync.addr = extend_addr_bits(msg->xaddr << 1,
+                                 decoder->msg_decoder->hw_cfg->addr_bits);
+    return NEXUSRV_TRACE_CALLBACK(cb, on_sync, opaque, &sync);
+}
+
+static int nexusrv_trace_run_res(nexusrv_trace_decoder *decoder,
+                                 const nexusrv_trace_callbacks *cb,
+                                 void *opaque,
+                                 nexusrv_msg *msg) {
+    uint32_t hist = msg->hist;
+    uint32_t repeat = 1;
+    if (nexusrv_msg_has_icnt(msg)) {
+        nexusrv_trace_retire_timestamp(decoder, &msg->timestamp);
+        return nexusrv_trace_run_retire(decoder, cb, opaque, msg->icnt);
+    } else if (nexusrv_msg_has_hist(msg)) {
+        if (msg->hrepeat)
+            repeat = msg->hrepeat;
+    } else if (decoder->msg_decoder->hw_cfg->quirk_sifive &&
+               (msg->res_code == 8 || msg->res_code == 9) &&
+               msg->res_data) {
+        // Sifive quirks
+        hist = msg->res_code == 8 ? 0b10 : 0b11;
+        repeat = msg->res_data;
+    } else
+        return nexusrv_trace_run_unsupported(decoder, cb, opaque, msg);
+    for (uint32_t i = 0; i < repeat; ++i) {
+        nexusrv_trace_retire_timestamp(decoder, &msg->timestamp);
+        int rc = nexusrv_trace_run_tnts(cb, opaque, hist);
+        if (rc)
+            return rc;
+    }
+    return 0;
+}
+
+/*
+ * The branch Message is updated the same way as the pull API does,
+ * so it can be run again by RepeatBranch.
+ */
+static int nexusrv_trace_run_branch(nexusrv_trace_decoder *decoder,
+                                    const nexusrv_trace_callbacks *cb,
+                                    void *opaque,
+                                    nexusrv_msg *msg) {
+    int rc;
+    if (nexusrv_msg_is_sync(msg))
+        nexusrv_trace_set_timestamp(decoder, msg->timestamp);
+    else
+        nexusrv_trace_retire_timestamp(decoder, &msg->timestamp);
+    if (msg->icnt &&
+        (rc = nexusrv_trace_run_retire(decoder, cb, opaque, msg->icnt)))
+        return rc;
+    if (nexusrv_msg_has_hist(msg) &&
+        (rc = nexusrv_trace_run_tnts(cb, opaque, msg->hist)))
+        return rc;
+    if (nexusrv_msg_is_indir_branch(msg)) {
+        nexusrv_trace_indirect indir = {};
+        nexusrv_trace_update_indirect(decoder, msg, &indir);
+        rc = NEXUSRV_TRACE_CALLBACK(cb, on_indirect, opaque, &indir);
+    } else
+        rc = NEXUSRV_TRACE_CALLBACK(cb, on_tnt_bits, opaque, 1, 1);
+    if (rc || !nexusrv_msg_is_sync(msg))
+        return rc;
+    return nexusrv_trace_run_sync(decoder, cb, opaque, msg);
+}
+
+static int nexusrv_trace_run_msg(nexusrv_trace_decoder *decoder,
+                                 const nexusrv_trace_callbacks *cb,
+                                 void *opaque,
+                                 nexusrv_msg *msg) {
+    int rc;
+    if (nexusrv_msg_is_res(msg))
+        return nexusrv_trace_run_res(decoder, cb, opaque, msg);
+    if (nexusrv_msg_is_branch(msg))
+        return nexusrv_trace_run_branch(decoder, cb, opaque, msg);
+    if (nexusrv_msg_is_sync(msg)) {
+        nexusrv_trace_set_timestamp(decoder, msg->timestamp);
+        if (msg->icnt &&
+            (rc = nexusrv_trace_run_retire(decoder, cb, opaque, msg->icnt)))
+            return rc;
+        return nexusrv_trace_run_sync(decoder, cb, opaque, msg);
+    }
+    nexusrv_trace_retire_timestamp(decoder, &msg->timestamp);
+    if (nexusrv_msg_is_error(msg)) {
+        nexusrv_trace_error error = {};
+        error.ecode = msg->error_code;
+        error.etype = msg->error_type;
+        decoder->synced = 0;
+        return NEXUSRV_TRACE_CALLBACK(cb, on_error, opaque, &error);
+    }
+    if (nexusrv_msg_is_stop(msg)) {
+        nexusrv_trace_stop stop = {};
+        if (msg->icnt &&
+            (rc = nexusrv_trace_run_retire(decoder, cb, opaque, msg->icnt)))
+            return rc;
+        if (nexusrv_msg_has_hist(msg) &&
+            (rc = nexusrv_trace_run_tnts(cb, opaque, msg->hist)))
+            return rc;
+        stop.evcode = msg->stop_code;
+        decoder->synced = 0;
+        return NEXUSRV_TRACE_CALLBACK(cb, on_stop, opaque, &stop);
+    }
+    if (msg->tcode == NEXUSRV_TCODE_Ownership) {
+        nexusrv_trace_ownership owner = {};
+        owner.context = msg->context;
+        owner.fmt = msg->ownership_fmt;
+        owner.priv = msg->ownership_priv;
+        owner.v = msg->ownership_v;
+        return NEXUSRV_TRACE_CALLBACK(cb, on_ownership, opaque, &owner);
+    }
+    // Standalone RepeatBranch, nothing to repeat
+    return 0;
+}
+
+int nexusrv_trace_run(nexusrv_trace_decoder *decoder,
+                      const nexusrv_trace_callbacks *cb,
+                      void *opaque) {
+    if (decoder->msg_present || decoder->res_icnt ||
+        nexusrv_hist_array_size(decoder->res_hists))
+        return -nexus_trace_mismatch;
+    nexusrv_msg msg;
+    nexusrv_msg branch;
+    bool repeatable = false;
+    for (;;) {
+        ssize_t len = nexusrv_trace_next_msg(decoder, &msg);
+        if (len <= 0)
+            return len;
+        int rc;
+        if (!nexusrv_trace_run_supported(&msg))
+            rc = nexusrv_trace_run_unsupported(decoder, cb, opaque, &msg);
+        else if (!decoder->synced) {
+            if (!nexusrv_msg_is_sync(&msg))
+                continue;
+            decoder->synced = 1;
+            rc = nexusrv_trace_run_sync(decoder, cb, opaque, &msg);
+        } else if (msg.tcode == NEXUSRV_TCODE_RepeatBranch && repeatable) {
+            // The timestamp of RepeatBranch is dropped, as the pull API does
+            rc = 0;
+            for (uint32_t i = 0; !rc && i < msg.hrepeat; ++i)
+                rc = nexusrv_trace_run_branch(decoder, cb, opaque, &branch);
+        } else if (nexusrv_msg_is_branch(&msg) && !nexusrv_msg_is_sync(&msg)) {
+            branch = msg;
+            rc = nexusrv_trace_run_branch(decoder, cb, opaque, &branch);
+            repeatable = true;
+            goto done_msg;
+        } else
+            rc = nexusrv_trace_run_msg(decoder, cb, opaque, &msg);
+        repeatable = false;
+done_msg:
+        if (rc)
+            return rc;
+    }
+}
@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * trace-index.c - NexusRV trace index and seeking implementation
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <libnexus-rv/error.h>
+#include <libnexus-rv/trace-index.h>
+#include "trace-internal.h"
+#include "misc.h"
+
+static const char INDEX_MAGIC[8] = "NXRVIDX1";
+
+typedef struct nexusrv_trace_index_header {
+    char magic[8];
+    int16_t src;
+    uint16_t reserved[3];
+    uint64_t size;
+} nexusrv_trace_index_header;
+
+/*
+ * Message level replica of the trace decoder states that matter to the
+ * index: sync status, retired I-CNT and timestamp.
+ */
+typedef struct nexusrv_index_scan {
+    const nexusrv_hw_cfg *hw_cfg;
+    nexusrv_time_base time_base;
+    nexusrv_time_tracker time_tracker;
+    uint64_t timestamp;
+    uint64_t icnt;
+    bool synced;
+    bool repeatable;        // Last Message is a branch to repeat
+    nexusrv_msg branch;     // The branch to repeat
+} nexusrv_index_scan;
+
+void nexusrv_trace_index_fini(nexusrv_trace_index *index) {
+    free(index->entries);
+    index->entries = NULL;
+    index->size = index->capacity = 0;
+}
+
+static int nexusrv_trace_index_append(nexusrv_trace_index *index,
+                                      const nexusrv_trace_index_entry *entry) {
+    if (index->size == index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 64;
+        nexusrv_trace_index_entry *entries = realloc(index->entries,
+                capacity * sizeof(*entries));
+        if (!entries)
+            return -nexus_no_mem;
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    index->entries[index->size++] = *entry;
+    return 0;
+}
+
+static void nexusrv_index_scan_set_timestamp(nexusrv_index_scan *scan,
+                                             uint64_t timestamp) {
+    scan->timestamp = timestamp;
+    nexusrv_time_tracker_update(&scan->time_base, &scan->time_tracker,
+                                timestamp);
+}
+
+// Same as nexusrv_trace_retire_timestamp
+static void nexusrv_index_scan_retire_timestamp(nexusrv_index_scan *scan,
+                                                uint64_t *timestamp) {
+    if (scan->hw_cfg->quirk_sifive) {
+        nexusrv_index_scan_set_timestamp(scan, scan->timestamp ^ *timestamp);
+        *timestamp = 0;
+    } else
+        nexusrv_index_scan_set_timestamp(scan, scan->timestamp + *timestamp);
+}
+
+static void nexusrv_index_scan_retire(nexusrv_index_scan *scan,
+                                      nexusrv_msg *msg) {
+    if (nexusrv_msg_has_icnt(msg))
+        scan->icnt += msg->icnt;
+    nexusrv_index_scan_retire_timestamp(scan, &msg->timestamp);
+}
+
+ssize_t nexusrv_trace_index_scan(nexusrv_trace_index *index,
+                                 nexusrv_msg_decoder *msg_decoder) {
+    nexusrv_index_scan scan = {};
+    scan.hw_cfg = msg_decoder->hw_cfg;
+    nexusrv_time_base_init(&scan.time_base, msg_decoder->hw_cfg);
+    nexusrv_time_tracker_init(&scan.time_tracker, 0);
+    index->src = msg_decoder->src_filter;
+    for (;;) {
+        nexusrv_msg msg;
+        ssize_t rc = nexusrv_msg_decoder_next(msg_decoder, &msg);
+        if (rc < 0)
+            return rc;
+        if (!rc)
+            break;
+        bool repeatable = scan.repeatable;
+        scan.repeatable = false;
+        if (!nexusrv_trace_check_msg(&msg)) {
+            nexusrv_index_scan_retire_timestamp(&scan, &msg.timestamp);
+            continue;
+        }
+        if (nexusrv_msg_is_sync(&msg)) {
+            nexusrv_trace_index_entry entry;
+            // I-CNT of the SYNC is dropped if not synced
+            if (scan.synced && nexusrv_msg_has_icnt(&msg))
+                scan.icnt += msg.icnt;
+            nexusrv_index_scan_set_timestamp(&scan, msg.timestamp);
+            scan.synced = true;
+            entry.offset = nexusrv_msg_decoder_offset(msg_decoder);
+            entry.ticks = nexusrv_time_tracker_ticks(&scan.time_tracker);
+            entry.icnt = scan.icnt;
+            int err = nexusrv_trace_index_append(index, &entry);
+            if (err < 0)
+                return err;
+            continue;
+        }
+        if (!scan.synced)
+            continue;
+        if (msg.tcode == NEXUSRV_TCODE_RepeatBranch) {
+            // The branch is retired again hrepeat times
+            for (uint32_t i = 0; repeatable && i < msg.hrepeat; ++i)
+                nexusrv_index_scan_retire(&scan, &scan.branch);
+            continue;
+        }
+        if (nexusrv_msg_is_branch(&msg)) {
+            scan.branch = msg;
+            nexusrv_index_scan_retire(&scan, &scan.branch);
+            scan.repeatable = true;
+            continue;
+        }
+        nexusrv_index_scan_retire(&scan, &msg);
+        if (nexusrv_msg_is_error(&msg) || nexusrv_msg_is_stop(&msg))
+            scan.synced = false;
+    }
+    return index->size;
+}
+
+int nexusrv_trace_index_save(const nexusrv_trace_index *index, int fd) {
+    nexusrv_trace_index_header header = {};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.src = index->src;
+    header.size = index->size;
+    if (write_all(fd, &header, sizeof(header)) != sizeof(header))
+        return -nexus_stream_write_failed;
+    size_t bytes = index->size * sizeof(*index->entries);
+    if (write_all(fd, index->entries, bytes) != (ssize_t)bytes)
+        return -nexus_stream_write_failed;
+    return 0;
+}
+
+int nexusrv_trace_index_load(nexusrv_trace_index *index, int fd) {
+    nexusrv_trace_index_header header;
+    nexusrv_trace_index_fini(index);
+    ssize_t rc = read_all(fd, &header, sizeof(header));
+    if (rc < 0)
+        return -nexus_stream_read_failed;
+    if (rc != sizeof(header) ||
+        memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) ||
+        header.size > SIZE_MAX / sizeof(*index->entries))
+        return -nexus_index_invalid;
+    size_t bytes = header.size * sizeof(*index->entries);
+    index->entries = malloc(bytes ? bytes : 1);
+    if (!index->entries)
+        return -nexus_no_mem;
+    index->capacity = header.size;
+    rc = read_all(fd, index->entries, bytes);
+    if (rc < 0)
+        return -nexus_stream_read_failed;
+    if ((size_t)rc != bytes)
+        return -nexus_index_invalid;
+    for (size_t i = 1; i < header.size; ++i)
+        if (index->entries[i].offset <= index->entries[i - 1].offset)
+            return -nexus_index_invalid;
+    index->src = header.src;
+    index->size = header.size;
+    return 0;
+}
+
+/*
+ * Reposition the decoder to the SYNC of the \p entry
+ */
+static int nexusrv_trace_seek_entry(nexusrv_trace_decoder *decoder,
+                                    const nexusrv_trace_index_entry *entry,
+                                    uint64_t *addr) {
+    nexusrv_trace_sync sync;
+    int rc = nexusrv_msg_decoder_seek(decoder->msg_decoder, entry->offset);
+    if (rc < 0)
+        return rc;
+    nexusrv_trace_reset(decoder);
+    nexusrv_time_tracker_set(&decoder->time_base, &decoder->time_tracker,
+                             entry->ticks);
+    rc = nexusrv_trace_sync_reset(decoder, &sync);
+    if (rc < 0)
+        return rc;
+    decoder->retired_icnt = entry->icnt;
+    *addr = sync.addr;
+    return 0;
+}
+
+/*
+ * Consume the next event without the program
+ * Sync or Indirect event => 1, with the target in \p addr
+ * Other events => 0
+ * error => <0
+ */
+static int nexusrv_trace_skip_event(nexusrv_trace_decoder *decoder,
+                                    uint64_t *addr) {
+    nexusrv_trace_sync sync;
+    nexusrv_trace_indirect indirect;
+    nexusrv_trace_stop stop;
+    nexusrv_trace_error error;
+    unsigned event;
+    int32_t rc = nexusrv_trace_sync_reset(decoder, &sync);
+    if (rc > 0) {
+        *addr = sync.addr;
+        return 1;
+    }
+    if (!rc)
+        rc = nexusrv_trace_try_retire(decoder, INT32_MAX, &event);
+    if (rc == -nexus_msg_unsupported) {
+        nexusrv_msg msg;
+        ssize_t len = nexusrv_msg_decoder_next(decoder->msg_decoder, &msg);
+        if (len < 0)
+            return len;
+        nexusrv_trace_add_timestamp(decoder, msg.timestamp);
+        return 0;
+    }
+    if (rc < 0)
+        return rc;
+    switch (event) {
+        case NEXUSRV_Trace_Event_Direct:
+        case NEXUSRV_Trace_Event_DirectSync:
+            rc = nexusrv_trace_next_tnt(decoder);
+            return rc < 0 ? rc : 0;
+        case NEXUSRV_Trace_Event_Indirect:
+        case NEXUSRV_Trace_Event_IndirectSync:
+        case NEXUSRV_Trace_Event_Trap:
+            rc = nexusrv_trace_next_indirect(decoder, &indirect);
+            if (rc < 0)
+                return rc;
+            *addr = indirect.target;
+            return 1;
+        case NEXUSRV_Trace_Event_Sync:
+            rc = nexusrv_trace_next_sync(decoder, &sync);
+            if (rc < 0)
+                return rc;
+            *addr = sync.addr;
+            return 1;
+        case NEXUSRV_Trace_Event_Stop:
+            rc = nexusrv_trace_next_stop(decoder, &stop);
+            return rc < 0 ? rc : 0;
+        case NEXUSRV_Trace_Event_Error:
+            rc = nexusrv_trace_next_error(decoder, &error);
+            return rc < 0 ? rc : 0;
+        default:
+            if (!rc) {
+                // The buffered Message carries no event (e.g., Ownership)
+                nexusrv_trace_add_timestamp(decoder, decoder->msg.timestamp);
+                decoder->msg_present = 0;
+            }
+            return 0;
+    }
+}
+
+static uint64_t nexusrv_trace_seek_key(nexusrv_trace_decoder *decoder,
+                                       bool by_icnt) {
+    return by_icnt ? nexusrv_trace_retired_icnt(decoder) :
+                     nexusrv_trace_time(decoder);
+}
+
+static uint64_t nexusrv_trace_index_key(nexusrv_trace_decoder *decoder,
+                                        const nexusrv_trace_index_entry *entry,
+                                        bool by_icnt) {
+    return by_icnt ? entry->icnt : nexusrv_time_base_ns(&decoder->time_base,
+            entry->ticks + decoder->time_tracker.offset);
+}
+
+static int nexusrv_trace_seek(nexusrv_trace_decoder *decoder,
+                              const nexusrv_trace_index *index,
+                              bool by_icnt, uint64_t target, uint64_t *addr) {
+    nexusrv_trace_index scanned;
+    int rc = 0;
+    if (decoder->source)
+        return -nexus_stream_seek_failed;
+    nexusrv_trace_index_init(&scanned);
+    if (!index) {
+        rc = nexusrv_msg_decoder_seek(decoder->msg_decoder, 0);
+        if (rc >= 0) {
+            ssize_t scanned_rc = nexusrv_trace_index_scan(
+                    &scanned, decoder->msg_decoder);
+            if (scanned_rc < 0)
+                rc = scanned_rc;
+        }
+        if (rc < 0)
+            goto out;
+        index = &scanned;
+    } else if (index->src != decoder->msg_decoder->src_filter) {
+        rc = -nexus_index_invalid;
+        goto out;
+    }
+    if (!index->size) {
+        rc = -nexus_trace_eof;
+        goto out;
+    }
+    // Find the last SYNC at or before the target
+    size_t lo = 0, hi = index->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (nexusrv_trace_index_key(decoder, &index->entries[mid],
+                                    by_icnt) <= target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    const nexusrv_trace_index_entry *entry = &index->entries[lo ? lo - 1 : 0];
+    rc = nexusrv_trace_seek_entry(decoder, entry, addr);
+    // With a return stack, stop at the SYNC, as the stack can't be
+    // rebuilt at an Indirect event without the program
+    if (rc < 0 || decoder->msg_decoder->hw_cfg->max_stack)
+        goto out;
+    // Count the events to skip, then replay them again from the SYNC,
+    // as the trace decoder can't be stopped after the target is passed
+    size_t skip = 0;
+    for (;;) {
+        uint64_t target_addr;
+        rc = nexusrv_trace_skip_event(decoder, &target_addr);
+        if (rc < 0 ||
+            nexusrv_trace_seek_key(decoder, by_icnt) > target)
+            break;
+        if (rc)
+            ++skip;
+    }
+    if (rc < 0 && rc != -nexus_trace_eof)
+        goto out;
+    rc = nexusrv_trace_seek_entry(decoder, entry, addr);
+    while (rc >= 0 && skip) {
+        rc = nexusrv_trace_skip_event(decoder, addr);
+        if (rc > 0)
+            --skip;
+    }
+    if (rc > 0)
+        rc = 0;
+out:
+    nexusrv_trace_index_fini(&scanned);
+    return rc;
+}
+
+int nexusrv_trace_seek_time(nexusrv_trace_decoder *decoder,
+                            const nexusrv_trace_index *index,
+                            uint64_t time, uint64_t *addr) {
+    return nexusrv_trace_seek(decoder, index, false, time, addr);
+}
+
+int nexusrv_trace_seek_icnt(nexusrv_trace_decoder *decoder,
+                            const nexusrv_trace_index *index,
+                            uint64_t icnt, uint64_t *addr) {
+    return nexusrv_trace_seek(decoder, index, true, icnt, addr);
+}
@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_LIB_TRACE_INTERNAL_H
+#define LIBNEXUS_RV_LIB_TRACE_INTERNAL_H
+
+#include <libnexus-rv/trace-decoder.h>
+
+// Is the Message handled by the trace decoder?
+bool nexusrv_trace_check_msg(const nexusrv_msg *msg);
+
+// Drop all pending Messages and states, and make the decoder unsynced
+void nexusrv_trace_reset(nexusrv_trace_decoder *decoder);
+
+#endif
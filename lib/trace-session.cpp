@@ -0,0 +1,347 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * trace-session.cpp - NexusRV multi-hart trace session implementation
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <deque>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <cstring>
+extern "C" {
+#include <libnexus-rv/error.h>
+#include <libnexus-rv/trace-session.h>
+}
+
+struct queued_msg {
+    nexusrv_msg msg;
+    ssize_t len;
+};
+
+struct session_stream {
+    struct nexusrv_trace_session *session;
+    uint16_t src;
+    bool initialized;
+    bool rewound;       // last is returned to the stream
+    bool partial;       // head is partially fetched before an error
+    queued_msg last;
+    std::deque<queued_msg> queue;
+    nexusrv_trace_msg_source source;
+    nexusrv_trace_decoder decoder;
+    nexusrv_trace_session_event head;
+
+    ~session_stream() {
+        if (initialized)
+            nexusrv_trace_decoder_fini(&decoder);
+    }
+};
+
+struct stream_later {
+    bool operator()(const session_stream *a, const session_stream *b) const {
+        if (a->head.time != b->head.time)
+            return a->head.time > b->head.time;
+        return a->src > b->src;
+    }
+};
+
+struct nexusrv_trace_session {
+    nexusrv_msg_decoder *msg_decoder;
+    std::vector<std::unique_ptr<session_stream>> streams; // Indexed by SRC
+    std::vector<int64_t> time_offsets; // Indexed by SRC
+    std::vector<session_stream *> discovered; // Streams without head yet
+    std::priority_queue<session_stream *,
+                        std::vector<session_stream *>,
+                        stream_later> heap;
+    session_stream *refill; // Stream whose head was just consumed
+    size_t buffered;
+    bool eof;
+};
+
+static ssize_t stream_next_msg(void *opaque, nexusrv_msg *msg);
+static void stream_rewind_msg(void *opaque);
+
+static int session_add_stream(nexusrv_trace_session *session, uint16_t src,
+                              session_stream **stream) {
+    if (src >= session->streams.size())
+        return -nexus_msg_invalid;
+    __try {
+        std::unique_ptr<session_stream> s = std::make_unique<session_stream>();
+        s->session = session;
+        s->src = src;
+        s->source.next = stream_next_msg;
+        s->source.rewind_last = stream_rewind_msg;
+        s->source.opaque = s.get();
+        int rc = nexusrv_trace_decoder_init(&s->decoder,
+                                            session->msg_decoder);
+        if (rc < 0) {
+            nexusrv_trace_decoder_fini(&s->decoder);
+            return rc;
+        }
+        s->initialized = true;
+        nexusrv_trace_decoder_set_source(&s->decoder, &s->source);
+        nexusrv_trace_set_time_offset(&s->decoder,
+                                      session->time_offsets[src]);
+        session->discovered.push_back(s.get());
+        *stream = s.get();
+        session->streams[src] = std::move(s);
+        return 0;
+    } __catch(const std::bad_alloc&) {
+        return -nexus_no_mem;
+    }
+}
+
+/*
+ * Pull Messages from the funnel, and queue them to their streams,
+ * until we get one for SRC \p want (or any SRC if negative).
+ */
+static ssize_t session_route(nexusrv_trace_session *session, int want,
+                             nexusrv_msg *msg) {
+    for (;;) {
+        if (session->eof)
+            return 0;
+        ssize_t rc = nexusrv_msg_decoder_next(session->msg_decoder, msg);
+        if (rc < 0)
+            return rc;
+        if (!rc) {
+            session->eof = true;
+            return 0;
+        }
+        if (!nexusrv_msg_has_src(msg))
+            continue;
+        if (msg->src == want)
+            return rc;
+        session_stream *stream = nullptr;
+        if (msg->src < session->streams.size())
+            stream = session->streams[msg->src].get();
+        if (!stream) {
+            int err = session_add_stream(session, msg->src, &stream);
+            if (err < 0)
+                return err;
+        }
+        __try {
+            stream->queue.push_back({*msg, rc});
+        } __catch(const std::bad_alloc&) {
+            return -nexus_no_mem;
+        }
+        ++session->buffered;
+        if (want < 0)
+            return rc;
+    }
+}
+
+static ssize_t stream_next_msg(void *opaque, nexusrv_msg *msg) {
+    session_stream *stream = static_cast<session_stream *>(opaque);
+    if (stream->rewound) {
+        stream->rewound = false;
+        *msg = stream->last.msg;
+        return stream->last.len;
+    }
+    ssize_t rc;
+    if (!stream->queue.empty()) {
+        *msg = stream->queue.front().msg;
+        rc = stream->queue.front().len;
+        stream->queue.pop_front();
+        --stream->session->buffered;
+    } else {
+        rc = session_route(stream->session, stream->src, msg);
+        if (rc <= 0) {
+            stream->last.len = 0;
+            return rc;
+        }
+    }
+    stream->last = {*msg, rc};
+    return rc;
+}
+
+static void stream_rewind_msg(void *opaque) {
+    session_stream *stream = static_cast<session_stream *>(opaque);
+    if (stream->last.len)
+        stream->rewound = true;
+}
+
+/*
+ * Decode the next event of the stream into its head
+ * fetched => 1
+ * end of stream => 0
+ * error => <0
+ */
+static int stream_fetch(session_stream *stream) {
+    nexusrv_trace_decoder *decoder = &stream->decoder;
+    nexusrv_trace_session_event *ev = &stream->head;
+    // Resumed after an error, keep the I-CNT retired so far
+    if (!stream->partial) {
+        memset(ev, 0, sizeof(*ev));
+        ev->src = stream->src;
+        stream->partial = true;
+    }
+    for (;;) {
+        unsigned event;
+        nexusrv_msg msg;
+        int32_t rc = nexusrv_trace_sync_reset(decoder, &ev->sync);
+        if (rc > 0) {
+            ev->event = NEXUSRV_Trace_Event_Sync;
+            break;
+        }
+        if (!rc)
+            rc = nexusrv_trace_try_retire(decoder, UINT32_MAX, &event);
+        if (rc == -nexus_msg_unsupported) {
+            // Skip the Message, but keep its timestamp
+            ssize_t len = stream_next_msg(stream, &msg);
+            if (len < 0)
+                return len;
+            nexusrv_trace_add_timestamp(decoder, msg.timestamp);
+            continue;
+        }
+        if (rc == -nexus_trace_eof) {
+            stream->partial = false;
+            return 0;
+        }
+        if (rc < 0)
+            return rc;
+        ev->icnt += rc;
+        ev->event = event;
+        switch (event) {
+            case NEXUSRV_Trace_Event_Direct:
+            case NEXUSRV_Trace_Event_DirectSync:
+                rc = nexusrv_trace_next_tnt(decoder);
+                ev->event = NEXUSRV_Trace_Event_Direct;
+                ev->taken = rc > 0;
+                break;
+            case NEXUSRV_Trace_Event_Indirect:
+            case NEXUSRV_Trace_Event_IndirectSync:
+                ev->event = NEXUSRV_Trace_Event_Indirect;
+                __attribute__((fallthrough));
+            case NEXUSRV_Trace_Event_Trap:
+                rc = nexusrv_trace_next_indirect(decoder, &ev->indirect);
+                break;
+            case NEXUSRV_Trace_Event_Sync:
+                rc = nexusrv_trace_next_sync(decoder, &ev->sync);
+                break;
+            case NEXUSRV_Trace_Event_Stop:
+                rc = nexusrv_trace_next_stop(decoder, &ev->stop);
+                break;
+            case NEXUSRV_Trace_Event_Error:
+                rc = nexusrv_trace_next_error(decoder, &ev->error);
+                break;
+            default:
+                if (rc)
+                    continue;
+                // The buffered Message carries no event (e.g., Ownership)
+                nexusrv_trace_add_timestamp(decoder, decoder->msg.timestamp);
+                decoder->msg_present = 0;
+                continue;
+        }
+        if (rc < 0)
+            return rc;
+        break;
+    }
+    ev->time = nexusrv_trace_time(decoder);
+    stream->partial = false;
+    return 1;
+}
+
+static int session_fill_heads(nexusrv_trace_session *session) {
+    /*
+     * A stream is only taken off refill or discovered once its head is
+     * fetched, or it's ended, so a retry after an error resumes it.
+     * The heap has room for all streams, and push doesn't throw.
+     */
+    if (session->refill) {
+        session_stream *stream = session->refill;
+        int rc = stream_fetch(stream);
+        if (rc < 0)
+            return rc;
+        session->refill = nullptr;
+        if (rc)
+            session->heap.push(stream);
+    }
+    // Fetching a head may discover more streams
+    while (!session->discovered.empty()) {
+        session_stream *stream = session->discovered.front();
+        int rc = stream_fetch(stream);
+        if (rc < 0)
+            return rc;
+        session->discovered.erase(session->discovered.begin());
+        if (rc)
+            session->heap.push(stream);
+    }
+    return 0;
+}
+
+extern "C" {
+
+struct nexusrv_trace_session *nexusrv_trace_session_new(
+        nexusrv_msg_decoder *msg_decoder) {
+    __try {
+        std::unique_ptr<nexusrv_trace_session> session =
+                std::make_unique<nexusrv_trace_session>();
+        session->msg_decoder = msg_decoder;
+        session->streams.resize((size_t)1 << msg_decoder->hw_cfg->src_bits);
+        session->time_offsets.resize(session->streams.size());
+        std::vector<session_stream *> heap;
+        heap.reserve(session->streams.size());
+        session->heap = decltype(session->heap)(stream_later(),
+                                                std::move(heap));
+        session->refill = nullptr;
+        session->buffered = 0;
+        session->eof = false;
+        return session.release();
+    } __catch(const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void nexusrv_trace_session_free(struct nexusrv_trace_session *session) {
+    delete session;
+}
+
+int nexusrv_trace_session_next(struct nexusrv_trace_session *session,
+                               nexusrv_trace_session_event *event) {
+    for (;;) {
+        int rc;
+        __try {
+            rc = session_fill_heads(session);
+        } __catch(const std::bad_alloc&) {
+            rc = -nexus_no_mem;
+        }
+        if (rc < 0)
+            return rc;
+        if (!session->heap.empty())
+            break;
+        if (session->eof)
+            return 0;
+        // No stream discovered yet
+        nexusrv_msg msg;
+        ssize_t len = session_route(session, -1, &msg);
+        if (len < 0)
+            return len;
+    }
+    session_stream *stream = session->heap.top();
+    session->heap.pop();
+    *event = stream->head;
+    session->refill = stream;
+    return 1;
+}
+
+nexusrv_trace_decoder *nexusrv_trace_session_decoder(
+        struct nexusrv_trace_session *session, uint16_t src) {
+    if (src >= session->streams.size() || !session->streams[src])
+        return nullptr;
+    return &session->streams[src]->decoder;
+}
+
+void nexusrv_trace_session_set_time_offset(
+        struct nexusrv_trace_session *session, uint16_t src, int64_t offset) {
+    if (src >= session->time_offsets.size())
+        return;
+    session->time_offsets[src] = offset;
+    if (session->streams[src])
+        nexusrv_trace_set_time_offset(&session->streams[src]->decoder, offset);
+}
+
+size_t nexusrv_trace_session_buffered(struct nexusrv_trace_session *session) {
+    return session->buffered;
+}
+}
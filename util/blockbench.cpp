@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * blockbench.cpp - Lookup cost of rv_block_table vs. unordered_map
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <error.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include "blocktable.h"
+
+using namespace std;
+
+/*
+ * Kernel-like PC stream: functions in kernel text, each made of a few
+ * 2-byte aligned blocks. Functions are picked with a Zipf distribution,
+ * and their blocks are walked in order, as a retired trace does.
+ */
+struct pc_stream {
+    vector<uint64_t> blocks;
+    vector<size_t> func_first;  // first block of each function, and the end
+    vector<uint64_t> pcs;
+};
+
+static pc_stream make_stream(size_t nfuncs, size_t nlookups, unsigned seed) {
+    pc_stream s;
+    mt19937_64 rng(seed);
+    uint64_t pc = 0xffffffff80000000ULL;
+    for (size_t f = 0; f < nfuncs; ++f) {
+        s.func_first.push_back(s.blocks.size());
+        size_t nblocks = 2 + rng() % 12;
+        for (size_t b = 0; b < nblocks; ++b) {
+            s.blocks.push_back(pc);
+            pc += 2 * (1 + rng() % 16);
+        }
+        // Functions are 16-byte aligned
+        pc = (pc + 15) & ~15ULL;
+    }
+    s.func_first.push_back(s.blocks.size());
+    // Zipf with s = 1 over functions, hot ones scattered over the text
+    vector<double> cdf(nfuncs);
+    double sum = 0;
+    for (size_t f = 0; f < nfuncs; ++f)
+        cdf[f] = sum += 1.0 / (f + 1);
+    vector<size_t> rank(nfuncs);
+    for (size_t f = 0; f < nfuncs; ++f)
+        rank[f] = f;
+    shuffle(rank.begin(), rank.end(), rng);
+    uniform_real_distribution<double> dist(0, sum);
+    while (s.pcs.size() < nlookups) {
+        size_t r = lower_bound(cdf.begin(), cdf.end(), dist(rng)) - cdf.begin();
+        size_t f = rank[min(r, nfuncs - 1)];
+        for (size_t b = s.func_first[f];
+             b < s.func_first[f + 1] && s.pcs.size() < nlookups; ++b)
+            s.pcs.push_back(s.blocks[b]);
+    }
+    return s;
+}
+
+template <typename F>
+static double ns_per_lookup(const vector<uint64_t> &pcs, F lookup) {
+    uint64_t sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (auto pc : pcs)
+        sum += lookup(pc);
+    auto end = chrono::steady_clock::now();
+    // Keep the lookups from being optimized away
+    if (sum == 42)
+        fputc('\0', stderr);
+    return chrono::duration<double, nano>(end - start).count() / pcs.size();
+}
+
+// Hit rate of the direct-mapped front cache of rv_block_table
+static double front_hit_rate(const vector<uint64_t> &pcs) {
+    vector<uint64_t> front(rv_block_table::front_size, 0);
+    size_t hits = 0;
+    for (auto pc : pcs) {
+        auto &slot = front[(pc >> 1) & (rv_block_table::front_size - 1)];
+        if (slot == pc)
+            ++hits;
+        slot = pc;
+    }
+    return 100.0 * hits / pcs.size();
+}
+
+int main(int argc, char **argv) {
+    size_t nfuncs = 30000;
+    size_t nlookups = 20000000;
+    if (argc > 1)
+        nfuncs = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        nlookups = strtoul(argv[2], NULL, 0);
+    if (!nfuncs || !nlookups)
+        error(-1, 0, "Usage: %s [functions] [lookups]", argv[0]);
+    auto s = make_stream(nfuncs, nlookups, 1);
+    rv_block_table table;
+    unordered_map<uint64_t, uint32_t> map;
+    for (size_t i = 0; i < s.blocks.size(); ++i) {
+        table.insert(s.blocks[i], i);
+        map.emplace(s.blocks[i], i);
+    }
+    printf("%zu functions, %zu blocks, %zu lookups\n",
+           nfuncs, s.blocks.size(), s.pcs.size());
+    printf("front cache hit rate:  %.1f%%\n", front_hit_rate(s.pcs));
+    // Warm up both, then measure
+    for (int pass = 0; pass < 2; ++pass) {
+        double t = ns_per_lookup(s.pcs, [&](uint64_t pc) {
+            return table.find(pc);
+        });
+        double m = ns_per_lookup(s.pcs, [&](uint64_t pc) {
+            return map.find(pc)->second;
+        });
+        if (pass)
+            printf("rv_block_table:        %.2f ns/lookup\n"
+                   "unordered_map:         %.2f ns/lookup\n", t, m);
+    }
+    return 0;
+}
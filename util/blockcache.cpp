@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * blockcache.cpp - Persistent instruction block cache
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <error.h>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
+#include "blockcache.h"
+
+using namespace std;
+
+static const char BLOCKS_MAGIC[8] = {'N', 'X', 'R', 'V', 'B', 'L', 'K', '1'};
+
+struct blocks_header {
+    char magic[8];
+    uint64_t count;
+};
+
+struct block_record {
+    uint64_t key;
+    uint64_t hash;
+    int64_t imm;
+    uint32_t icnt;
+    uint8_t len;
+    uint8_t itype;
+    uint8_t reserved[2];
+};
+
+static uint64_t block_key(uint64_t fileoff, bool rv64) {
+    return fileoff << 1 | rv64;
+}
+
+// FNV-1a over 64-bit words
+uint64_t block_cache::hash(const uint8_t *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    for (; len; ++data, --len)
+        h = (h ^ *data) * 0x100000001b3ULL;
+    return h;
+}
+
+block_cache::obj_blocks *block_cache::get(const obj_file *obj) {
+    auto it = by_obj.find(obj);
+    if (it != by_obj.end())
+        return it->second;
+    obj_blocks *blocks = nullptr;
+    auto build_id = obj->get_build_id();
+    if (build_id && !build_id->empty()) {
+        string hex(build_id->size() * 2, '\0');
+        bin2hex(hex.data(), build_id->data(), build_id->size());
+        auto [it_id, inserted] = by_build_id.try_emplace(hex);
+        if (inserted) {
+            it_id->second = make_unique<obj_blocks>();
+            it_id->second->path = dir + "/" + hex + ".blocks";
+            it_id->second->dirty = false;
+            // A missing or corrupted file is treated as empty
+            auto data = read_file_binary(it_id->second->path.c_str());
+            blocks_header header;
+            if (data.size() >= sizeof(header)) {
+                memcpy(&header, data.data(), sizeof(header));
+                if (!memcmp(header.magic, BLOCKS_MAGIC, sizeof(BLOCKS_MAGIC)) &&
+                    header.count == (data.size() - sizeof(header)) /
+                                    sizeof(block_record)) {
+                    auto *p = data.data() + sizeof(header);
+                    for (uint64_t i = 0; i < header.count; ++i) {
+                        block_record rec;
+                        memcpy(&rec, p + i * sizeof(rec), sizeof(rec));
+                        it_id->second->blocks.emplace(rec.key, block_info{
+                            rec.icnt, rec.hash,
+                            nexusrv_inst{rec.len, rec.itype, rec.imm}});
+                    }
+                }
+            }
+        }
+        blocks = it_id->second.get();
+    }
+    by_obj.emplace(obj, blocks);
+    return blocks;
+}
+
+optional<block_info> block_cache::find(const obj_file *obj,
+                                       uint64_t fileoff, bool rv64) {
+    lock_guard<mutex> guard(lock);
+    auto *blocks = get(obj);
+    if (!blocks)
+        return nullopt;
+    auto it = blocks->blocks.find(block_key(fileoff, rv64));
+    if (it == blocks->blocks.end())
+        return nullopt;
+    return it->second;
+}
+
+void block_cache::insert(const obj_file *obj, uint64_t fileoff, bool rv64,
+                         const block_info &info) {
+    lock_guard<mutex> guard(lock);
+    auto *blocks = get(obj);
+    if (!blocks)
+        return;
+    blocks->blocks.insert_or_assign(block_key(fileoff, rv64), info);
+    blocks->dirty = true;
+}
+
+void block_cache::save() {
+    lock_guard<mutex> guard(lock);
+    error_code ec;
+    filesystem::create_directories(dir, ec);
+    for (auto &[build_id, blocks] : by_build_id) {
+        if (!blocks->dirty)
+            continue;
+        // Write to a temporary file, and replace atomically
+        string tmp = blocks->path + cppfmt(".%d", getpid());
+        auto_file fp(fopen(tmp.c_str(), "wb"), &fclose);
+        if (!fp)
+            error(-1, errno, "Failed to create block cache %s", tmp.c_str());
+        blocks_header header = {};
+        memcpy(header.magic, BLOCKS_MAGIC, sizeof(BLOCKS_MAGIC));
+        header.count = blocks->blocks.size();
+        bool ok = fwrite(&header, sizeof(header), 1, fp.get()) == 1;
+        for (auto &[key, info] : blocks->blocks) {
+            block_record rec = {};
+            rec.key = key;
+            rec.hash = info.hash;
+            rec.imm = info.inst.imm;
+            rec.icnt = info.icnt;
+            rec.len = info.inst.len;
+            rec.itype = info.inst.itype;
+            ok = ok && fwrite(&rec, sizeof(rec), 1, fp.get()) == 1;
+        }
+        if (fflush(fp.get()) || !ok)
+            error(-1, errno, "Failed to write block cache %s", tmp.c_str());
+        fp.reset();
+        if (rename(tmp.c_str(), blocks->path.c_str()))
+            error(-1, errno, "Failed to rename block cache %s", tmp.c_str());
+        blocks->dirty = false;
+    }
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_BLOCKCACHE_H
+#define LIBNEXUS_RV_BLOCKCACHE_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+extern "C" {
+#include <libnexus-rv/inst-helper.h>
+}
+#include "objfile.h"
+
+/*
+ * A block discovered by rv_block_arena::fetch
+ *
+ * The hash covers the bytes of the whole block, so a block is only
+ * reused if the code in memory is the same as when it's discovered,
+ * e.g., not patched by the kernel alternatives differently.
+ */
+struct block_info {
+    uint32_t icnt;
+    uint64_t hash;
+    nexusrv_inst inst;
+};
+
+/*
+ * Persistent cache of instruction blocks across replay runs
+ *
+ * Blocks are stored per object file in {dir}/{build-id}.blocks, keyed
+ * by the file offset of the block start. Objects without build-id are
+ * not cached. Each file is loaded on the first lookup of its object, and
+ * written back by save() if new blocks are added.
+ */
+struct block_cache {
+    inline explicit block_cache(std::string dir) : dir(std::move(dir)) {}
+    std::optional<block_info> find(const obj_file *obj,
+                                   uint64_t fileoff, bool rv64);
+    void insert(const obj_file *obj, uint64_t fileoff, bool rv64,
+                const block_info &info);
+    void save();
+    static uint64_t hash(const uint8_t *data, size_t len);
+private:
+    struct obj_blocks {
+        std::string path;
+        bool dirty;
+        std::unordered_map<uint64_t, block_info> blocks;
+    };
+    obj_blocks *get(const obj_file *obj);
+    std::string dir;
+    // Shared by concurrent replay workers
+    std::mutex lock;
+    std::unordered_map<const obj_file*, obj_blocks*> by_obj;
+    std::unordered_map<std::string, std::unique_ptr<obj_blocks> > by_build_id;
+};
+
+#endif
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * blocktable.cpp - Address lookup of instruction blocks
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <bit>
+#include "blocktable.h"
+
+using namespace std;
+
+rv_block_table::rv_block_table() :
+        front_cache(make_unique<entry[]>(front_size)), used(0) {
+    for (size_t i = 0; i < front_size; ++i)
+        front_cache[i] = {0, no_block};
+    reset(1024);
+}
+
+// Empty table of size entries, a power of 2
+void rv_block_table::reset(size_t size) {
+    table = make_unique<entry[]>(size);
+    mask = size - 1;
+    shift = 64 - countr_zero(size);
+    for (size_t i = 0; i < size; ++i)
+        table[i] = {0, no_block};
+}
+
+uint32_t rv_block_table::find_slow(uint64_t addr) const {
+    for (size_t i = hash(addr);; ++i) {
+        auto &e = table[i & mask];
+        if (e.index == no_block || e.addr == addr)
+            return e.index;
+    }
+}
+
+void rv_block_table::insert(uint64_t addr, uint32_t index) {
+    // Keep the load factor under 1/2
+    if ((used + 1) * 2 > mask + 1)
+        grow();
+    for (size_t i = hash(addr);; ++i) {
+        auto &e = table[i & mask];
+        if (e.index == no_block) {
+            e = {addr, index};
+            ++used;
+            break;
+        }
+        if (e.addr == addr) {
+            e.index = index;
+            break;
+        }
+    }
+    auto &front = front_cache[(addr >> 1) & (front_size - 1)];
+    if (front.addr == addr)
+        front.index = index;
+}
+
+void rv_block_table::grow() {
+    auto old = std::move(table);
+    size_t old_mask = mask;
+    reset((mask + 1) * 2);
+    for (size_t i = 0; i <= old_mask; ++i) {
+        if (old[i].index == no_block)
+            continue;
+        for (size_t j = hash(old[i].addr);; ++j) {
+            auto &e = table[j & mask];
+            if (e.index == no_block) {
+                e = old[i];
+                break;
+            }
+        }
+    }
+}
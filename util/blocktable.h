@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_BLOCKTABLE_H
+#define LIBNEXUS_RV_BLOCKTABLE_H
+
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Map of block start address to the index in rv_block_arena
+ *
+ * Lookups first go to a small direct-mapped cache indexed by the low
+ * bits of PC, then a flat open-addressing table with linear probing.
+ * Neither allocates per entry, and a hit takes one or two cache lines.
+ */
+struct rv_block_table {
+    static constexpr uint32_t no_block = UINT32_MAX;
+    static constexpr size_t front_size = 4096;
+    rv_block_table();
+    inline uint32_t find(uint64_t addr) {
+        auto &front = front_cache[(addr >> 1) & (front_size - 1)];
+        if (front.addr == addr && front.index != no_block)
+            return front.index;
+        uint32_t index = find_slow(addr);
+        if (index != no_block)
+            front = {addr, index};
+        return index;
+    }
+    void insert(uint64_t addr, uint32_t index);
+private:
+    struct entry {
+        uint64_t addr;
+        uint32_t index;
+    };
+    // Fibonacci hashing, the top bits of the product index the table
+    inline size_t hash(uint64_t addr) const {
+        // Instructions are at least 2-byte aligned
+        return (addr >> 1) * 0x9e3779b97f4a7c15ULL >> shift;
+    }
+    uint32_t find_slow(uint64_t addr) const;
+    void reset(size_t size);
+    void grow();
+    std::unique_ptr<entry[]> front_cache;
+    std::unique_ptr<entry[]> table;
+    size_t mask;
+    unsigned shift;     // 64 - log2(size of table)
+    size_t used;
+};
+
+#endif
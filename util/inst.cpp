@@ -6,6 +6,7 @@
  */
 
 #include <cassert>
+#include <charconv>
 #include <error.h>
 #include <capstone.h>
 #include <libnexus-rv/error.h>
@@ -22,228 +23,288 @@ struct auto_csh {
     csh handle;
 };
 
-map<pair<cs_arch, cs_mode>, auto_csh> cached_csh;
+// Capstone handles are not thread-safe
+thread_local map<pair<cs_arch, cs_mode>, auto_csh> cached_csh;
 
-uint64_t rv_inst_block::retire(nexusrv_trace_decoder *decoder) {
-    check_exc(decoder);
-    return addr + icnt * 2;
+static inline rv_inst_status completed(const rv_inst_block *block,
+                                       uint64_t next) {
+    return {0, NEXUSRV_Trace_Event_None, block->icnt, next};
 }
 
-unsigned rv_inst_block::check_exc(nexusrv_trace_decoder *decoder) {
-    unsigned event;
-    int32_t retired = nexusrv_trace_try_retire(decoder, icnt, &event);
+static inline rv_inst_status stopped(const rv_inst_block *block,
+                                     uint32_t retired, unsigned event) {
+    return {0, event, retired, block->addr + retired * 2};
+}
+
+static inline rv_inst_status failed(int rc) {
+    return {rc, NEXUSRV_Trace_Event_None, 0, 0};
+}
+
+/*
+ * Retire the whole block, and get the event pending after it
+ * Return false if stopped by event or failed, with status set
+ */
+static bool check_exc(const rv_inst_block *block,
+                      nexusrv_trace_decoder *decoder,
+                      unsigned *event, rv_inst_status *status) {
+    int32_t retired = nexusrv_trace_try_retire(decoder, block->icnt, event);
     if (retired < 0) {
         error(0, 0, "Trying to retire %u icnt, but failed: %s",
-            icnt, str_nexus_error(retired));
-        throw rv_inst_exc_failed{retired};
+            block->icnt, str_nexus_error(retired));
+        *status = failed(retired);
+        return false;
     }
-    if ((uint32_t)retired < icnt) {
-        switch (event) {
+    if ((uint32_t)retired < block->icnt) {
+        switch (*event) {
             // Expect these messages at any given i-cnt
             case NEXUSRV_Trace_Event_Trap:
             case NEXUSRV_Trace_Event_DirectSync:
             case NEXUSRV_Trace_Event_IndirectSync:
             case NEXUSRV_Trace_Event_Sync:
             case NEXUSRV_Trace_Event_Error:
-                throw rv_inst_exc_event{addr + retired * 2, event};
+                *status = stopped(block, retired, *event);
+                return false;
         }
         error(0, 0,
               "Expecting trap/sync/error, but got %s, icnt=%" PRIi32,
-              str_nexusrv_trace_event(event), retired);
-        throw rv_inst_exc_failed{-nexus_trace_mismatch};
+              str_nexusrv_trace_event(*event), retired);
+        *status = failed(-nexus_trace_mismatch);
+        return false;
     }
-    return event;
-}
-
-rv_ib_dir_jmp::rv_ib_dir_jmp(shared_ptr<memory_view> vm,
-                             uint64_t addr, uint32_t icnt,
-                             auto_cs_insn insn) :
-        rv_inst_block(vm, addr, icnt, move(insn)) {
-    auto *rv_detail = &this->insn->detail->riscv;
-    assert(rv_detail->op_count > 0);
-    auto op_last = rv_detail->op_count - 1;
-    assert(rv_detail->operands[op_last].type == RISCV_OP_IMM);
-    off = rv_detail->operands[op_last].imm;
-}
-
-uint64_t rv_ib_dir_jmp::retire(nexusrv_trace_decoder *decoder) {
-    check_exc(decoder);
-    return addr + icnt * 2 - insn->size + off;
+    return true;
 }
 
-uint64_t rv_ib_cond_branch::retire(nexusrv_trace_decoder *decoder) {
-    auto event = check_exc(decoder);
-    if (event == NEXUSRV_Trace_Event_Error) {
-        /* The Error event is right after
-         * We can't tell whether we should have got the
-         * DirectBranch or not. Thus, we are unable to retire the block
-         */
-        throw rv_inst_exc_event{addr + icnt * 2, event};
-    }
-    int tnt = nexusrv_trace_next_tnt(decoder);
-    if (tnt < 0)
-        throw rv_inst_exc_failed{tnt};
-    taken = !!tnt;
-    if (!taken)
-        return addr + icnt * 2;
-    return addr + icnt * 2 - insn->size + off;
-}
-
-int rv_ib_cond_branch::print(FILE *fp) const {
-    return rv_inst_block::print(fp) +
-        fprintf(fp, "%s", taken ? " [taken]" : "");
-}
-
-string rv_ib_cond_branch::to_string() const {
-    return cppfmt("%s %s%s",
-        insn->mnemonic, insn->op_str,
-        taken ? " [taken]" : "");
-}
-
-uint64_t rv_ib_dir_call::retire(nexusrv_trace_decoder *decoder) {
-    uint64_t target = rv_ib_dir_jmp::retire(decoder);
-    stack0 = nexusrv_trace_callstack_used(decoder);
-    nexusrv_trace_push_call(decoder, addr + icnt * 2);
-    stack1 = nexusrv_trace_callstack_used(decoder);
-    return target;
-}
-
-int rv_ib_dir_call::print(FILE *fp) const {
-    return rv_inst_block::print(fp) +
-        fprintf(fp, " [stack:%u->%u]", stack0, stack1);
-}
-
-string rv_ib_dir_call::to_string() const {
-    return cppfmt("%s %s [stack:%u->%u]",
-        insn->mnemonic, insn->op_str,
-        stack0, stack1);
-}
-
-uint64_t rv_ib_indir_jmp::retire(nexusrv_trace_decoder *decoder) {
-    auto event = check_exc(decoder);
+static rv_inst_status retire_indir(const rv_inst_block *block,
+                                   nexusrv_trace_decoder *decoder,
+                                   unsigned event) {
     if (event != NEXUSRV_Trace_Event_Indirect) {
         error(0, 0, "Expecting Indirect, but got %s, icnt left %u",
             str_nexusrv_trace_event(event), nexusrv_trace_available_icnt(decoder));
-        throw rv_inst_exc_failed{-nexus_trace_mismatch};
+        return failed(-nexus_trace_mismatch);
     }
     nexusrv_trace_indirect indir;
     int rc = nexusrv_trace_next_indirect(decoder, &indir);
     if (rc < 0)
-        throw rv_inst_exc_failed{rc};
-    return indir.target;
-}
-
-uint64_t rv_ib_indir_call::retire(nexusrv_trace_decoder *decoder) {
-    uint64_t target = rv_ib_indir_jmp::retire(decoder);
-    stack0 = nexusrv_trace_callstack_used(decoder);
-    nexusrv_trace_push_call(decoder, addr + icnt * 2);
-    stack1 = nexusrv_trace_callstack_used(decoder);
-    return target;
-}
-
-int rv_ib_indir_call::print(FILE *fp) const {
-    return rv_inst_block::print(fp) +
-        fprintf(fp, " [stack:%u->%u]", stack0, stack1);
-}
-
-string rv_ib_indir_call::to_string() const {
-    return cppfmt("%s %s [stack:%u->%u]",
-        insn->mnemonic, insn->op_str,
-        stack0, stack1);
+        return failed(rc);
+    return completed(block, indir.target);
 }
 
-uint64_t rv_ib_ret::retire(nexusrv_trace_decoder *decoder) {
-    auto event = check_exc(decoder);
+static rv_inst_status retire_ret(const rv_inst_block *block,
+                                 nexusrv_trace_decoder *decoder,
+                                 unsigned event) {
     if (event == NEXUSRV_Trace_Event_Error) {
         /* The Error event is right after
          * We can't tell whether we should have got the
          * IndirBranch or not. Thus, we are unable to retire the block
          */
-        throw rv_inst_exc_event{addr + icnt * 2, event};
+        return stopped(block, block->icnt, event);
     }
-    stacksz = nexusrv_trace_callstack_used(decoder);
-    IRO = false;
+    unsigned stacksz = nexusrv_trace_callstack_used(decoder);
     uint64_t target;
+    rv_inst_status status;
     if (event == NEXUSRV_Trace_Event_Indirect) {
         nexusrv_trace_pop_ret(decoder, &target);
         nexusrv_trace_indirect indir;
         int rc = nexusrv_trace_next_indirect(decoder, &indir);
         if (rc < 0)
-            throw rv_inst_exc_failed{rc};
-        return indir.target;
+            return failed(rc);
+        status = completed(block, indir.target);
+    } else {
+        int rc = nexusrv_trace_pop_ret(decoder, &target);
+        if (rc < 0)
+            return failed(rc);
+        status = completed(block, target);
+        status.implicit = true;
     }
-    int rc = nexusrv_trace_pop_ret(decoder, &target);
-    if (rc < 0)
-        throw rv_inst_exc_failed{rc};
-    IRO = true;
-    return target;
+    status.stack0 = stacksz;
+    status.stack1 = stacksz ? stacksz - 1 : 0;
+    return status;
+}
+
+rv_inst_status rv_inst_block::retire(nexusrv_trace_decoder *decoder) const {
+    unsigned event;
+    rv_inst_status status;
+    if (kind == NEXUSRV_ITYPE_Exception) {
+        /* Expect an exception exactly at the start of the insn */
+        int32_t retired = nexusrv_trace_try_retire(
+                        decoder, icnt - len / 2, &event);
+        if (retired < 0)
+            return failed(retired);
+        if ((uint32_t)retired < icnt - len / 2u)
+            return stopped(this, retired, event);
+        if (event != NEXUSRV_Trace_Event_Trap) {
+            error(0, 0, "Expecting Trap, but got %s, icnt left %u",
+                str_nexusrv_trace_event(event), nexusrv_trace_available_icnt(decoder));
+            return failed(-nexus_trace_mismatch);
+        }
+        nexusrv_trace_indirect indir;
+        int rc = nexusrv_trace_next_indirect(decoder, &indir);
+        if (rc < 0)
+            return failed(rc);
+        return completed(this, indir.target);
+    }
+    if (!check_exc(this, decoder, &event, &status))
+        return status;
+    unsigned stack0 = nexusrv_trace_callstack_used(decoder);
+    switch (kind) {
+        case NEXUSRV_ITYPE_Cond_Branch: {
+            if (event == NEXUSRV_Trace_Event_Error) {
+                /* The Error event is right after
+                 * We can't tell whether we should have got the
+                 * DirectBranch or not. Thus, we are unable to retire the block
+                 */
+                return stopped(this, icnt, event);
+            }
+            int tnt = nexusrv_trace_next_tnt(decoder);
+            if (tnt < 0)
+                return failed(tnt);
+            if (!tnt)
+                return completed(this, addr + icnt * 2);
+            status = completed(this, last_addr() + off);
+            status.taken = true;
+            return status;
+        }
+        case NEXUSRV_ITYPE_Direct_Jump:
+            return completed(this, last_addr() + off);
+        case NEXUSRV_ITYPE_Direct_Call:
+            status = completed(this, last_addr() + off);
+            break;
+        // Treat trap return the same as indirect jump for now
+        // (w/o context tracking)
+        case NEXUSRV_ITYPE_Indirect_Jump:
+        case NEXUSRV_ITYPE_Trap_Return:
+            return retire_indir(this, decoder, event);
+        case NEXUSRV_ITYPE_Indirect_Call:
+            status = retire_indir(this, decoder, event);
+            break;
+        case NEXUSRV_ITYPE_Function_Return:
+            return retire_ret(this, decoder, event);
+        case NEXUSRV_ITYPE_Coroutine_Swap:
+            if (decoder->msg_decoder->hw_cfg->quirk_sifive) {
+                status = retire_indir(this, decoder, event);
+                break;
+            }
+            status = retire_ret(this, decoder, event);
+            status.coswap = true;
+            break;
+        default:
+            return completed(this, addr + icnt * 2);
+    }
+    // Calls and coroutine swaps push the return address
+    if (status.rc < 0 || status.event != NEXUSRV_Trace_Event_None)
+        return status;
+    nexusrv_trace_push_call(decoder, addr + icnt * 2);
+    status.stack0 = stack0;
+    status.stack1 = nexusrv_trace_callstack_used(decoder);
+    return status;
 }
 
-int rv_ib_ret::print(FILE *fp) const {
-    return rv_inst_block::print(fp) +
-        fprintf(fp, "%s [stack:%u->%u]",
-                IRO ? " [implicit]" : " [explicit]",
-                stacksz, stacksz - 1);
+bool rv_block_registry::find(uint64_t addr, bool rv64, uint32_t *icnt,
+                             nexusrv_inst *inst) {
+    lock_guard<mutex> guard(lock);
+    auto it = blocks.find(addr);
+    if (it == blocks.end() || it->second.rv64 != rv64)
+        return false;
+    *icnt = it->second.icnt;
+    *inst = it->second.inst;
+    return true;
 }
 
-string rv_ib_ret::to_string() const {
-    return cppfmt("%s %s%s [stack:%u->%u]",
-        insn->mnemonic, insn->op_str,
-        IRO ? " [implicit]" : " [explicit]",
-        stacksz, stacksz ? stacksz - 1 : 0);
+void rv_block_registry::insert(uint64_t addr, bool rv64, uint32_t icnt,
+                               const nexusrv_inst &inst) {
+    lock_guard<mutex> guard(lock);
+    blocks.try_emplace(addr, entry{icnt, rv64, inst, nullptr});
 }
 
-uint64_t rv_ib_co_swap::retire(nexusrv_trace_decoder *decoder) {
-    stack0 = nexusrv_trace_callstack_used(decoder);
-    IRO = false;
-    coswap = false;
-    uint64_t target;
-    if (decoder->msg_decoder->hw_cfg->quirk_sifive)
-        target = rv_ib_indir_call::retire(decoder);
-    else {
-        coswap = true;
-        target = rv_ib_ret::retire(decoder);
-        nexusrv_trace_push_call(decoder, addr + icnt * 2);
-    }
-    stack1 = nexusrv_trace_callstack_used(decoder);
-    return target;
+const string *rv_block_registry::find_text(uint64_t addr, bool rv64) {
+    lock_guard<mutex> guard(lock);
+    auto it = blocks.find(addr);
+    if (it == blocks.end() || it->second.rv64 != rv64)
+        return nullptr;
+    return it->second.text;
 }
 
-int rv_ib_co_swap::print(FILE *fp) const {
-    return rv_inst_block::print(fp) +
-        fprintf(fp, "%s%s [stack:%u->%u]",
-                IRO ? " [implicit]" : " [explicit]",
-                coswap ? " [coswap]" : "",
-                stack0, stack1);
+const string *rv_block_registry::insert_text(uint64_t addr, bool rv64,
+                                             string str) {
+    lock_guard<mutex> guard(lock);
+    auto *text = &*texts.insert(std::move(str)).first;
+    auto it = blocks.find(addr);
+    if (it != blocks.end() && it->second.rv64 == rv64 && !it->second.text)
+        it->second.text = text;
+    return text;
 }
 
-string rv_ib_co_swap::to_string() const {
-    return cppfmt("%s %s%s%s [stack:%u->%u]",
-        insn->mnemonic, insn->op_str,
-        IRO ? " [implicit]" : " [explicit]",
-        coswap ? " [coswap]" : "",
-        stack0, stack1);
+rv_inst_block *rv_block_arena::add(uint64_t addr, uint32_t icnt,
+                                   const nexusrv_inst &inst, bool rv64) {
+    uint32_t index = blocks.size();
+    auto &block = blocks.emplace_back(rv_inst_block{
+            addr, icnt, (int32_t)inst.imm, rv_inst_block::no_text,
+            inst.itype, inst.len, rv64, 0, {}});
+    for (auto &next : block.next)
+        next = rv_inst_block::no_block;
+    by_addr.insert(addr, index);
+    return &block;
 }
 
-uint64_t rv_ib_int::retire(nexusrv_trace_decoder *decoder) {
-    unsigned event;
-    /* Expect an exception exactly at the start of the insn */
-    int32_t retired = nexusrv_trace_try_retire(
-                    decoder, icnt - insn->size / 2, &event);
-    if (retired < 0)
-        throw rv_inst_exc_failed{retired};
-    if ((uint32_t)retired < icnt - insn->size / 2)
-        throw rv_inst_exc_event{addr + retired * 2, event};
-    if (event != NEXUSRV_Trace_Event_Trap) {
-        error(0, 0, "Expecting Trap, but got %s, icnt left %u",
-            str_nexusrv_trace_event(event), nexusrv_trace_available_icnt(decoder));
-        throw rv_inst_exc_failed{-nexus_trace_mismatch};
+void rv_block_arena::chain(rv_inst_block *block, const rv_inst_block *next) {
+    block->next[block->next_victim++ % rv_inst_block::successors] =
+            by_addr.find(next->addr);
+}
+
+const string &rv_block_arena::text(memory_view &vm, rv_inst_block *block) {
+    if (block->text != rv_inst_block::no_text)
+        return *texts[block->text];
+    auto *str = shared.find_text(block->addr, block->rv64);
+    if (!str) {
+        // Disassembled without the lock, another thread might race
+        auto insn = disasm1(vm, block->last_addr(), block->rv64);
+        str = shared.insert_text(block->addr, block->rv64, insn ?
+                cppfmt("%s %s", insn->mnemonic, insn->op_str) : "(unknown)");
     }
-    nexusrv_trace_indirect indir;
-    int rc = nexusrv_trace_next_indirect(decoder, &indir);
-    if (rc < 0)
-        throw rv_inst_exc_failed{rc};
-    return indir.target;
+    // Many blocks end with the same instruction, e.g., ret
+    auto it = by_text.find(str);
+    if (it == by_text.end()) {
+        texts.push_back(str);
+        it = by_text.emplace(str, texts.size() - 1).first;
+    }
+    block->text = it->second;
+    return *str;
+}
+
+static size_t print_stack(logger &l, unsigned stack0, unsigned stack1) {
+    // " [stack:%u->%u]" without going through printf
+    char buf[48] = " [stack:";
+    char *p = buf + 8, *end = buf + sizeof(buf);
+    p = to_chars(p, end, stack0).ptr;
+    *p++ = '-';
+    *p++ = '>';
+    p = to_chars(p, end, stack1).ptr;
+    *p++ = ']';
+    return l.print(buf, p - buf);
+}
+
+size_t rv_block_arena::print(logger &l, memory_view &vm, rv_inst_block *block,
+                             const rv_inst_status &status) {
+    auto &str = text(vm, block);
+    size_t printed = l.print(str.data(), str.size());
+    switch (block->kind) {
+        case NEXUSRV_ITYPE_Cond_Branch:
+            if (status.taken)
+                printed += l.print(" [taken]");
+            break;
+        case NEXUSRV_ITYPE_Direct_Call:
+        case NEXUSRV_ITYPE_Indirect_Call:
+            printed += print_stack(l, status.stack0, status.stack1);
+            break;
+        case NEXUSRV_ITYPE_Function_Return:
+        case NEXUSRV_ITYPE_Coroutine_Swap:
+            printed += l.print(status.implicit ? " [implicit]" : " [explicit]");
+            if (status.coswap)
+                printed += l.print(" [coswap]");
+            printed += print_stack(l, status.stack0, status.stack1);
+            break;
+    }
+    return printed;
 }
 
 static csh get_csh(cs_arch arch, cs_mode mode) {
@@ -253,13 +314,12 @@ static csh get_csh(cs_arch arch, cs_mode mode) {
     csh handle;
     if (cs_open(arch, mode, &handle) != CS_ERR_OK)
         error(-1, 0, "failed to open csh for arch %d mode %d", arch, mode);
-    cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
     cached_csh.emplace(make_pair(arch, mode), handle);
     return handle;
 }
 
-auto_cs_insn rv_inst_block::disasm1(shared_ptr<memory_view> vm, uint64_t va, bool rv64) {
-    auto [mapped, len] = vm->try_map(va);
+auto_cs_insn disasm1(memory_view &vm, uint64_t va, bool rv64) {
+    auto [mapped, len] = vm.try_map(va);
     if (!mapped)
         return auto_cs_insn(nullptr, &cs_free1);
     auto cs_handle = get_csh(CS_ARCH_RISCV,
@@ -267,159 +327,51 @@ auto_cs_insn rv_inst_block::disasm1(shared_ptr<memory_view> vm, uint64_t va, boo
                              (cs_mode)(CS_MODE_RISCV64 | CS_MODE_RISCVC) :
                              (cs_mode)(CS_MODE_RISCV32 | CS_MODE_RISCVC));
     cs_insn *insn = nullptr;
+    // Capstone doesn't know some extensions (such as bitmanip)
     if (!cs_disasm(cs_handle, mapped, len, va, 1, &insn))
-        error(-1, 0, "failed to decode insn @%" PRIx64 " len=%zu err=%d",
-              va, len, cs_errno(cs_handle));
+        insn = nullptr;
     return auto_cs_insn(insn, &cs_free1);
 }
 
-shared_ptr<rv_inst_block> rv_inst_block::fetch(shared_ptr<memory_view> vm, uint64_t va, bool rv64) {
-    auto [mapped, len] = vm->try_map(va);
-    auto orig_va = va;
-    auto orig_mapped = mapped;
-    auto orig_len = len;
+rv_inst_block *rv_block_arena::fetch(memory_view &vm, uint64_t va, bool rv64,
+                                     block_cache *cache) {
+    uint32_t index = by_addr.find(va);
+    if (index != rv_inst_block::no_block)
+        return &blocks[index];
+    uint32_t icnt;
+    nexusrv_inst inst;
+    if (shared.find(va, rv64, &icnt, &inst))
+        return add(va, icnt, inst, rv64);
+    auto [mapped, len] = vm.try_map(va);
     if (!mapped)
         return nullptr;
-    auto cs_handle = get_csh(CS_ARCH_RISCV,
-                             rv64 ?
-                             (cs_mode)(CS_MODE_RISCV64 | CS_MODE_RISCVC) :
-                             (cs_mode)(CS_MODE_RISCV32 | CS_MODE_RISCVC));
-    auto_cs_insn insn(cs_malloc(cs_handle), &cs_free1);
-    while (len >= 2) {
-        if (!cs_disasm_iter(cs_handle, &mapped, &len, &va, insn.get())) {
-            // Ignore instructions capstone can't handle for now (such as bitmanip)
-            uint8_t b = *mapped;
-            size_t inst_len = ((b & 3) == 3) ? 4 : 2;
-            if (len < inst_len)
-                error(-1, 0, "partial instruction");
-            va += inst_len;
-            mapped += inst_len;
-            len -= inst_len;
-        }
-        assert(mapped == orig_mapped + (orig_len - len));
-        assert((mapped - orig_mapped) % 2 == 0);
-        auto icnt = (mapped - orig_mapped) / 2;
-        auto detail = insn->detail;
-        for (unsigned i = 0 ; i < detail->groups_count; ++i) {
-            if (detail->groups[i] == RISCV_GRP_BRANCH_RELATIVE)
-                return make_shared<rv_ib_cond_branch>(vm, orig_va, icnt, move(insn));
-        }
-        switch (insn->id) {
-            case RISCV_INS_MRET:
-            case RISCV_INS_SRET:
-            case RISCV_INS_URET:
-                return make_shared<rv_ib_iret>(vm, orig_va, icnt, move(insn));
-            case RISCV_INS_ECALL:
-            case RISCV_INS_EBREAK:
-            case RISCV_INS_C_EBREAK:
-                return make_shared<rv_ib_int>(vm, orig_va, icnt, move(insn));
-        }
-        auto *rv_detail = &insn->detail->riscv;
-        unsigned itype = NEXUSRV_ITYPE_None;
-        auto lastop = rv_detail->op_count - 1;
-        switch (insn->id) {
-            case RISCV_INS_JAL:
-                switch (rv_detail->op_count) {
-                    default:
-                        assert(false);
-                    case 1:
-                        // First operand is omitted:
-                        //   jal <label> -> jal ra, <label>
-                        //   j   <label> -> jal x0, <label>
-                        if (!strcmp(insn->mnemonic, "j"))
-                            itype = nexusrv_inst_jal_types(0);
-                        else if (!strcmp(insn->mnemonic, "jal"))
-                            itype = nexusrv_inst_jal_types(
-                                    RISCV_REG_RA - RISCV_REG_ZERO);
-                        else
-                            assert(false);
-                        break;
-                    case 2:
-                        assert(!strcmp(insn->mnemonic, "jal"));
-                        assert(rv_detail->operands[0].type == RISCV_OP_REG);
-                        itype = nexusrv_inst_jal_types(
-                                rv_detail->operands[0].reg - RISCV_REG_ZERO);
-                        break;
-                }
-                assert(rv_detail->operands[lastop].type == RISCV_OP_IMM);
-                break;
-            case RISCV_INS_JALR:
-                switch (rv_detail->op_count) {
-                    default:
-                        assert(false);
-                    case 1:
-                        assert(rv_detail->operands[0].type == RISCV_OP_REG);
-                        if (!strcmp(insn->mnemonic, "jr"))
-                            itype = nexusrv_inst_jalr_types(
-                                    0,
-                                    rv_detail->operands[0].reg - RISCV_REG_ZERO);
-                        else if (!strcmp(insn->mnemonic, "jalr"))
-                            itype = nexusrv_inst_jalr_types(
-                                    RISCV_REG_RA - RISCV_REG_ZERO,
-                                    rv_detail->operands[0].reg - RISCV_REG_ZERO);
-                        else
-                            assert(false);
-                        break;
-                    case 2:
-                        assert(!strcmp(insn->mnemonic, "jalr"));
-                        assert(rv_detail->operands[0].type == RISCV_OP_REG);
-                        assert(rv_detail->operands[1].type == RISCV_OP_IMM);
-                        itype = nexusrv_inst_jalr_types(
-                                RISCV_REG_RA - RISCV_REG_ZERO,
-                                rv_detail->operands[0].reg - RISCV_REG_ZERO);
-                        break;
-                    case 3:
-                        assert(!strcmp(insn->mnemonic, "jalr"));
-                        assert(rv_detail->operands[0].type == RISCV_OP_REG);
-                        assert(rv_detail->operands[1].type == RISCV_OP_REG);
-                        assert(rv_detail->operands[2].type == RISCV_OP_IMM);
-                        itype = nexusrv_inst_jalr_types(
-                                rv_detail->operands[0].reg - RISCV_REG_ZERO,
-                                rv_detail->operands[1].reg - RISCV_REG_ZERO);
-                        break;
-                }
-                break;
-            case RISCV_INS_C_J:
-                assert(!strcmp(insn->mnemonic, "c.j"));
-                assert(rv_detail->op_count == 1);
-                assert(rv_detail->operands[0].type == RISCV_OP_IMM);
-                itype = NEXUSRV_ITYPE_Direct_Jump;
-                break;
-            case RISCV_INS_C_JR:
-                assert(!strcmp(insn->mnemonic, "c.jr"));
-                assert(rv_detail->op_count == 1);
-                assert(rv_detail->operands[0].type == RISCV_OP_REG);
-                itype = nexusrv_inst_cjr_types(
-                        rv_detail->operands[0].reg - RISCV_REG_ZERO);
-                break;
-            case RISCV_INS_C_JAL:
-                assert(!strcmp(insn->mnemonic, "c.jal"));
-                assert(rv_detail->op_count == 1);
-                assert(rv_detail->operands[0].type == RISCV_OP_IMM);
-                itype = NEXUSRV_ITYPE_Direct_Call;
-                break;
-            case RISCV_INS_C_JALR:
-                assert(!strcmp(insn->mnemonic, "c.jalr"));
-                assert(rv_detail->op_count == 1);
-                assert(rv_detail->operands[0].type == RISCV_OP_REG);
-                itype = nexusrv_inst_cjalr_types(
-                        rv_detail->operands[0].reg - RISCV_REG_ZERO);
-                break;
-        }
-        switch (itype) {
-            case NEXUSRV_ITYPE_Direct_Jump:
-                return make_shared<rv_ib_dir_jmp>(vm, orig_va, icnt, move(insn));
-            case NEXUSRV_ITYPE_Direct_Call:
-                return make_shared<rv_ib_dir_call>(vm, orig_va, icnt, move(insn));
-            case NEXUSRV_ITYPE_Indirect_Jump:
-                return make_shared<rv_ib_indir_jmp>(vm, orig_va, icnt, move(insn));
-            case NEXUSRV_ITYPE_Indirect_Call:
-                return make_shared<rv_ib_indir_call>(vm, orig_va, icnt, move(insn));
-            case NEXUSRV_ITYPE_Coroutine_Swap:
-                return make_shared<rv_ib_co_swap>(vm, orig_va, icnt, move(insn));
-            case NEXUSRV_ITYPE_Function_Return:
-                return make_shared<rv_ib_ret>(vm, orig_va, icnt, move(insn));
+    shared_ptr<obj_file> obj;
+    uint64_t fileoff = 0;
+    if (cache)
+        tie(obj, fileoff) = vm.query_file(va);
+    if (obj) {
+        auto info = cache->find(obj.get(), fileoff, rv64);
+        if (info && info->icnt * 2ULL <= len &&
+            block_cache::hash(mapped, info->icnt * 2) == info->hash) {
+            shared.insert(va, rv64, info->icnt, info->inst);
+            return add(va, info->icnt, info->inst, rv64);
         }
     }
+    size_t pos = 0;
+    while (len - pos >= 2) {
+        unsigned inst_len = nexusrv_inst_decode(mapped + pos, len - pos,
+                                                rv64, &inst);
+        if (!inst_len)
+            error(-1, 0, "partial instruction @%" PRIx64, va + pos);
+        pos += inst_len;
+        if (inst.itype == NEXUSRV_ITYPE_None)
+            continue;
+        icnt = pos / 2;
+        if (obj)
+            cache->insert(obj.get(), fileoff, rv64, block_info{
+                    icnt, block_cache::hash(mapped, pos), inst});
+        shared.insert(va, rv64, icnt, inst);
+        return add(va, icnt, inst, rv64);
+    }
     return nullptr;
-}
\ No newline at end of file
+}
@@ -7,15 +7,25 @@
 #define LIBNEXUS_RV_INST_H
 
 #include <memory>
+#include <deque>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
 #include <capstone.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
 #include <libnexus-rv/trace-decoder.h>
+#include <libnexus-rv/inst-helper.h>
 #ifdef __cplusplus
 }
 #endif
 #include "vm.h"
+#include "blockcache.h"
+#include "blocktable.h"
+#include "logger.h"
 
 static inline void cs_free1(cs_insn *insn) {
     cs_free(insn, 1);
@@ -23,128 +33,134 @@ static inline void cs_free1(cs_insn *insn) {
 
 typedef std::unique_ptr<cs_insn, decltype(&cs_free1)> auto_cs_insn;
 
-struct rv_inst_block : std::enable_shared_from_this<rv_inst_block> {
-    inline rv_inst_block(std::shared_ptr<memory_view> vm,
-                         uint64_t addr, uint32_t icnt,
-                         auto_cs_insn insn) :
-    vm(vm), addr(addr), icnt(icnt), insn(std::move(insn)) {}
-    inline virtual ~rv_inst_block() {};
-    static std::shared_ptr<rv_inst_block> fetch(
-            std::shared_ptr<memory_view> vm, uint64_t addr, bool rv64);
-    static auto_cs_insn disasm1(
-            std::shared_ptr<memory_view> vm, uint64_t addr, bool rv64);
-    virtual uint64_t retire(nexusrv_trace_decoder *decoder);
-    inline virtual int print(FILE* fp) const {
-        return fprintf(fp, "%s %s", insn->mnemonic, insn->op_str);
-    }
-    inline virtual std::string to_string() const {
-        return cppfmt("%s %s", insn->mnemonic, insn->op_str);
-    }
-protected:
-    unsigned check_exc(nexusrv_trace_decoder *decoder);
-    std::shared_ptr<memory_view> vm;
-public:
-    const uint64_t addr;
-    const uint32_t icnt;
-    const auto_cs_insn insn;
-};
-
-struct rv_inst_exc_event {
-    uint64_t addr;
-    unsigned event;
-};
+auto_cs_insn disasm1(memory_view &vm, uint64_t addr, bool rv64);
 
-struct rv_inst_exc_failed {
+/*
+ * Result of retiring a block
+ *
+ * If the block is fully retired, event is NEXUSRV_Trace_Event_None, and
+ * next is the next PC. Otherwise, the block is stopped by the event
+ * (Trap, Sync, Error...) after retiring icnt, and next is the address
+ * of the event. rc is negative if the block failed to retire.
+ * The remaining fields describe the last instruction for printing.
+ */
+struct rv_inst_status {
     int rc;
+    unsigned event;
+    uint32_t icnt;
+    uint64_t next;
+    bool taken = false;     // Conditional branch taken
+    bool implicit = false;  // Return address from the return stack
+    bool coswap = false;    // Coroutine swap with the return stack
+    unsigned stack0 = 0;
+    unsigned stack1 = 0;
 };
 
-struct rv_ib_dir_jmp : rv_inst_block {
-    rv_ib_dir_jmp(std::shared_ptr<memory_view> vm,
-                  uint64_t addr, uint32_t icnt,
-                  auto_cs_insn insn);
-    inline ~rv_ib_dir_jmp() {}
-    uint64_t retire(nexusrv_trace_decoder *decoder) override;
-protected:
-    int64_t off;
-};
-
-struct rv_ib_cond_branch : rv_ib_dir_jmp {
-    using rv_ib_dir_jmp::rv_ib_dir_jmp;
-    inline ~rv_ib_cond_branch() {}
-    uint64_t retire(nexusrv_trace_decoder *decoder) override;
-    int print(FILE *fp) const override;
-    std::string to_string() const override;
-protected:
-    mutable bool taken;
-};
-
-struct rv_ib_dir_call : rv_ib_dir_jmp {
-    using rv_ib_dir_jmp::rv_ib_dir_jmp;
-    inline ~rv_ib_dir_call() {}
-    uint64_t retire(nexusrv_trace_decoder *decoder) override;
-    int print(FILE *fp) const override;
-    std::string to_string() const override;
-protected:
-    mutable unsigned stack0;
-    mutable unsigned stack1;
-};
-
-struct rv_ib_indir_jmp : rv_inst_block {
-    using rv_inst_block::rv_inst_block;
-    inline ~rv_ib_indir_jmp() {}
-    uint64_t retire(nexusrv_trace_decoder *decoder) override;
-};
-
-// Treat it the same as indiect jump for now (w/o context tracking)
-struct rv_ib_iret : rv_ib_indir_jmp {
-    using rv_ib_indir_jmp::rv_ib_indir_jmp;
-    inline ~rv_ib_iret() {}
-};
-
-struct rv_ib_indir_call : virtual rv_ib_indir_jmp {
-    using rv_ib_indir_jmp::rv_ib_indir_jmp;
-    inline ~rv_ib_indir_call() {}
-    uint64_t retire(nexusrv_trace_decoder *decoder) override;
-    int print(FILE *fp) const override;
-    std::string to_string() const override;
-protected:
-    inline rv_ib_indir_call() : rv_ib_indir_jmp(
-            nullptr, 0, 0, auto_cs_insn(nullptr, &cs_free1)) {}
-    mutable unsigned stack0;
-    mutable unsigned stack1;
-};
-
-struct rv_ib_ret : virtual rv_ib_indir_jmp {
-    using rv_ib_indir_jmp::rv_ib_indir_jmp;
-    inline ~rv_ib_ret() {}
-    uint64_t retire(nexusrv_trace_decoder *decoder) override;
-    int print(FILE *fp) const override;
-    std::string to_string() const override;
-protected:
-    inline rv_ib_ret() : rv_ib_indir_jmp(
-            nullptr, 0, 0, auto_cs_insn(nullptr, &cs_free1)) {}
-    mutable bool IRO;
-    mutable unsigned stacksz;
+/*
+ * A block of instructions ending with a control-flow instruction.
+ * Blocks are discovered by the native decoder in inst-helper.h, and
+ * capstone only disassembles the last instruction when printed.
+ *
+ * Blocks are small POD records in rv_block_arena, and never freed
+ * until the arena is. The kind of the last instruction (NEXUSRV_ITYPE_x)
+ * selects how the block is retired.
+ */
+struct rv_inst_block {
+    static constexpr uint32_t no_text = UINT32_MAX;
+    static constexpr uint32_t no_block = rv_block_table::no_block;
+    static constexpr unsigned successors = 4;
+    uint64_t addr;
+    uint32_t icnt;
+    int32_t off;        // Target offset of direct jump/call/branch
+    uint32_t text;      // Index of disassembly in rv_block_arena
+    uint8_t kind;       // NEXUSRV_ITYPE_x
+    uint8_t len;        // Length of the last instruction
+    bool rv64;
+    uint8_t next_victim;
+    /*
+     * Successor links, like chained blocks in binary translators.
+     * The fallthrough and taken target of a conditional branch, or
+     * the target of a direct jump/call always fit. Indirect jumps and
+     * returns use the slots as a small round-robin target cache.
+     * Each is an index in the arena, and the target is its addr.
+     */
+    uint32_t next[successors];
+
+    // Address of the last (control-flow) instruction
+    inline uint64_t last_addr() const {
+        return addr + icnt * 2 - len;
+    }
+    rv_inst_status retire(nexusrv_trace_decoder *decoder) const;
 };
 
-struct rv_ib_co_swap : rv_ib_ret, rv_ib_indir_call {
-    rv_ib_co_swap(std::shared_ptr<memory_view> vm,
-                  uint64_t addr, uint32_t icnt,
-                  auto_cs_insn insn) :
-            rv_ib_indir_jmp(vm, addr, icnt, std::move(insn)) {}
-    inline ~rv_ib_co_swap() {}
-    uint64_t retire(nexusrv_trace_decoder *decoder) override;
-    int print(FILE *fp) const override;
-    std::string to_string() const override;
-protected:
-    mutable bool coswap;
+/*
+ * Blocks discovered by all threads, and the disassembly text of their
+ * last instruction, so concurrent workers decode and disassemble each
+ * block only once. Only consulted on misses of the per thread arenas,
+ * whose lookup and chaining stay lock-free.
+ */
+struct rv_block_registry {
+    struct entry {
+        uint32_t icnt;
+        bool rv64;
+        nexusrv_inst inst;
+        const std::string *text;    // nullptr if not disassembled yet
+    };
+    bool find(uint64_t addr, bool rv64, uint32_t *icnt, nexusrv_inst *inst);
+    void insert(uint64_t addr, bool rv64, uint32_t icnt,
+                const nexusrv_inst &inst);
+    const std::string *find_text(uint64_t addr, bool rv64);
+    // Text of the block at addr, deduplicated, owned by the registry
+    const std::string *insert_text(uint64_t addr, bool rv64, std::string str);
+private:
+    std::mutex lock;
+    std::unordered_map<uint64_t, entry> blocks;
+    std::unordered_set<std::string> texts;
 };
 
-// Instruction block that raises exception/interrupt
-struct rv_ib_int : rv_inst_block {
-    using rv_inst_block::rv_inst_block;
-    inline ~rv_ib_int() {}
-    uint64_t retire(nexusrv_trace_decoder *decoder) override;
+/*
+ * Per thread storage of all blocks discovered, with the address lookup
+ * and the table of disassembly text shared by the blocks. Misses go to
+ * the registry shared with other threads.
+ */
+struct rv_block_arena {
+    inline explicit rv_block_arena(rv_block_registry &shared) :
+            shared(shared) {}
+    /*
+     * Find or discover the block starting from addr
+     * Return nullptr if addr is not mapped
+     */
+    rv_inst_block *fetch(memory_view &vm, uint64_t addr, bool rv64,
+                         block_cache *cache = nullptr);
+    // Successor block previously chained to target, if any
+    inline rv_inst_block *chained(const rv_inst_block *block,
+                                  uint64_t target) {
+        for (auto index : block->next) {
+            if (index == rv_inst_block::no_block)
+                continue;
+            auto *next = &blocks[index];
+            if (next->addr == target)
+                return next;
+        }
+        return nullptr;
+    }
+    void chain(rv_inst_block *block, const rv_inst_block *next);
+    /*
+     * Disassembly of the last instruction, rendered on first use
+     * and kept in the arena. Dynamic annotations are appended by print.
+     */
+    const std::string &text(memory_view &vm, rv_inst_block *block);
+    size_t print(logger &l, memory_view &vm, rv_inst_block *block,
+                 const rv_inst_status &status);
+private:
+    rv_inst_block *add(uint64_t addr, uint32_t icnt,
+                       const nexusrv_inst &inst, bool rv64);
+    // Stable references on growth, so blocks can be held across fetch
+    std::deque<rv_inst_block> blocks;
+    rv_block_table by_addr;
+    rv_block_registry &shared;
+    std::vector<const std::string*> texts;
+    std::unordered_map<const std::string*, uint32_t> by_text;
 };
 
 #endif
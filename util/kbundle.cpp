@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * kbundle.cpp - Portable bundle of Linux kernel core
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <error.h>
+#include <elf.h>
+#include <cstring>
+#include <algorithm>
+#include "linux.h"
+
+using namespace std;
+
+/*
+ * The bundle is an ELF core file, so it's loaded like kcore. Each text
+ * range copied from kcore is a PT_LOAD, and the metadata is a note of
+ * KBUNDLE_NOTE_NAME in the PT_NOTE, laid out as:
+ *
+ *   kbundle_header
+ *   kallsym        [nsyms]
+ *   uint32_t       [nkmods]     Module names in kallsyms
+ *   kbundle_module [nmods]
+ *   kbundle_section[nsections]
+ *   char           [strings_size]
+ *
+ * Names are offsets in strings, which starts with the kallsyms names.
+ */
+static const char KBUNDLE_MAGIC[8] = {'N', 'X', 'R', 'V', 'K', 'C', 'B', '1'};
+static const char KBUNDLE_NOTE_NAME[] = "NEXUSRV";
+#define KBUNDLE_NOTE_TYPE 1
+#define KBUNDLE_ALIGN 4096
+
+struct kbundle_header {
+    char magic[8];
+    uint64_t vmlinux_start;
+    uint64_t vmlinux_end;
+    uint64_t bpf_start;
+    uint32_t version;
+    uint32_t nsyms;
+    uint32_t nkmods;
+    uint32_t nmods;
+    uint32_t nsections;
+    uint32_t strings_size;
+};
+
+struct kbundle_module {
+    uint32_t name;
+    uint32_t buildid;
+    uint32_t buildid_size;
+    uint32_t reserved;
+};
+
+struct kbundle_section {
+    uint64_t addr;
+    uint32_t module;
+    uint32_t name;
+};
+
+static inline uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+/*
+ * Kernel text, and the core of modules from .text, merged and aligned
+ * to pages. The core of a module may have its text and data allocated
+ * separately, but its text always starts at .text and fits in coresize.
+ */
+vector<pair<uint64_t, uint64_t> > linux_kcore::text_ranges() const {
+    vector<pair<uint64_t, uint64_t> > ranges, merged;
+    ranges.emplace_back(vmlinux_start, vmlinux_end);
+    for (auto &[mod, sections] : mod_sections) {
+        auto text = sections.find(".text");
+        auto coresize = mod_coresizes.find(mod);
+        if (text == sections.end() || coresize == mod_coresizes.end())
+            continue;
+        ranges.emplace_back(text->second, text->second + coresize->second);
+    }
+    sort(ranges.begin(), ranges.end());
+    for (auto [start, end] : ranges) {
+        start &= ~uint64_t(KBUNDLE_ALIGN - 1);
+        end = align_up(end, KBUNDLE_ALIGN);
+        if (!merged.empty() && start <= merged.back().second)
+            merged.back().second = max(merged.back().second, end);
+        else
+            merged.emplace_back(start, end);
+    }
+    return merged;
+}
+
+static void write_all(FILE *fp, const void *data, size_t size,
+                      const char *filename) {
+    if (size && fwrite(data, size, 1, fp) != 1)
+        error(-1, errno, "Failed to write bundle %s", filename);
+}
+
+static void write_pad(FILE *fp, uint64_t size, const char *filename) {
+    static const uint8_t zeros[KBUNDLE_ALIGN] = {};
+    for (; size; size -= min<uint64_t>(size, sizeof(zeros)))
+        write_all(fp, zeros, min<uint64_t>(size, sizeof(zeros)), filename);
+}
+
+void linux_kcore::save_bundle(const char *filename) const {
+    // Metadata tables
+    string strings = kallsyms_names;
+    auto add_string = [&](string_view str) {
+        uint32_t offset = strings.size();
+        strings.append(str);
+        strings.push_back('\0');
+        return offset;
+    };
+    kbundle_header header = {};
+    memcpy(header.magic, KBUNDLE_MAGIC, sizeof(KBUNDLE_MAGIC));
+    header.vmlinux_start = vmlinux_start;
+    header.vmlinux_end = vmlinux_end;
+    header.bpf_start = bpf_start;
+    header.version = add_string(version);
+    vector<uint32_t> kmods;
+    for (auto &mod : kallsyms_mods)
+        kmods.push_back(add_string(mod));
+    vector<kbundle_module> mods;
+    vector<kbundle_section> sections;
+    for (auto &[mod, mod_secs] : mod_sections) {
+        kbundle_module module = {};
+        module.name = add_string(mod);
+        auto buildid = mod_buildids.find(mod);
+        if (buildid != mod_buildids.end()) {
+            module.buildid = strings.size();
+            module.buildid_size = buildid->second.size();
+            strings.append(buildid->second.begin(), buildid->second.end());
+        }
+        for (auto &[name, addr] : mod_secs)
+            sections.push_back({addr, uint32_t(mods.size()),
+                                add_string(name)});
+        mods.push_back(module);
+    }
+    if (strings.size() > UINT32_MAX)
+        error(-1, 0, "Bundle metadata too large");
+    // Copied field by field, so the padding is written as zeros
+    vector<kallsym> syms(kallsyms.size());
+    memset(syms.data(), 0, syms.size() * sizeof(kallsym));
+    for (size_t i = 0; i < kallsyms.size(); ++i) {
+        syms[i].addr = kallsyms[i].addr;
+        syms[i].name = kallsyms[i].name;
+        syms[i].module = kallsyms[i].module;
+        syms[i].type = kallsyms[i].type;
+    }
+    header.nsyms = kallsyms.size();
+    header.nkmods = kmods.size();
+    header.nmods = mods.size();
+    header.nsections = sections.size();
+    header.strings_size = strings.size();
+    size_t descsz = sizeof(header) +
+                    kallsyms.size() * sizeof(kallsym) +
+                    kmods.size() * sizeof(uint32_t) +
+                    mods.size() * sizeof(kbundle_module) +
+                    sections.size() * sizeof(kbundle_section) +
+                    strings.size();
+    // ELF layout
+    auto ranges = text_ranges();
+    Elf64_Ehdr ehdr = {};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_CORE;
+    ehdr.e_machine = EM_RISCV;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = sizeof(ehdr);
+    ehdr.e_ehsize = sizeof(ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = ranges.size() + 1;
+    Elf64_Nhdr nhdr = {};
+    nhdr.n_namesz = sizeof(KBUNDLE_NOTE_NAME);
+    nhdr.n_descsz = descsz;
+    nhdr.n_type = KBUNDLE_NOTE_TYPE;
+    uint64_t note_offset = sizeof(ehdr) + ehdr.e_phnum * sizeof(Elf64_Phdr);
+    uint64_t note_size = sizeof(nhdr) + align_up(sizeof(KBUNDLE_NOTE_NAME), 4) +
+                         align_up(descsz, 4);
+    vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+    phdrs[0].p_type = PT_NOTE;
+    phdrs[0].p_offset = note_offset;
+    phdrs[0].p_filesz = note_size;
+    phdrs[0].p_align = 4;
+    uint64_t data_offset = align_up(note_offset + note_size, KBUNDLE_ALIGN);
+    uint64_t offset = data_offset;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        auto &phdr = phdrs[i + 1];
+        phdr.p_type = PT_LOAD;
+        phdr.p_flags = PF_R | PF_X;
+        phdr.p_offset = offset;
+        phdr.p_vaddr = ranges[i].first;
+        phdr.p_filesz = phdr.p_memsz = ranges[i].second - ranges[i].first;
+        phdr.p_align = KBUNDLE_ALIGN;
+        offset += phdr.p_filesz;
+    }
+    auto_file fp(fopen(filename, "wb"), &fclose);
+    if (!fp)
+        error(-1, errno, "Failed to create bundle %s", filename);
+    write_all(fp.get(), &ehdr, sizeof(ehdr), filename);
+    write_all(fp.get(), phdrs.data(), phdrs.size() * sizeof(Elf64_Phdr),
+              filename);
+    write_all(fp.get(), &nhdr, sizeof(nhdr), filename);
+    write_all(fp.get(), KBUNDLE_NOTE_NAME, sizeof(KBUNDLE_NOTE_NAME),
+              filename);
+    write_pad(fp.get(), align_up(sizeof(KBUNDLE_NOTE_NAME), 4) -
+              sizeof(KBUNDLE_NOTE_NAME), filename);
+    write_all(fp.get(), &header, sizeof(header), filename);
+    write_all(fp.get(), syms.data(), syms.size() * sizeof(kallsym),
+              filename);
+    write_all(fp.get(), kmods.data(), kmods.size() * sizeof(uint32_t),
+              filename);
+    write_all(fp.get(), mods.data(), mods.size() * sizeof(kbundle_module),
+              filename);
+    write_all(fp.get(), sections.data(),
+              sections.size() * sizeof(kbundle_section), filename);
+    write_all(fp.get(), strings.data(), strings.size(), filename);
+    write_pad(fp.get(), data_offset - note_offset - sizeof(nhdr) -
+              align_up(sizeof(KBUNDLE_NOTE_NAME), 4) - descsz, filename);
+    // Text copied from kcore, holes between its segments are zeros
+    vector<uint8_t> buffer(1 << 20);
+    for (auto [start, end] : ranges) {
+        for (uint64_t addr = start; addr < end;) {
+            size_t chunk = min<uint64_t>(end - addr, buffer.size());
+            memset(buffer.data(), 0, chunk);
+            auto it = sect_by_vma.upper_bound(addr);
+            if (it != sect_by_vma.begin() &&
+                addr - prev(it)->first < prev(it)->second->size) {
+                auto *sect = prev(it)->second;
+                chunk = min<uint64_t>(chunk,
+                        sect->size - (addr - sect->vma));
+                ssize_t rc = pread(autofd.fd, buffer.data(), chunk,
+                                   sect->filepos + addr - sect->vma);
+                if (rc <= 0)
+                    error(-1, errno, "Failed to read kcore at %" PRIx64,
+                          addr);
+                chunk = rc;
+            } else if (it != sect_by_vma.end())
+                chunk = min<uint64_t>(chunk, it->first - addr);
+            write_all(fp.get(), buffer.data(), chunk, filename);
+            addr += chunk;
+        }
+    }
+    if (fflush(fp.get()))
+        error(-1, errno, "Failed to write bundle %s", filename);
+}
+
+void linux_kcore::load_bundle() {
+    unique_lock<mutex> guard(bfd_lock);
+    asection *section = bfd_get_section_by_name(abfd.get(), "note0");
+    if (!section)
+        error(-1, 0, "note not found in bundle %s", filename());
+    vector<uint8_t> notes(bfd_section_size(section));
+    if (!bfd_get_section_contents(abfd.get(), section, notes.data(),
+                                  0, notes.size()))
+        error(-1, 0, "failed to get section data");
+    guard.unlock();
+    const uint8_t *desc = nullptr, *end = notes.data() + notes.size();
+    size_t descsz = 0;
+    for (const uint8_t *p = notes.data(); !desc;) {
+        Elf64_Nhdr nhdr;
+        if (size_t(end - p) < sizeof(nhdr))
+            error(-1, 0, "metadata not found in bundle %s", filename());
+        memcpy(&nhdr, p, sizeof(nhdr));
+        p += sizeof(nhdr);
+        const uint8_t *name = p;
+        if (size_t(end - p) < align_up(nhdr.n_namesz, 4))
+            error(-1, 0, "truncated note in bundle %s", filename());
+        p += align_up(nhdr.n_namesz, 4);
+        if (size_t(end - p) < nhdr.n_descsz)
+            error(-1, 0, "truncated note in bundle %s", filename());
+        if (nhdr.n_type == KBUNDLE_NOTE_TYPE &&
+            nhdr.n_namesz == sizeof(KBUNDLE_NOTE_NAME) &&
+            !memcmp(name, KBUNDLE_NOTE_NAME, sizeof(KBUNDLE_NOTE_NAME))) {
+            desc = p;
+            descsz = nhdr.n_descsz;
+        }
+        p += align_up(nhdr.n_descsz, 4);
+    }
+    kbundle_header header;
+    if (descsz < sizeof(header))
+        error(-1, 0, "metadata too short in bundle %s", filename());
+    memcpy(&header, desc, sizeof(header));
+    if (memcmp(header.magic, KBUNDLE_MAGIC, sizeof(KBUNDLE_MAGIC)))
+        error(-1, 0, "unknown metadata version in bundle %s", filename());
+    if (descsz != sizeof(header) +
+                  uint64_t(header.nsyms) * sizeof(kallsym) +
+                  uint64_t(header.nkmods) * sizeof(uint32_t) +
+                  uint64_t(header.nmods) * sizeof(kbundle_module) +
+                  uint64_t(header.nsections) * sizeof(kbundle_section) +
+                  header.strings_size)
+        error(-1, 0, "corrupted metadata in bundle %s", filename());
+    vmlinux_start = header.vmlinux_start;
+    vmlinux_end = header.vmlinux_end;
+    bpf_start = header.bpf_start;
+    const uint8_t *p = desc + sizeof(header);
+    auto read_table = [&p](auto &table, size_t count) {
+        table.resize(count);
+        memcpy(table.data(), p, count * sizeof(table[0]));
+        p += count * sizeof(table[0]);
+    };
+    read_table(kallsyms, header.nsyms);
+    vector<uint32_t> kmods;
+    read_table(kmods, header.nkmods);
+    vector<kbundle_module> mods;
+    read_table(mods, header.nmods);
+    vector<kbundle_section> sections;
+    read_table(sections, header.nsections);
+    kallsyms_names.assign((const char*)p, header.strings_size);
+    auto get_string = [&](uint32_t offset) -> const char* {
+        if (offset >= kallsyms_names.size() ||
+            !memchr(&kallsyms_names[offset], '\0',
+                    kallsyms_names.size() - offset))
+            error(-1, 0, "invalid string in bundle %s", filename());
+        return &kallsyms_names[offset];
+    };
+    for (auto &sym : kallsyms) {
+        get_string(sym.name);
+        if (sym.module != kallsym::no_module && sym.module >= kmods.size())
+            error(-1, 0, "invalid module in bundle %s", filename());
+    }
+    for (auto offset : kmods)
+        kallsyms_mods.emplace_back(get_string(offset));
+    version = get_string(header.version);
+    vector<mod_sections_map::iterator> mod_its;
+    for (auto &mod : mods) {
+        auto mod_it = mod_sections.emplace(get_string(mod.name),
+                                           map<string, uint64_t>{}).first;
+        mod_its.push_back(mod_it);
+        if (!mod.buildid_size)
+            continue;
+        if (uint64_t(mod.buildid) + mod.buildid_size > kallsyms_names.size())
+            error(-1, 0, "invalid build-id in bundle %s", filename());
+        auto *buildid = (const uint8_t*)&kallsyms_names[mod.buildid];
+        mod_buildids.emplace(mod_it->first, vector<uint8_t>(
+                buildid, buildid + mod.buildid_size));
+    }
+    for (auto &sect : sections) {
+        if (sect.module >= mod_its.size())
+            error(-1, 0, "invalid module in bundle %s", filename());
+        add_mod_section(mod_its[sect.module], get_string(sect.name),
+                        sect.addr);
+    }
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * kcapture.cpp - Capture the kernel core into a portable bundle
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <error.h>
+#include "linux.h"
+#include "opts-def.h"
+
+using namespace std;
+
+static struct option long_opts[] = {
+        {"help",      no_argument,       NULL, 'h'},
+        {"procfs",    required_argument, NULL, 'p'},
+        {"sysfs",     required_argument, NULL, 'y'},
+        {NULL, 0,                        NULL, 0},
+};
+
+static const char short_opts[] = "hp:y:";
+
+static void help(const char *argv0) {
+    error(-1, 0, "Usage: \n"
+                  "\t%s: [OPTIONS...] <bundle file>\n"
+                  "\n"
+                  "\t-h, --help            Display this help message\n"
+                  "\t-p, --procfs [path]   Path to procfs (default /proc)\n"
+                  "\t-y, --sysfs [path]    Path to sysfs (default /sys)\n"
+                  "\n"
+                  "\tThe bundle is loaded by nexusrv-replay --kbundle\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *sysfs = "/sys";
+    const char *procfs = "/proc";
+    OPT_PARSE_BEGIN
+    OPT_PARSE_H_HELP
+    OPT_PARSE_P_PROCFS
+    OPT_PARSE_Y_SYSFS
+    OPT_PARSE_END
+    if (argc == optind)
+        error(-1, 0, "Insufficient arguments");
+    // Object files are not needed for capturing, so none are searched
+    linux_kcore kcore(procfs, sysfs, {}, {});
+    kcore.save_bundle(argv[optind]);
+    return 0;
+}
@@ -204,6 +204,7 @@ linux_ucore::linux_ucore(const char *filename,
                          vector<string> sysroot_dirs, vector<string> dbg_dirs) :
         linux_core_file(filename, move(sysroot_dirs), move(dbg_dirs))
 {
+    unique_lock<mutex> guard(bfd_lock);
     asection *section = bfd_get_section_by_name(abfd.get(),
                                                 ".note.linuxcore.file");
     if (!section)
@@ -214,6 +215,7 @@ linux_ucore::linux_ucore(const char *filename,
                                   0, sec_data.size()))
         error(-1, 0, "failed to get section data");
     unsigned long march = bfd_get_mach(abfd.get());
+    guard.unlock();
     switch (march) {
         case bfd_mach_riscv32:
             parse_ucore_metadata<uint32_t>(this, sec_data);
@@ -254,11 +256,30 @@ linux_kcore::linux_kcore(const char *procfs,
                          vector<string> sysroot_dirs,
                          vector<string> dbg_dirs) :
         linux_core_file(cppfmt("%s/kcore", procfs).c_str()) {
+    // Sized as the kernel address space, and only mmap-able by segment
+    whole_file_mappable = false;
     vmlinux_start = vmlinux_end = bpf_start = kaslr_offset = 0;
+    load_kallsyms(procfs);
+    version = read_file(cppfmt("%s/version", procfs).c_str());
+    load_modules(sysfs);
+    init_store(move(sysroot_dirs), move(dbg_dirs));
+}
+
+linux_kcore::linux_kcore(const char *bundle,
+                         vector<string> sysroot_dirs,
+                         vector<string> dbg_dirs) :
+        linux_core_file(bundle) {
+    vmlinux_start = vmlinux_end = bpf_start = kaslr_offset = 0;
+    load_bundle();
+    init_store(move(sysroot_dirs), move(dbg_dirs));
+}
+
+void linux_kcore::load_kallsyms(const char *procfs) {
     auto_file fkallsyms(fopen(cppfmt(
             "%s/kallsyms", procfs).c_str(), "r"), &fclose);
     if (!fkallsyms)
         error(-1, 0, "unable to open kallsyms, linux_kcore cannot continue");
+    unordered_map<string, uint16_t> mod_ids;
     sym_iterate_kallsyms(fkallsyms.get(), [&](
             uint64_t addr, char type, const char *sym, const char* mod) {
         if (!vmlinux_start && type == 'T' && !strcmp(sym, "_start"))
@@ -267,25 +288,63 @@ linux_kcore::linux_kcore(const char *procfs,
             vmlinux_end = addr;
         if (mod && !strcmp(mod, "[bpf]") && (!bpf_start || bpf_start > addr))
             bpf_start = addr;
-        auto modp = mod ? &*kallsyms_mods.emplace(mod).first : nullptr;
-        kallsyms.emplace(addr, make_tuple(string(sym), type,modp));
+        uint16_t module = kallsym::no_module;
+        if (mod) {
+            auto [it, inserted] = mod_ids.try_emplace(mod,
+                                                      kallsyms_mods.size());
+            if (inserted) {
+                if (kallsyms_mods.size() >= kallsym::no_module)
+                    error(-1, 0, "too many modules in kallsyms");
+                kallsyms_mods.emplace_back(mod);
+            }
+            module = it->second;
+        }
+        if (kallsyms_names.size() > UINT32_MAX)
+            error(-1, 0, "kallsyms too large");
+        kallsyms.push_back({addr, uint32_t(kallsyms_names.size()),
+                            module, type});
+        kallsyms_names.append(sym);
+        kallsyms_names.push_back('\0');
         return true;
     });
-    if (!vmlinux_start || !vmlinux_end)
-        error(-1, 0, "failed to identify vmlinux_start/end");
-    auto [kernel_version, release_str] = parse_kernel_ver(read_file(
-            cppfmt("%s/version", procfs).c_str()));
-    kernel_release = move(release_str);
-    store = make_shared<linux_kmods_file_store>(
-            move(sysroot_dirs), move(dbg_dirs), move(kernel_version));
-    auto vmlinux = store->get(str_kernel.c_str());
-    if (vmlinux) {
-        // Takes care of KASLR offset
-        auto &sections = vmlinux->get_sec_by_name();
-        auto it = sections.find(".head.text"sv);
-        if (it != sections.end())
-            kaslr_offset = vmlinux_start - it->second->vma;
+    kallsyms_names.shrink_to_fit();
+    /*
+     * Keep one symbol per address: the last global one if any,
+     * otherwise the last one, e.g., the alias defined last
+     */
+    stable_sort(kallsyms.begin(), kallsyms.end(),
+                [](const kallsym &l, const kallsym &r) {
+        return l.addr < r.addr;
+    });
+    auto out = kallsyms.begin();
+    for (auto it = kallsyms.begin(); it != kallsyms.end();) {
+        auto pick = it;
+        for (auto end = it; end != kallsyms.end() && end->addr == it->addr;
+             ++end)
+            if (bool(isupper(end->type)) >= bool(isupper(pick->type)))
+                pick = end;
+        auto addr = it->addr;
+        *out++ = *pick;
+        while (it != kallsyms.end() && it->addr == addr)
+            ++it;
     }
+    kallsyms.erase(out, kallsyms.end());
+    kallsyms.shrink_to_fit();
+}
+
+void linux_kcore::add_mod_section(mod_sections_map::iterator mod_it,
+                                  string name, uint64_t addr) {
+    auto section_it = mod_it->second.emplace(move(name), addr).first;
+    auto [it, inserted] = sections_map.emplace(addr,
+         make_pair(&mod_it->first, &section_it->first));
+    if (!inserted)
+        error(-1, 0,
+              "overlapping section @%" PRIx64 " %s:%s vs. %s:%s", addr,
+            mod_it->first.c_str(), section_it->first.c_str(),
+            it->second.first->c_str(), it->second.second->c_str());
+}
+
+void linux_kcore::load_modules(const char *sysfs) {
     directory_iterator di(cppfmt("%s/module", sysfs));
     for (auto& dentry : di) {
         auto& path = dentry.path();
@@ -299,6 +358,11 @@ linux_kcore::linux_kcore(const char *procfs,
         if (exists(buildid_path, ec))
             mod_buildids.emplace(mod_it->first,
                                  read_file_binary(buildid_path.c_str()));
+        // Only used to capture the module text in bundle
+        auto coresize_path = path / "coresize";
+        if (exists(coresize_path, ec))
+            mod_coresizes.emplace(mod_it->first, strtoull(
+                    read_file(coresize_path.c_str()).c_str(), nullptr, 0));
         for (auto& dentry : directory_iterator(section_dir)) {
             auto& path = dentry.path();
             auto sec_name = path.filename().string();
@@ -308,18 +372,27 @@ linux_kcore::linux_kcore(const char *procfs,
                 continue;
             uint64_t addr = strtoull(read_file(path.c_str()).c_str(),
                                      nullptr, 16);
-            auto section_it = mod_it->second.emplace(
-                    move(sec_name), addr).first;
-            auto [it, inserted] = sections_map.emplace(addr,
-                 make_pair(&mod_it->first,&section_it->first));
-            if (!inserted)
-                error(-1, 0,
-                      "overlapping section @%" PRIx64 " %s:%s vs. %s:%s", addr,
-                    mod_it->first.c_str(), section_it->first.c_str(),
-                    it->second.first->c_str(), it->second.second->c_str());
+            add_mod_section(mod_it, move(sec_name), addr);
         }
     }
 }
+void linux_kcore::init_store(vector<string> sysroot_dirs,
+                             vector<string> dbg_dirs) {
+    if (!vmlinux_start || !vmlinux_end)
+        error(-1, 0, "failed to identify vmlinux_start/end");
+    auto [kernel_version, release_str] = parse_kernel_ver(version);
+    kernel_release = move(release_str);
+    store = make_shared<linux_kmods_file_store>(
+            move(sysroot_dirs), move(dbg_dirs), move(kernel_version));
+    auto vmlinux = store->get(str_kernel.c_str());
+    if (vmlinux) {
+        // Takes care of KASLR offset
+        auto &sections = vmlinux->get_sec_by_name();
+        auto it = sections.find(".head.text"sv);
+        if (it != sections.end())
+            kaslr_offset = vmlinux_start - it->second->vma;
+    }
+}
 
 tuple<const std::string*, const std::string*, uint64_t>
 linux_kcore::get_file_vma(uint64_t vma) {
@@ -341,32 +414,26 @@ linux_kcore::get_file_vma(uint64_t vma) {
                       vma - it->first);
 }
 
-static int compare_sym_type(char l, char r) {
-    return int(isupper(l)) - int(isupper(r));
-}
-
 tuple<const std::string*, const std::string*, uint64_t>
 linux_kcore::get_label(uint64_t vma) {
-    auto it = kallsyms.upper_bound(vma);
-    optional<decltype(it)> last;
-    while (it != kallsyms.begin()) {
-        --it;
-        if (!last.has_value()) {
-            last.emplace(it);
-            continue;
-        }
-        if (it->first < (*last)->first)
-            break;
-        if (compare_sym_type(get<1>(it->second),
-                             get<1>((*last)->second)) > 0)
-            last.emplace(it);
-    }
-    if (!last.has_value())
+    const kallsym *base = kallsyms.data();
+    size_t n = kallsyms.size();
+    if (!n || vma < base->addr)
         return no_map_or_sym;
-    return make_tuple(
-            &get<0>((*last)->second),
-            get<2>((*last)->second),
-            (*last)->first);
+    // Branch-free binary search of the last symbol <= vma
+    while (n > 1) {
+        size_t half = n / 2;
+        base = base[half].addr <= vma ? base + half : base;
+        n -= half;
+    }
+    auto it = labels.find(base->name);
+    if (it == labels.end())
+        it = labels.emplace(base->name,
+                            &kallsyms_names[base->name]).first;
+    return make_tuple(&it->second,
+                      base->module == kallsym::no_module ?
+                      nullptr : &kallsyms_mods[base->module],
+                      base->addr);
 }
 
 vector<string> split_dirs(const string& str) {
@@ -10,6 +10,7 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <unordered_map>
 #include <filesystem>
 #include "objfile.h"
 
@@ -86,23 +87,59 @@ private:
 };
 
 struct linux_kcore : linux_core_file {
+    // From {procfs}/kcore, kallsyms, version and {sysfs}/module
     linux_kcore(const char *procfs, const char *sysfs,
                 std::vector<std::string> sysroot_dirs = {},
                 std::vector<std::string> dbg_dirs = {});
+    // From a bundle written by save_bundle
+    linux_kcore(const char *bundle,
+                std::vector<std::string> sysroot_dirs,
+                std::vector<std::string> dbg_dirs);
+    /*
+     * Write the kernel and module text, and the metadata to a bundle,
+     * which can be loaded on another machine without procfs/sysfs
+     */
+    void save_bundle(const char *filename) const;
     std::tuple<const std::string*, const std::string*, uint64_t>
         get_file_vma(uint64_t vma) override;
     std::tuple<const std::string*, const std::string*, uint64_t>
         get_label(uint64_t) override;
 private:
+    typedef std::map<std::string, std::map<std::string, uint64_t> >
+        mod_sections_map;
+    void load_kallsyms(const char *procfs);
+    void load_modules(const char *sysfs);
+    void load_bundle();
+    void add_mod_section(mod_sections_map::iterator mod_it,
+                         std::string name, uint64_t addr);
+    void init_store(std::vector<std::string> sysroot_dirs,
+                    std::vector<std::string> dbg_dirs);
+    std::vector<std::pair<uint64_t, uint64_t> > text_ranges() const;
     uint64_t vmlinux_start;
     uint64_t vmlinux_end;
     uint64_t bpf_start;
     uint64_t kaslr_offset;
+    std::string version;    // Content of {procfs}/version
     std::string kernel_release;
-    std::set<std::string> kallsyms_mods;
-    std::multimap<uint64_t, std::tuple<std::string, char, const std::string*> > kallsyms;
-    std::map<std::string, std::map<std::string, uint64_t> > mod_sections;
+    /*
+     * Flat table of kallsyms sorted by address, with one symbol per
+     * address, preferring global ones. Names are offsets in one pool.
+     */
+    struct kallsym {
+        static constexpr uint16_t no_module = UINT16_MAX;
+        uint64_t addr;
+        uint32_t name;      // Offset in kallsyms_names
+        uint16_t module;    // Index in kallsyms_mods
+        char type;
+    };
+    std::vector<kallsym> kallsyms;
+    std::string kallsyms_names;
+    std::vector<std::string> kallsyms_mods;
+    // Labels returned by get_label, keyed by name offset
+    std::unordered_map<uint32_t, std::string> labels;
+    mod_sections_map mod_sections;
     std::map<std::string_view, std::vector<uint8_t> > mod_buildids;
+    std::map<std::string_view, uint64_t> mod_coresizes;
     std::map<uint64_t, std::pair<const std::string*, const std::string*> > sections_map;
 };
 
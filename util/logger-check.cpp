@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * logger-check.cpp - Self-checks of the logger output
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <error.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "logger.h"
+
+using namespace std;
+
+// Output of lines written by fn to a memstream
+template <typename F>
+static string capture(F fn) {
+    char *buf = nullptr;
+    size_t len = 0;
+    FILE *fp = open_memstream(&buf, &len);
+    if (!fp)
+        error(-1, errno, "open_memstream failed");
+    {
+        logger l(fp);
+        fn(l);
+    }
+    fclose(fp);
+    string ret(buf, len);
+    free(buf);
+    return ret;
+}
+
+/*
+ * A repeated line, followed by a strict prefix of it, with the chunk
+ * filled to every offset around the end, so the marker and the prefix
+ * are written across the chunk boundary. Filler lines are short to keep
+ * the chunk at its default size.
+ */
+static void check_prefix_at_chunk_end() {
+    const size_t chunk = 1 << 20;
+    const size_t nfill = (chunk - 2200) / 100;
+    string prev(1000, 'p');
+    string prefix = prev.substr(0, 999);
+    string filler;
+    for (size_t i = 0; i < nfill; ++i)
+        filler += string(99, i % 2 ? 'g' : 'f') + "\n";
+    for (size_t extra = 0; extra < 1300; ++extra) {
+        string last(extra, 'x');
+        auto out = capture([&](logger &l) {
+            for (size_t i = 0; i < nfill; ++i) {
+                l.newline();
+                l.print(filler.c_str() + i * 100, 99);
+            }
+            l.newline();
+            l.print(last.c_str());
+            for (int i = 0; i < 2; ++i) {
+                l.newline();
+                l.print(prev.c_str());
+            }
+            l.newline();
+            l.print(prefix.c_str());
+        });
+        string expected = filler + (extra ? last + "\n" : "") + prev + "\n" +
+                          "<repeated 1 times>\n" + prefix + "\n";
+        if (out != expected)
+            error(-1, 0, "Prefix line mismatch with %zu extra bytes", extra);
+    }
+}
+
+// Repeats are folded, and counted again after a different line
+static void check_repeated() {
+    auto out = capture([](logger &l) {
+        for (int i = 0; i < 3; ++i) {
+            l.newline();
+            l.format("a %d", 1);
+        }
+        l.newline();
+        l.print("b");
+        l.pad(2);
+        l.print_hex(0xff);
+        l.newline();
+        l.print("b  ff");
+    });
+    if (out != "a 1\n<repeated 2 times>\nb  ff\n<repeated 1 times>\n")
+        error(-1, 0, "Repeated lines mismatch: %s", out.c_str());
+}
+
+/*
+ * Lines written before a fatal error() are not lost, including the
+ * queued chunks and held lines, whose deferred fields are left out
+ */
+static void check_fatal_exit() {
+    FILE *fp = tmpfile();
+    if (!fp)
+        error(-1, errno, "tmpfile failed");
+    const int nlines = 100000;
+    pid_t pid = fork();
+    if (pid < 0)
+        error(-1, errno, "fork failed");
+    if (!pid) {
+        freopen("/dev/null", "w", stderr);
+        logger l(fp);
+        l.set_deferral({[](uint64_t) { return false; },
+                        [](logger &, uint64_t) {}});
+        for (int i = 0; i < nlines; ++i) {
+            l.newline();
+            l.format("line %d", i);
+        }
+        l.defer(0);
+        l.print(" held");
+        l.newline();
+        l.print("last");
+        error(-1, 0, "Expected fatal error");
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid)
+        error(-1, errno, "waitpid failed");
+    string out;
+    char buf[65536];
+    size_t n;
+    rewind(fp);
+    while ((n = fread(buf, 1, sizeof(buf), fp)))
+        out.append(buf, n);
+    fclose(fp);
+    string tail = "line " + to_string(nlines - 1) + " held\nlast\n";
+    if (out.size() < tail.size() ||
+        out.compare(out.size() - tail.size(), tail.size(), tail) ||
+        out.compare(0, 7, "line 0\n"))
+        error(-1, 0, "Output lost on fatal error, %zu bytes", out.size());
+}
+
+// A forked child exiting doesn't write out the logger of the parent
+static void check_forked_exit() {
+    FILE *fp = tmpfile();
+    if (!fp)
+        error(-1, errno, "tmpfile failed");
+    {
+        logger l(fp);
+        l.newline();
+        l.print("parent");
+        pid_t pid = fork();
+        if (pid < 0)
+            error(-1, errno, "fork failed");
+        if (!pid)
+            exit(0);
+        int status;
+        if (waitpid(pid, &status, 0) != pid)
+            error(-1, errno, "waitpid failed");
+    }
+    char buf[64];
+    rewind(fp);
+    size_t n = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    if (string(buf, n) != "parent\n")
+        error(-1, 0, "Output of the parent written by the child");
+}
+
+int main() {
+    check_repeated();
+    check_prefix_at_chunk_end();
+    check_fatal_exit();
+    check_forked_exit();
+    return 0;
+}
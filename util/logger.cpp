@@ -6,32 +6,227 @@
 #include <cstring>
 #include <cassert>
 #include <cstdarg>
+#include <cerrno>
+#include <charconv>
+#include <error.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <atomic>
 #include "logger.h"
 
 using namespace std;
 
+// Live loggers, flushed on exit()
+static mutex loggers_lock;
+static unordered_set<logger*> loggers;
+static thread_local logger *thread_logger;
+// Process of the last logger created, to tell a child of fork() apart
+static atomic<pid_t> loggers_pid;
+
+logger::logger(FILE *fp) : fp(fp), fd(fileno(fp)), line_start(0),
+                           dirty(false), bufpos(0), repeated(0),
+                           draining(false), stopping(false),
+                           submitted(0), written(0),
+                           prev_thread_logger(thread_logger),
+                           pid(getpid()) {
+    static once_flag registered;
+    call_once(registered, [] { atexit(flush_at_exit); });
+    // Anything buffered by stdio goes before the chunks
+    if (fd >= 0)
+        fflush(fp);
+    thread_logger = this;
+    loggers_pid = pid;
+    lock_guard<mutex> guard(loggers_lock);
+    loggers.insert(this);
+}
+
+logger::~logger() {
+    {
+        lock_guard<mutex> guard(loggers_lock);
+        loggers.erase(this);
+    }
+    thread_logger = prev_thread_logger;
+    flush();
+    if (!writer.joinable())
+        return;
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    writer.join();
+}
+
+static void write_all(int fd, iovec *iov, int cnt) {
+    while (cnt) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error(-1, errno, "Failed to write output");
+        }
+        for (; cnt && (size_t)n >= iov->iov_len; ++iov, --cnt)
+            n -= iov->iov_len;
+        if (cnt) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Writer thread, writes all pending chunks at once
+void logger::write_chunks() {
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        cond.wait(guard, [this] { return !pending.empty() || stopping; });
+        if (pending.empty())
+            return;
+        vector<chunk> batch;
+        for (auto &c : pending)
+            batch.push_back(std::move(c));
+        pending.clear();
+        guard.unlock();
+        iovec iov[max_pending];
+        for (size_t i = 0; i < batch.size(); ++i)
+            iov[i] = {batch[i].data.get(), batch[i].size};
+        write_all(fd, iov, batch.size());
+        guard.lock();
+        for (auto &c : batch) {
+            c.size = 0;
+            spare.push_back(std::move(c));
+        }
+        written += batch.size();
+        cond.notify_all();
+    }
+}
+
+logger::chunk logger::take_chunk(size_t len) {
+    {
+        lock_guard<mutex> guard(lock);
+        for (auto it = spare.begin(); it != spare.end(); ++it) {
+            if (it->capacity < len)
+                continue;
+            chunk c = std::move(*it);
+            spare.erase(it);
+            return c;
+        }
+    }
+    chunk c;
+    c.capacity = max(chunk_size, len * 2);
+    c.data.reset(new char[c.capacity]);
+    return c;
+}
+
+void logger::submit(chunk c) {
+    if (fd < 0) {
+        if (fwrite(c.data.get(), c.size, 1, fp) != 1)
+            error(-1, errno, "Failed to write output");
+        c.size = 0;
+        spare.push_back(std::move(c));
+        return;
+    }
+    // Written to fp directly after the last flush()
+    fflush(fp);
+    unique_lock<mutex> guard(lock);
+    if (!writer.joinable())
+        writer = thread(&logger::write_chunks, this);
+    cond.wait(guard, [this] { return pending.size() < max_pending; });
+    pending.push_back(std::move(c));
+    ++submitted;
+    cond.notify_all();
+}
+
+// Bytes needed after the fragment for make_dirty()
+size_t logger::headroom() const {
+    return dirty ? 0 : bufpos + marker_max;
+}
+
+// Room at the tail of out for the next fragment
+size_t logger::room() const {
+    size_t left = out.capacity - out.size;
+    return left > headroom() ? left - headroom() : 0;
+}
+
+/*
+ * Make sure len bytes, and the headroom, fit at the tail of out.
+ * Complete lines are handed off to the writer, and the current line is
+ * carried to the next chunk.
+ */
+char *logger::reserve(size_t len) {
+    if (out.capacity - out.size < len + headroom()) {
+        size_t carry = out.size - line_start;
+        size_t need = carry + len + headroom();
+        chunk next = take_chunk(need);
+        if (carry)
+            memcpy(next.data.get(), out.data.get() + line_start, carry);
+        next.size = carry;
+        out.size = line_start;
+        if (out.size)
+            submit(std::move(out));
+        out = std::move(next);
+        line_start = 0;
+    }
+    return out.data.get() + out.size;
+}
+
+/*
+ * The current line differs from last from now on. Write the marker of
+ * repeated lines, and the prefix matched so far before the fragment of
+ * len bytes at the tail of out.
+ */
+void logger::make_dirty(size_t len) {
+    char *str = out.data.get() + out.size;
+    char marker[marker_max];
+    size_t mlen = 0;
+    if (repeated)
+        mlen = snprintf(marker, sizeof(marker),
+                        "<repeated %zu times>\n", repeated);
+    repeated = 0;
+    memmove(str + mlen + bufpos, str, len);
+    memcpy(str, marker, mlen);
+    memcpy(str + mlen, last.data(), bufpos);
+    out.size += mlen;
+    line_start = out.size;
+    out.size += bufpos;
+    dirty = true;
+}
+
 void logger::maybe_marker() {
     if (!repeated)
         return;
-    fprintf(fp, "<repeated %zu times>\n", repeated);
+    char *p = reserve(marker_max);
+    out.size += snprintf(p, marker_max, "<repeated %zu times>\n", repeated);
+    line_start = out.size;
     repeated = 0;
 }
 
-size_t logger::print(const char *str, size_t len) {
-    assert(bufpos <= buf.size());
-    size_t left = buf.size() - bufpos;
-    if (left >= len &&
-        !strncmp(str, buf.c_str() + bufpos, len)) {
-        // Repeating previous lines
-        goto done;
+size_t logger::emit(const char *str, size_t len) {
+    if (!dirty && bufpos + len <= last.size() &&
+        !memcmp(str, last.data() + bufpos, len)) {
+        // Repeating the previous line
+        bufpos += len;
+        return len;
     }
-    dirty = true;
-    maybe_marker();
-    if (buf.size() < bufpos + len)
-        buf.resize(bufpos + len);
-    memcpy(buf.data() + bufpos, str, len);
-done:
-    bufpos += len;
+    memcpy(reserve(len), str, len);
+    if (!dirty)
+        make_dirty(len);
+    out.size += len;
+    return len;
+}
+
+// Text segment at the end of the held current line
+string &logger::held_text() {
+    auto &segments = held.back().segments;
+    if (segments.empty() || segments.back().deferred)
+        segments.push_back({"", false, 0});
+    return segments.back().text;
+}
+
+size_t logger::print(const char *str, size_t len) {
+    if (held.empty() || draining)
+        return emit(str, len);
+    held_text().append(str, len);
     return len;
 }
 
@@ -39,31 +234,204 @@ size_t logger::print(const char *str) {
     return print(str, strlen(str));
 }
 
+size_t logger::print_dec(uint64_t value) {
+    char buf[24];
+    return print(buf, to_chars(buf, buf + sizeof(buf), value).ptr - buf);
+}
+
+size_t logger::print_hex(uint64_t value) {
+    char buf[24];
+    return print(buf, to_chars(buf, buf + sizeof(buf), value, 16).ptr - buf);
+}
+
+size_t logger::pad(size_t width) {
+    static const char spaces[] = "                                ";
+    for (size_t left = width; left; ) {
+        size_t n = min(left, sizeof(spaces) - 1);
+        print(spaces, n);
+        left -= n;
+    }
+    return width;
+}
+
+// Formatted in place with one pass, unless it doesn't fit
 size_t logger::format(const char *fmt, ...) {
-    va_list vl;
-    va_start(vl, fmt);
-    int len = vsnprintf(nullptr, 0, fmt, vl);
-    char localbuf[len + 1];
-    va_end(vl);
+    va_list vl, vl2;
     va_start(vl, fmt);
-    vsprintf(localbuf, fmt, vl);
+    va_copy(vl2, vl);
+    size_t len;
+    if (held.empty() || draining) {
+        char *p = reserve(128);
+        size_t avail = room();
+        len = vsnprintf(p, avail, fmt, vl);
+        if (len >= avail)
+            vsnprintf(reserve(len + 1), len + 1, fmt, vl2);
+        if (!dirty && bufpos + len <= last.size() &&
+            !memcmp(out.data.get() + out.size, last.data() + bufpos, len))
+            bufpos += len;
+        else {
+            if (!dirty)
+                make_dirty(len);
+            out.size += len;
+        }
+    } else {
+        auto &text = held_text();
+        size_t pos = text.size();
+        text.resize(pos + 128);
+        len = vsnprintf(text.data() + pos, 128 + 1, fmt, vl);
+        text.resize(pos + len);
+        if (len > 128)
+            vsnprintf(text.data() + pos, len + 1, fmt, vl2);
+    }
+    va_end(vl2);
     va_end(vl);
-    return print(localbuf, len);
+    return len;
 }
 
-void logger::newline() {
-    buf.resize(bufpos);
-    bufpos = 0;
+void logger::defer(uint64_t key) {
+    if (held.empty()) {
+        /*
+         * Move the current line to held. last is intact if not dirty,
+         * and the line is compared with it again when drained.
+         */
+        string text = dirty ?
+                string(out.data.get() + line_start, out.size - line_start) :
+                last.substr(0, bufpos);
+        held.push_back({{{std::move(text), false, 0}}, dirty});
+        out.size = line_start;
+        bufpos = 0;
+        dirty = false;
+    }
+    held.back().segments.push_back({"", true, key});
+}
+
+// Finish the current line
+void logger::complete() {
+    // Shorter than the previous line with the same prefix
+    if (!dirty && bufpos && bufpos < last.size()) {
+        reserve(0);
+        make_dirty(0);
+    }
     if (dirty) {
-        maybe_marker();
-        fprintf(fp, "%s\n", buf.c_str());
-    } else if (!buf.empty())
+        char *p = reserve(1);
+        last.assign(out.data.get() + line_start, p);
+        *p = '\n';
+        ++out.size;
+    } else if (bufpos)
         ++repeated;
+    else
+        last.clear();
+    line_start = out.size;
+    bufpos = 0;
     dirty = false;
 }
 
+// Write out held lines in order, till one is not ready, unless wait
+void logger::drain(bool wait) {
+    while (!held.empty()) {
+        auto &line = held.front();
+        bool current = held.size() == 1;
+        bool has_deferred = false;
+        for (auto &segment : line.segments) {
+            if (!segment.deferred)
+                continue;
+            has_deferred = true;
+            if (!wait && !deferred.ready(segment.key))
+                return;
+        }
+        // Keep holding the current line till it's completed
+        if (current && has_deferred)
+            return;
+        draining = true;
+        // Marker of a dirty line is written when it's held
+        line_start = out.size;
+        bufpos = 0;
+        dirty = line.dirty;
+        for (auto &segment : line.segments) {
+            if (segment.deferred)
+                deferred.render(*this, segment.key);
+            else
+                emit(segment.text.data(), segment.text.size());
+        }
+        draining = false;
+        held.pop_front();
+        if (current)
+            return;
+        complete();
+    }
+}
+
+void logger::newline() {
+    if (held.empty()) {
+        complete();
+        return;
+    }
+    held.push_back({{}, false});
+    drain(held.size() > max_held);
+}
+
+void logger::wait_written() {
+    if (!writer.joinable() || writer.get_id() == this_thread::get_id())
+        return;
+    // Only the chunks submitted so far, as another thread might go on
+    unique_lock<mutex> guard(lock);
+    size_t target = submitted;
+    cond.wait(guard, [this, target] { return written >= target; });
+}
+
 void logger::flush() {
     newline();
-    buf.clear();
+    drain(true);
+    last.clear();
     maybe_marker();
-}
\ No newline at end of file
+    if (out.size)
+        submit(std::move(out));
+    out = {};
+    line_start = 0;
+    wait_written();
+}
+
+/*
+ * Write out everything on exit of this thread. Deferred fields are left
+ * out, as the symbol lookup might be what failed, or hold its locks.
+ */
+void logger::salvage() {
+    // The line being drained is already partially in out
+    if (draining) {
+        draining = false;
+        held.pop_front();
+        complete();
+    } else if (held.empty())
+        complete();
+    while (!held.empty()) {
+        line_start = out.size;
+        bufpos = 0;
+        dirty = held.front().dirty;
+        for (auto &segment : held.front().segments)
+            if (!segment.deferred)
+                emit(segment.text.data(), segment.text.size());
+        held.pop_front();
+        complete();
+    }
+    maybe_marker();
+    if (out.size)
+        submit(std::move(out));
+    out = {};
+    line_start = 0;
+}
+
+/*
+ * Loggers copied from the parent by fork() are left alone in the child,
+ * as the parent writes them out, and their locks might be held.
+ */
+void logger::flush_at_exit() {
+    pid_t self = getpid();
+    if (loggers_pid != self)
+        return;
+    if (thread_logger && thread_logger->pid == self)
+        thread_logger->salvage();
+    lock_guard<mutex> guard(loggers_lock);
+    for (auto *l : loggers)
+        if (l->pid == self)
+            l->wait_written();
+}
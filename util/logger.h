@@ -7,25 +7,130 @@
 #define LIBNEXUS_LOGGER_H
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 #include <cstdio>
+#include <sys/types.h>
 
+/*
+ * Line oriented text output
+ *
+ * Text is formatted in place into large chunks, and full chunks are
+ * written to the fd of fp by a background thread with writev(), or with
+ * fwrite() if fp has no fd, e.g., open_memstream. A line identical to
+ * the previous one is counted instead of written, and followed by
+ * "<repeated N times>". Call flush() before writing to fp directly.
+ *
+ * On exit(), e.g., by a fatal error(), the logger of the exiting thread
+ * writes out everything, and the chunks queued by other loggers are
+ * written before the process is gone. A child of fork() leaves the
+ * loggers of the parent alone.
+ */
 struct logger {
-    inline logger(FILE *fp) : fp(fp), dirty(false), bufpos(0), repeated(0){}
-    inline ~logger() {
-        flush();
-    }
+    /*
+     * Fields rendered later, e.g., symbols looked up asynchronously
+     * ready(key) tells if the field can be rendered without blocking,
+     * and render(l, key) prints it. Fields are rendered in order.
+     */
+    struct deferral {
+        std::function<bool(uint64_t)> ready;
+        std::function<void(logger&, uint64_t)> render;
+    };
+    explicit logger(FILE *fp);
+    ~logger();
     size_t format(const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
     size_t print(const char *str);
     size_t print(const char *str, size_t len);
+    // Without going through printf
+    size_t print_dec(uint64_t value);
+    size_t print_hex(uint64_t value);   // No 0x prefix
+    size_t pad(size_t width);           // width spaces
+    /*
+     * Add a deferred field to the current line. The line, and all lines
+     * after it, are held until the field is ready.
+     */
+    void defer(uint64_t key);
+    inline bool holding() const {
+        return !held.empty();
+    }
+    inline void set_deferral(deferral d) {
+        deferred = std::move(d);
+    }
     void newline();
+    // Write out everything, and wait for the writer
     void flush();
 private:
+    struct held_segment {
+        std::string text;
+        bool deferred;
+        uint64_t key;
+    };
+    struct held_line {
+        std::vector<held_segment> segments;
+        bool dirty;
+    };
+    struct chunk {
+        std::unique_ptr<char[]> data;
+        size_t size = 0;
+        size_t capacity = 0;
+    };
+    // Bound of held lines before blocking on the deferred fields
+    static constexpr size_t max_held = 65536;
+    static constexpr size_t chunk_size = 1 << 20;
+    // Bound of chunks queued to the writer before blocking
+    static constexpr size_t max_pending = 4;
+    // Room for "<repeated N times>\n"
+    static constexpr size_t marker_max = 48;
+    size_t headroom() const;
+    size_t room() const;
+    char *reserve(size_t len);
+    void make_dirty(size_t len);
+    size_t emit(const char *str, size_t len);
+    std::string &held_text();
+    void complete();
+    void drain(bool wait);
     void maybe_marker();
+    chunk take_chunk(size_t len);
+    void submit(chunk c);
+    void write_chunks();
+    void wait_written();
+    void salvage();
+    static void flush_at_exit();
     FILE* fp;
+    int fd;
+    /*
+     * If dirty, the current line is in out from line_start. Otherwise,
+     * it's the first bufpos bytes of last, not written to out yet.
+     */
+    chunk out;
+    size_t line_start;
     bool dirty;
-    std::string buf;
+    std::string last;
     size_t bufpos;
     size_t repeated;
+    deferral deferred;
+    // The last one is the current line
+    std::deque<held_line> held;
+    bool draining;
+    // Writer thread, started by the first chunk submitted
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<chunk> pending;
+    std::vector<chunk> spare;
+    bool stopping;
+    // Number of chunks submitted to, and written by the writer
+    size_t submitted;
+    size_t written;
+    // Logger of the thread before this one
+    logger *prev_thread_logger;
+    // Process created in, not the child of fork()
+    pid_t pid;
 };
 
 #endif
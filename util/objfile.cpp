@@ -12,10 +12,34 @@
 #include <filesystem>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include "objfile.h"
 
 using namespace std;
 
+obj_map_options obj_map_opts;
+mutex bfd_lock;
+
+void parse_obj_map_options(const char *str) {
+    string opts(str);
+    char *saveptr;
+    for (char *opt = strtok_r(opts.data(), ",", &saveptr); opt;
+         opt = strtok_r(nullptr, ",", &saveptr)) {
+        if (!strcmp(opt, "section"))
+            obj_map_opts.whole_file = false;
+        else if (!strcmp(opt, "file"))
+            obj_map_opts.whole_file = true;
+        else if (!strcmp(opt, "populate"))
+            obj_map_opts.populate = true;
+        else if (!strcmp(opt, "willneed"))
+            obj_map_opts.advice = MADV_WILLNEED;
+        else if (!strcmp(opt, "random"))
+            obj_map_opts.advice = MADV_RANDOM;
+        else
+            error(-1, 0, "Invalid mmap option %s", opt);
+    }
+}
+
 static int open_bfd(const char *filename) {
     int fd = open(filename, O_RDONLY | O_CLOEXEC);
     if (fd < 0)
@@ -23,10 +47,21 @@ static int open_bfd(const char *filename) {
     return fd;
 }
 
+static bfd *fdopen_bfd(const char *filename, int fd) {
+    lock_guard<mutex> guard(bfd_lock);
+    return bfd_fdopenr(filename, nullptr, fd);
+}
+
+static void close_bfd(bfd *abfd) {
+    lock_guard<mutex> guard(bfd_lock);
+    bfd_close(abfd);
+}
+
 obj_file::obj_file(const char *filename, bfd_format format) :
 autofd(open_bfd(filename)),
-abfd(bfd_fdopenr(filename, nullptr, autofd.fd), &bfd_close)
+abfd(fdopen_bfd(filename, autofd.fd), &close_bfd)
 {
+    lock_guard<mutex> guard(bfd_lock);
     if (!abfd)
         error(-1, 0, "failed to open %s", filename);
     if (!bfd_check_format(abfd.get(), format))
@@ -53,16 +88,41 @@ abfd(bfd_fdopenr(filename, nullptr, autofd.fd), &bfd_close)
     }, this);
 }
 
+const uint8_t *obj_file::map_file() {
+    if (file_mapped || !whole_file_mappable)
+        return (const uint8_t*)file_mapped;
+    // Only try once, and fall back to mapping sections
+    whole_file_mappable = false;
+    struct stat st;
+    if (fstat(autofd.fd, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+        return nullptr;
+    void *addr = ::mmap(nullptr, st.st_size, PROT_READ,
+                        MAP_SHARED | (obj_map_opts.populate ? MAP_POPULATE : 0),
+                        autofd.fd, 0);
+    if (addr == MAP_FAILED)
+        return nullptr;
+    if (obj_map_opts.advice != MADV_NORMAL)
+        madvise(addr, st.st_size, obj_map_opts.advice);
+    file_mapped = addr;
+    file_mapped_size = st.st_size;
+    return (const uint8_t*)file_mapped;
+}
+
 pair<void*, size_t> obj_file::mmap(uint64_t fileoff, int prot, int flags) {
     auto it = sect_by_fileoff.find(fileoff);
     if (it == sect_by_fileoff.end())
         error(-1, 0, "fileoff %" PRIx64 "not found", fileoff);
-    auto it2 = sect_mapped.find(fileoff);
     auto *asection = it->second;
     size_t sz = asection->rawsize;
     if (!sz)
         sz = asection->size;
     assert(sz);
+    if (obj_map_opts.whole_file && prot == PROT_READ && flags == MAP_SHARED) {
+        auto *base = map_file();
+        if (base && asection->filepos + sz <= file_mapped_size)
+            return make_pair((void*)(base + asection->filepos), sz);
+    }
+    auto it2 = sect_mapped.find(fileoff);
     if (it2 != sect_mapped.end())
         return make_pair(it2->second, sz);
     size_t pagesz = getpagesize(), pagemask = pagesz - 1;
@@ -71,6 +131,7 @@ pair<void*, size_t> obj_file::mmap(uint64_t fileoff, int prot, int flags) {
     size_t pg_len = (off - pg_offset + sz + pagemask) & ~pagemask;
     void *ret_addr = nullptr;
     size_t ret_size = 0;
+    lock_guard<mutex> guard(bfd_lock);
     void *addr = bfd_mmap(abfd.get(), nullptr, pg_len, prot, flags, pg_offset,
                           &ret_addr, &ret_size);
     if (addr == MAP_FAILED)
@@ -110,6 +171,27 @@ uint64_t obj_file::fileoff_to_va(uint64_t offset) const {
     return offset - it->first + it->second->vma;
 }
 
+optional<uint64_t> obj_file::va_to_fileoff(uint64_t va) const {
+    auto it = sect_by_vma.upper_bound(va);
+    if (it == sect_by_vma.begin())
+        return nullopt;
+    --it;
+    if (va - it->first >= it->second->size)
+        return nullopt;
+    return va - it->first + it->second->filepos;
+}
+
+optional<uint64_t> obj_file::section_to_fileoff(const string &section,
+                                                uint64_t offset) const {
+    auto it = sect_by_name.find(section);
+    if (it == sect_by_name.end())
+        return nullopt;
+    auto *sect = it->second;
+    if ((sect->flags & SEC_LOAD) != SEC_LOAD || offset >= sect->size)
+        return nullopt;
+    return offset + sect->filepos;
+}
+
 optional<vector<uint8_t> > obj_file::get_build_id() const {
     struct {
         uint32_t name_sz;
@@ -124,6 +206,7 @@ optional<vector<uint8_t> > obj_file::get_build_id() const {
     sec_data.resize(bfd_section_size(it->second));
     if (sec_data.size() < sizeof(gnu_build_id))
         error(-1, 0, "build-id too short");
+    lock_guard<mutex> guard(bfd_lock);
     if (!bfd_get_section_contents(get_bfd(), it->second,
                                   sec_data.data(),
                                   0, sec_data.size()))
@@ -138,10 +221,44 @@ optional<vector<uint8_t> > obj_file::get_build_id() const {
             sizeof(gnu_build_id) + gnu_build_id.name_sz, sec_data.end());
 }
 
+asymbol **obj_file::get_symtab() {
+    if (symtab_loaded)
+        return symtab.get();
+    symtab_loaded = true;
+    if (!(bfd_get_file_flags(abfd.get()) & HAS_SYMS))
+        return nullptr;
+    bool dynamic = false;
+    long sz = bfd_get_symtab_upper_bound(abfd.get());
+    if (!sz) {
+        dynamic = true;
+        sz = bfd_get_dynamic_symtab_upper_bound(abfd.get());
+    }
+    if (sz <= 0)
+        return nullptr;
+    symtab = make_unique<asymbol*[]>(sz / sizeof(asymbol*));
+    long count = dynamic ?
+            bfd_canonicalize_dynamic_symtab(abfd.get(), symtab.get()) :
+            bfd_canonicalize_symtab(abfd.get(), symtab.get());
+    /*
+     * ELF without .symtab still has an upper bound of one (NULL) entry,
+     * so retry with dynamic symbols if none found, e.g., stripped .so
+     */
+    if (!count && !dynamic &&
+        (sz = bfd_get_dynamic_symtab_upper_bound(abfd.get())) > 0) {
+        symtab = make_unique<asymbol*[]>(sz / sizeof(asymbol*));
+        count = bfd_canonicalize_dynamic_symtab(abfd.get(), symtab.get());
+    }
+    if (count <= 0)
+        symtab.reset();
+    return symtab.get();
+}
+
 obj_file::~obj_file() {
     auto it = sect_mapped.begin();
     for (auto i = sect_mapped.begin(), j = sect_mapped.end(); i != j;) {
         auto fileoff = i++->first;
         unmap(fileoff);
     }
+    if (file_mapped)
+        munmap(file_mapped, file_mapped_size);
 }
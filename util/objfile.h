@@ -13,15 +13,42 @@
 #include <memory>
 #include <vector>
 #include <map>
+#include <mutex>
 #include <sys/mman.h>
 #include "misc.h"
 
+/*
+ * How obj_file maps sections, effective on the next mapping
+ *
+ * With whole_file, each file is mapped once on first use, and sections
+ * are pointers in it, instead of one mapping per section. populate and
+ * advice apply to the whole file mapping.
+ */
+struct obj_map_options {
+    bool whole_file = false;
+    bool populate = false;      // MAP_POPULATE
+    int advice = MADV_NORMAL;   // madvise() of the mapping
+};
+extern obj_map_options obj_map_opts;
+
+// Parse comma separated: section, file, populate, willneed, random
+void parse_obj_map_options(const char *str);
+
+/*
+ * libbfd isn't thread-safe, e.g., its cache of open files and the error
+ * state are global. Held by every bfd call from concurrent replay workers.
+ */
+extern std::mutex bfd_lock;
+
 struct obj_file : std::enable_shared_from_this<obj_file> {
     obj_file(const char *filename, bfd_format format);
     std::pair<void*, size_t> mmap(uint64_t fileoff,
                                     int prot = PROT_READ, int flags = MAP_SHARED);
     void unmap(uint64_t fileoff);
     uint64_t fileoff_to_va(uint64_t offset) const;
+    std::optional<uint64_t> va_to_fileoff(uint64_t va) const;
+    std::optional<uint64_t> section_to_fileoff(const std::string &section,
+                                               uint64_t offset) const;
     std::optional<std::vector<uint8_t> > get_build_id() const;
     inline const char *filename() const {
         return abfd->filename;
@@ -29,14 +56,27 @@ struct obj_file : std::enable_shared_from_this<obj_file> {
     inline bfd *get_bfd() const {
         return abfd.get();
     }
+    /*
+     * Symbol table for bfd_find_nearest_line, loaded on first use
+     * bfd_lock must be held
+     */
+    asymbol **get_symtab();
     ~obj_file();
 protected:
     auto_fd autofd;
-    std::unique_ptr<bfd, decltype(&bfd_close)> abfd;
+    std::unique_ptr<bfd, void(*)(bfd*)> abfd;
     std::map<uint64_t, asection*> sect_by_vma;
     std::map<uint64_t, asection*> sect_by_fileoff;
     std::map<uint64_t, void*> sect_mapped;
     std::multimap<std::string_view, asection*> sect_by_name;
+    std::unique_ptr<asymbol*[]> symtab;
+    bool symtab_loaded = false;
+    // Whole file mapping, nullptr if not mapped (yet)
+    const uint8_t *map_file();
+    // Cleared if the file can't be mapped as a whole, e.g., kcore
+    bool whole_file_mappable = true;
+    void *file_mapped = nullptr;
+    size_t file_mapped_size = 0;
 public:
     inline const std::map<uint64_t, asection*>& get_sect_by_vma() const {
         return sect_by_vma;
@@ -29,6 +29,11 @@
             cpu = atoi(optarg);                     \
             break;
 
+#define OPT_PARSE_C_CPUS                            \
+        case 'c':                                   \
+            cpus = split_cpus(optarg);              \
+            break;
+
 #define OPT_PARSE_B_BUFSZ                           \
         case 'b':                                   \
             bufsz = strtoul(optarg, NULL, 0);       \
@@ -80,12 +85,86 @@
                 sysroot_dirs, dbg_dirs));           \
             break;
 
+#define OPT_PARSE_CAP_K_KBUNDLE                     \
+        case 'K':                                   \
+            vm->load_core(make_shared<linux_kcore>( \
+                optarg, sysroot_dirs, dbg_dirs));   \
+            break;
+
 #define OPT_PARSE_E_ELF                             \
         case 'e':                                   \
             vm->load_core(make_shared<elf_file>(    \
                 optarg));                           \
             break;
 
+#define OPT_PARSE_J_JOBS                            \
+        case 'j':                                   \
+            jobs = strtoul(optarg, NULL, 0);        \
+            if (!jobs)                              \
+                error(-1, 0, "Jobs cannot be 0");   \
+            break;
+
+#define OPT_PARSE_G_SEGSZ                           \
+        case 'g':                                   \
+            segsz = strtoul(optarg, NULL, 0);       \
+            if (!segsz)                             \
+                error(-1, 0, "Segment size cannot be 0"); \
+            break;
+
+#define OPT_PARSE_T_SEEK_TIME                       \
+        case 't':                                   \
+            seek.emplace(trace_seek{                \
+                false, strtoull(optarg, NULL, 0), NULL}); \
+            break;
+
+#define OPT_PARSE_N_SEEK_ICNT                       \
+        case 'n':                                   \
+            seek.emplace(trace_seek{                \
+                true, strtoull(optarg, NULL, 0), NULL}); \
+            break;
+
+#define OPT_PARSE_I_INDEX                           \
+        case 'i':                                   \
+            index_file = optarg;                    \
+            break;
+
+#define OPT_PARSE_CAP_C_CACHEDIR                    \
+        case 'C':                                   \
+            cachedir = optarg;                      \
+            break;
+
+#define OPT_PARSE_F_FORMAT                          \
+        case 'f':                                   \
+            if (!strcmp(optarg, "text"))            \
+                format = format_text;               \
+            else if (!strcmp(optarg, "bin"))        \
+                format = format_bin;                \
+            else if (!strcmp(optarg, "chrome"))     \
+                format = format_chrome;             \
+            else                                    \
+                error(-1, 0, "Invalid format %s", optarg); \
+            break;
+
+#define OPT_PARSE_CAP_P_PROFILE                     \
+        case 'P':                                   \
+            profile_prefix = optarg;                \
+            break;
+
+#define OPT_PARSE_O_OUTPUT                          \
+        case 'o':                                   \
+            output_prefix = optarg;                 \
+            break;
+
+#define OPT_PARSE_A_ADDR2LINE                       \
+        case 'a':                                   \
+            sym_use_addr2line = true;               \
+            break;
+
+#define OPT_PARSE_CAP_M_MMAP                        \
+        case 'M':                                   \
+            parse_obj_map_options(optarg);          \
+            break;
+
 #define OPT_PARSE_END                               \
         default:                                    \
             return 1;                               \
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * pool.cpp - Work-stealing thread pool
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <cassert>
+#include "pool.h"
+
+using namespace std;
+
+work_stealing_pool::work_stealing_pool(unsigned nthreads) :
+        next_queue(0), pending(0), stopping(false) {
+    assert(nthreads);
+    for (unsigned i = 0; i < nthreads; ++i)
+        queues.emplace_back(make_unique<worker_queue>());
+    for (unsigned i = 0; i < nthreads; ++i)
+        threads.emplace_back(&work_stealing_pool::run, this, i);
+}
+
+work_stealing_pool::~work_stealing_pool() {
+    {
+        lock_guard<mutex> guard(idle_lock);
+        stopping = true;
+    }
+    idle_cv.notify_all();
+    for (auto &t : threads)
+        t.join();
+}
+
+void work_stealing_pool::submit(task t) {
+    auto &q = *queues[next_queue++ % queues.size()];
+    {
+        lock_guard<mutex> guard(q.lock);
+        q.tasks.emplace_back(move(t));
+    }
+    {
+        lock_guard<mutex> guard(idle_lock);
+        ++pending;
+    }
+    idle_cv.notify_one();
+}
+
+bool work_stealing_pool::try_pop(unsigned self, task &t) {
+    auto &q = *queues[self];
+    lock_guard<mutex> guard(q.lock);
+    if (q.tasks.empty())
+        return false;
+    t = move(q.tasks.front());
+    q.tasks.pop_front();
+    return true;
+}
+
+bool work_stealing_pool::try_steal(unsigned self, task &t) {
+    for (unsigned i = 1; i < queues.size(); ++i) {
+        auto &q = *queues[(self + i) % queues.size()];
+        lock_guard<mutex> guard(q.lock);
+        if (q.tasks.empty())
+            continue;
+        t = move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+    return false;
+}
+
+void work_stealing_pool::run(unsigned self) {
+    for (;;) {
+        {
+            unique_lock<mutex> guard(idle_lock);
+            idle_cv.wait(guard, [this] {
+                return pending || stopping;
+            });
+            // Finish all the submitted tasks before stopping
+            if (!pending)
+                return;
+            --pending;
+        }
+        // A task is reserved for us, and it's in one of the queues
+        task t;
+        while (!try_pop(self, t) && !try_steal(self, t));
+        t();
+    }
+}
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_POOL_H
+#define LIBNEXUS_RV_POOL_H
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+/*
+ * Work-stealing thread pool
+ *
+ * Each worker owns a queue. Tasks are distributed round-robin, and the
+ * owner takes from the front (oldest first), so tasks submitted in order
+ * roughly complete in order. An idle worker steals from the back of the
+ * other queues.
+ */
+struct work_stealing_pool {
+    typedef std::function<void()> task;
+    explicit work_stealing_pool(unsigned nthreads);
+    ~work_stealing_pool();
+    void submit(task t);
+    inline unsigned size() const {
+        return threads.size();
+    }
+private:
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+    bool try_pop(unsigned self, task &t);
+    bool try_steal(unsigned self, task &t);
+    void run(unsigned self);
+    std::vector<std::unique_ptr<worker_queue> > queues;
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> next_queue;
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+    size_t pending;
+    bool stopping;
+};
+
+#endif
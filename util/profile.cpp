@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * profile.cpp - Hotspot profile of the replayed trace
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <cerrno>
+#include <cinttypes>
+#include <string>
+#include <error.h>
+#include "profile.h"
+
+using namespace std;
+
+profile_data::profile_data() : nodes(1) {}
+
+uint32_t profile_data::child(uint32_t parent, uint64_t addr) {
+    auto &children = nodes[parent].children;
+    auto it = children.find(addr);
+    if (it != children.end())
+        return it->second;
+    // nodes[parent] may move with emplace_back()
+    uint32_t index = nodes.size();
+    auto &n = nodes.emplace_back();
+    n.addr = addr;
+    n.parent = parent;
+    nodes[parent].children[addr] = index;
+    return index;
+}
+
+void profile_data::merge(const profile_data &other, uint32_t from,
+                         uint32_t to) {
+    for (auto &[addr, c] : other.nodes[from].blocks) {
+        auto &mine = nodes[to].blocks[addr];
+        mine.icnt += c.icnt;
+        mine.time += c.time;
+    }
+    for (auto &[addr, index] : other.nodes[from].children)
+        merge(other, index, child(to, addr));
+}
+
+void profile_data::merge(const profile_data &other) {
+    merge(other, 0, 0);
+}
+
+static string name_of(const profile_data::resolver &resolve, uint64_t addr) {
+    if (!addr)
+        return "[unknown]";
+    auto *func = resolve(addr);
+    if (func)
+        return *func;
+    return cppfmt("0x%" PRIx64, addr);
+}
+
+void profile_data::write_folded(FILE *fp, const resolver &resolve) const {
+    map<string, uint64_t> folded;
+    unordered_map<uint64_t, string> names;
+    auto name = [&](uint64_t addr) -> const string& {
+        auto it = names.find(addr);
+        if (it == names.end())
+            it = names.emplace(addr, name_of(resolve, addr)).first;
+        return it->second;
+    };
+    vector<string> stacks(nodes.size());
+    for (uint32_t i = 1; i < nodes.size(); ++i) {
+        // Parent is always created before the child
+        auto &parent = stacks[nodes[i].parent];
+        stacks[i] = parent.empty() ?
+                name(nodes[i].addr) : parent + ";" + name(nodes[i].addr);
+    }
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        for (auto &[addr, c] : nodes[i].blocks) {
+            auto &leaf = name(addr);
+            string stack = stacks[i];
+            // Skip the leaf if it's the function of the frame
+            if (!i || leaf != name(nodes[i].addr))
+                stack = stack.empty() ? leaf : stack + ";" + leaf;
+            folded[stack] += c.icnt;
+        }
+    }
+    for (auto &[stack, icnt] : folded)
+        if (icnt)
+            fprintf(fp, "%s %" PRIu64 "\n", stack.c_str(), icnt);
+}
+
+/*
+ * Minimal protobuf encoder for profile.proto of pprof
+ */
+static void pb_varint(string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(char(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+static void pb_uint(string &out, unsigned field, uint64_t value) {
+    pb_varint(out, field << 3);
+    pb_varint(out, value);
+}
+
+static void pb_bytes(string &out, unsigned field, const string &value) {
+    pb_varint(out, field << 3 | 2);
+    pb_varint(out, value.size());
+    out += value;
+}
+
+static void pb_packed(string &out, unsigned field,
+                      const vector<uint64_t> &values) {
+    string packed;
+    for (auto value : values)
+        pb_varint(packed, value);
+    pb_bytes(out, field, packed);
+}
+
+void profile_data::write_pprof(FILE *fp, const resolver &resolve) const {
+    // Profile fields
+    enum {
+        sample_type = 1, sample = 2, location = 4,
+        function = 5, string_table = 6,
+    };
+    string out;
+    unordered_map<string, uint64_t> strings;
+    vector<const string*> string_list;
+    auto str = [&](const string &s) {
+        auto [it, inserted] = strings.try_emplace(s, strings.size());
+        if (inserted)
+            string_list.push_back(&it->first);
+        return it->second;
+    };
+    str("");
+    unordered_map<string, uint64_t> functions;
+    unordered_map<uint64_t, uint64_t> func_ids;
+    unordered_map<uint64_t, uint64_t> locations;
+    // Function of addr, by its name
+    auto func = [&](uint64_t addr) {
+        auto it = func_ids.find(addr);
+        if (it != func_ids.end())
+            return it->second;
+        auto name = name_of(resolve, addr);
+        auto [f, inserted] = functions.try_emplace(
+                name, functions.size() + 1);
+        if (inserted) {
+            string msg;
+            pb_uint(msg, 1, f->second);
+            pb_uint(msg, 2, str(name));
+            pb_uint(msg, 3, str(name));
+            pb_bytes(out, function, msg);
+        }
+        func_ids.emplace(addr, f->second);
+        return f->second;
+    };
+    auto loc = [&](uint64_t addr) {
+        auto it = locations.find(addr);
+        if (it != locations.end())
+            return it->second;
+        uint64_t id = locations.size() + 1;
+        string line, msg;
+        pb_uint(line, 1, func(addr));
+        pb_uint(msg, 1, id);
+        pb_uint(msg, 3, addr);
+        pb_bytes(msg, 4, line);
+        pb_bytes(out, location, msg);
+        locations.emplace(addr, id);
+        return id;
+    };
+    for (auto [type, unit] : {make_pair("instructions", "count"),
+                              make_pair("time", "nanoseconds")}) {
+        string msg;
+        pb_uint(msg, 1, str(type));
+        pb_uint(msg, 2, str(unit));
+        pb_bytes(out, sample_type, msg);
+    }
+    vector<uint64_t> stack;
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        for (auto &[addr, c] : nodes[i].blocks) {
+            // Leaf first
+            stack.clear();
+            stack.push_back(loc(addr));
+            uint32_t n = i;
+            // Skip the entry of the frame if it's the function of the leaf
+            if (n && func(addr) == func(nodes[n].addr))
+                n = nodes[n].parent;
+            for (; n; n = nodes[n].parent)
+                stack.push_back(loc(nodes[n].addr));
+            string msg;
+            pb_packed(msg, 1, stack);
+            pb_packed(msg, 2, {c.icnt, c.time});
+            pb_bytes(out, sample, msg);
+        }
+    }
+    for (auto *s : string_list)
+        pb_bytes(out, string_table, *s);
+    if (fwrite(out.data(), out.size(), 1, fp) != 1)
+        error(-1, errno, "Failed to write profile");
+}
+
+profile_sink::profile_sink(profile_data &shared, mutex &lock) :
+    shared(shared), lock(lock), current(0), last_time(0) {}
+
+profile_sink::~profile_sink() {
+    lock_guard<mutex> guard(lock);
+    shared.merge(data);
+}
+
+void profile_sink::account(uint64_t time, uint64_t addr, uint32_t icnt) {
+    auto &c = data.nodes[current].blocks[addr];
+    c.icnt += icnt;
+    if (last_time && time > last_time)
+        c.time += time - last_time;
+    last_time = time;
+}
+
+void profile_sink::call(uint64_t target) {
+    current = data.child(current, target);
+}
+
+void profile_sink::ret() {
+    // Returning from functions called before the trace started
+    if (current)
+        current = data.nodes[current].parent;
+}
+
+void profile_sink::reset(uint64_t time) {
+    current = 0;
+    last_time = time;
+}
+
+void profile_sink::write_block(uint64_t time, const rv_inst_block *block,
+                               const rv_inst_status &status, unsigned) {
+    account(time, block->addr, block->icnt);
+    switch (block->kind) {
+        case NEXUSRV_ITYPE_Direct_Call:
+        case NEXUSRV_ITYPE_Indirect_Call:
+        case NEXUSRV_ITYPE_Exception:
+            call(status.next);
+            break;
+        case NEXUSRV_ITYPE_Function_Return:
+        case NEXUSRV_ITYPE_Trap_Return:
+            ret();
+            break;
+        case NEXUSRV_ITYPE_Coroutine_Swap:
+            if (status.coswap)
+                ret();
+            call(status.next);
+            break;
+    }
+}
+
+void profile_sink::write_partial(uint64_t time, uint64_t addr,
+                                 uint32_t icnt) {
+    account(time, addr, icnt);
+}
+
+void profile_sink::write_retire(uint64_t time, uint32_t icnt) {
+    account(time, 0, icnt);
+}
+
+void profile_sink::write_tnt(uint64_t, bool) {}
+
+void profile_sink::write_indirect(uint64_t,
+                                  const nexusrv_trace_indirect &indir) {
+    if (indir.interrupt || indir.exception)
+        call(indir.target);
+}
+
+void profile_sink::write_sync(uint64_t time, uint64_t, unsigned, bool) {
+    reset(time);
+}
+
+void profile_sink::write_stop(uint64_t time, unsigned) {
+    reset(time);
+}
+
+void profile_sink::write_error(uint64_t time, unsigned, uint32_t) {
+    reset(time);
+}
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_PROFILE_H
+#define LIBNEXUS_RV_PROFILE_H
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include "sink.h"
+
+/*
+ * Calling context tree of retired instructions
+ *
+ * A node is a function called (by its entry address) in the context of
+ * its parent. The root is the context before any call seen, e.g., right
+ * after SYNC. Each node counts the I-CNT and time of the blocks retired
+ * in it, by the address of block, or 0 if retired without the program.
+ * Time of an event is the delta from the previous event, as the
+ * timestamps are only updated with Messages.
+ */
+struct profile_data {
+    struct cost {
+        uint64_t icnt;
+        uint64_t time;
+    };
+    struct node {
+        uint64_t addr;
+        uint32_t parent;
+        std::map<uint64_t, uint32_t> children;
+        std::unordered_map<uint64_t, cost> blocks;
+    };
+    typedef chrome_sink::resolver resolver;
+    profile_data();
+    uint32_t child(uint32_t parent, uint64_t addr);
+    void merge(const profile_data &other);
+    // Lines of "frame;frame;...;leaf icnt" for flamegraph.pl
+    void write_folded(FILE *fp, const resolver &resolve) const;
+    // Uncompressed pprof protobuf, with samples of icnt and time
+    void write_pprof(FILE *fp, const resolver &resolve) const;
+    std::vector<node> nodes;
+private:
+    void merge(const profile_data &other, uint32_t from, uint32_t to);
+};
+
+/*
+ * Aggregate the replayed trace into profile_data, instead of output.
+ * The call stack is reconstructed from calls and returns the same way
+ * as chrome_sink, and reset at SYNC, STOP and ERROR.
+ * The profile is merged into the shared one on destruction, so
+ * segments decoded in parallel produce the same profile.
+ */
+struct profile_sink : replay_sink {
+    profile_sink(profile_data &shared, std::mutex &lock);
+    ~profile_sink();
+    void write_block(uint64_t time, const rv_inst_block *block,
+                     const rv_inst_status &status, unsigned stack) override;
+    void write_partial(uint64_t time, uint64_t addr, uint32_t icnt) override;
+    void write_retire(uint64_t time, uint32_t icnt) override;
+    void write_tnt(uint64_t time, bool taken) override;
+    void write_indirect(uint64_t time,
+                        const nexusrv_trace_indirect &indir) override;
+    void write_sync(uint64_t time, uint64_t addr, unsigned sync,
+                    bool seek) override;
+    void write_stop(uint64_t time, unsigned evcode) override;
+    void write_error(uint64_t time, unsigned etype, uint32_t ecode) override;
+private:
+    void account(uint64_t time, uint64_t addr, uint32_t icnt);
+    void call(uint64_t target);
+    void ret();
+    void reset(uint64_t time);
+    profile_data data;
+    profile_data &shared;
+    std::mutex &lock;
+    uint32_t current;
+    uint64_t last_time;
+};
+
+#endif
@@ -6,12 +6,16 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 #include <cinttypes>
 #include <cassert>
 #include <vector>
+#include <deque>
 #include <string>
 #include <unordered_map>
 #include <algorithm>
+#include <future>
+#include <thread>
 #include <getopt.h>
 #include <error.h>
 #include <fcntl.h>
@@ -19,6 +23,7 @@ extern "C" {
 #include <libnexus-rv/error.h>
 #include <libnexus-rv/msg-decoder.h>
 #include <libnexus-rv/trace-decoder.h>
+#include <libnexus-rv/trace-index.h>
 #include <capstone.h>
 }
 #include "objfile.h"
@@ -28,9 +33,15 @@ extern "C" {
 #include "sym.h"
 #include "opts-def.h"
 #include "logger.h"
+#include "segment.h"
+#include "pool.h"
 #include "misc.h"
+#include "blockcache.h"
+#include "sink.h"
+#include "profile.h"
 
 #define DEFAULT_BUFFER_SIZE 4096
+#define DEFAULT_SEGMENT_SIZE (4UL << 20)
 
 using namespace std;
 
@@ -46,10 +57,22 @@ static struct option long_opts[] = {
         {"sysfs",     required_argument, NULL, 'y'},
         {"ucore",     required_argument, NULL, 'u'},
         {"kcore",     no_argument,       NULL, 'k'},
+        {"kbundle",   required_argument, NULL, 'K'},
+        {"jobs",      required_argument, NULL, 'j'},
+        {"segsz",     required_argument, NULL, 'g'},
+        {"seek-time", required_argument, NULL, 't'},
+        {"seek-icnt", required_argument, NULL, 'n'},
+        {"index",     required_argument, NULL, 'i'},
+        {"cachedir",  required_argument, NULL, 'C'},
+        {"format",    required_argument, NULL, 'f'},
+        {"profile",   required_argument, NULL, 'P'},
+        {"output",    required_argument, NULL, 'o'},
+        {"addr2line", no_argument,       NULL, 'a'},
+        {"mmap",      required_argument, NULL, 'M'},
         {NULL, 0,                        NULL, 0},
 };
 
-static const char short_opts[] = "hw:s:c:b:e:r:d:p:y:u:k";
+static const char short_opts[] = "hw:s:c:b:e:r:d:p:y:u:kK:j:g:t:n:i:C:f:P:o:aM:";
 
 static void help(const char *argv0) {
     error(-1, 0, "Usage: \n"
@@ -57,24 +80,67 @@ static void help(const char *argv0) {
                   "\n"
                   "\t-h, --help            Display this help message\n"
                   "\t-w, --hwcfg [string]  Hardware Configuration string\n"
-                  "\t-c, --filter [int]    Select a particular SRC (hart)\n"
+                  "\t-c, --filter [int,int,...]\n"
+                  "\t                      Select SRCs (harts), replayed concurrently\n"
                   "\t-b, --buffersz [int]  Buffer size (default %d)\n"
                   "\t-e, --elf [path]      Path to ELF file to load as core/symbol\n"
                   "\t-p, --procfs [path]   Path to procfs (default /proc)\n"
                   "\t-y, --sysfs [path]    Path to sysfs (default /sys)\n"
                   "\t-r, --sysroot [path:path:...]\n"
-                  "\t                      Sysroot search dirs (affects following --ucore --kcore)\n"
+                  "\t                      Sysroot search dirs (affects following --ucore --kcore --kbundle)\n"
                   "\t-d, --debugdir [path:path:...]\n"
-                  "\t                      Debug search dirs (affects following --ucore --kcore)\n"
+                  "\t                      Debug search dirs (affects following --ucore --kcore --kbundle)\n"
                   "\t-u, --ucore [path]    Userspace coredump (can be multiple)\n"
-                  "\t-k, --kcore           Kernel coredump (using {procfs}/kcore)\n",
-          argv0, DEFAULT_BUFFER_SIZE);
+                  "\t-k, --kcore           Kernel coredump (using {procfs}/kcore)\n"
+                  "\t-K, --kbundle [path]  Kernel coredump captured by nexusrv-kcapture\n"
+                  "\t-j, --jobs [int]      Decode trace segments in parallel (default 1)\n"
+                  "\t-g, --segsz [int]     Segment size for parallel decoding (default %lu)\n"
+                  "\t-t, --seek-time [int] Start replaying from timestamp\n"
+                  "\t-n, --seek-icnt [int] Start replaying from I-CNT (in half-words)\n"
+                  "\t-i, --index [path]    Index of SYNC for seeking (created if not exist)\n"
+                  "\t-C, --cachedir [path] Directory of persistent instruction block cache\n"
+                  "\t-f, --format [fmt]    Output format: text (default), bin or chrome\n"
+                  "\t                      chrome timestamps are in us only with timerfreq=\n"
+                  "\t                      in hwcfg, otherwise in 1000 timer ticks\n"
+                  "\t-P, --profile [path]  Write hotspot profile to {path}.folded and {path}.pb\n"
+                  "\t                      instead of output\n"
+                  "\t-o, --output [path]   Write output of each SRC to {path}.{SRC}\n"
+                  "\t                      instead of merging to stdout\n"
+                  "\t-a, --addr2line       Resolve source lines with external addr2line\n"
+                  "\t                      (default %s, or $ADDR2LINE)\n"
+                  "\t-M, --mmap [opt,...]  How object/core files are mapped:\n"
+                  "\t                      section (default) or file (whole file once),\n"
+                  "\t                      and populate, willneed or random hints\n",
+          argv0, DEFAULT_BUFFER_SIZE, DEFAULT_SEGMENT_SIZE, DEFAULT_ADDR2LINE);
 }
 
 #define FMT_TIME_OFFSET "[%" PRIu64 "] +%zu "
 
-map<shared_ptr<obj_file>, map<string, sym_server> > sym_srvs;
-unordered_map<uint64_t, shared_ptr<rv_inst_block> > insts;
+struct trace_seek {
+    bool by_icnt;
+    uint64_t target;
+    const nexusrv_trace_index *index;
+};
+
+// Shared by all workers, one server per object (and section)
+static mutex sym_srvs_lock;
+static map<shared_ptr<obj_file>, map<string, sym_server> > sym_srvs;
+// Blocks are looked up and chained per thread, and decoded once
+static rv_block_registry shared_blocks;
+thread_local rv_block_arena insts(shared_blocks);
+// Shared by all workers, if enabled
+static unique_ptr<block_cache> persistent_blocks;
+
+enum output_format {
+    format_text,
+    format_bin,
+    format_chrome,
+    format_profile,
+};
+static output_format format = format_text;
+// Merged from all workers in profile mode
+static profile_data profile;
+static mutex profile_lock;
 
 static void print_label(shared_ptr<memory_view> vm, logger& l, uint64_t addr,
                         const string **last_func) {
@@ -90,25 +156,94 @@ static void print_label(shared_ptr<memory_view> vm, logger& l, uint64_t addr,
         l.format("; %s", module->c_str());
 }
 
-static void print_sym(shared_ptr<memory_view> vm, logger& l, uint64_t addr,
-                      const string **last_func) {
+static sym_server &get_sym_srv(shared_ptr<obj_file> obj,
+                               const string *section) {
+    lock_guard<mutex> guard(sym_srvs_lock);
+    auto& srvs = sym_srvs[obj];
+    return srvs.try_emplace(
+            section ? *section : "",
+            obj,
+            section ? section->c_str() : nullptr).first->second;
+}
+
+// Function containing addr, or nullptr if unknown
+static const string *query_func(shared_ptr<memory_view> vm, uint64_t addr) {
+    auto [obj, section, vma] = vm->query_sym(addr);
+    if (!obj)
+        return get<0>(vm->query_label(addr));
+    return get_sym_srv(obj, section).query(vma).func;
+}
+
+/*
+ * Symbols of addresses in the text output
+ *
+ * The lookup is requested from the symbol server when printed. If not
+ * answered yet by addr2line, the symbol becomes a deferred field of the
+ * logger, and the replay goes on meanwhile. The function name is elided
+ * if it's the same as the previous symbol, so symbols are always
+ * rendered in order.
+ */
+struct sym_printer {
+    sym_printer(shared_ptr<memory_view> vm, logger &l);
+    inline ~sym_printer() {
+        l.flush();
+        l.set_deferral({});
+    }
+    void print(uint64_t addr);
+private:
+    struct field {
+        sym_server *srv;    // nullptr if not backed by an object
+        uint64_t addr;
+        uint64_t vma;
+    };
+    void render(logger &l, const field &f);
+    shared_ptr<memory_view> vm;
+    logger &l;
+    const string *last_func = nullptr;
+    deque<field> fields;
+    uint64_t first = 0;     // Key of the front of fields
+};
+
+sym_printer::sym_printer(shared_ptr<memory_view> vm, logger &l) :
+vm(vm), l(l) {
+    l.set_deferral({
+        [this](uint64_t key) {
+            auto &f = fields[key - first];
+            return !f.srv || f.srv->ready(f.vma);
+        },
+        [this](logger &l, uint64_t key) {
+            assert(key == first);
+            render(l, fields.front());
+            fields.pop_front();
+            ++first;
+        }});
+}
+
+void sym_printer::print(uint64_t addr) {
     auto [obj, section, vma] = vm->query_sym(addr);
-    if (!obj) {
-        print_label(vm, l, addr, last_func);
+    field f{obj ? &get_sym_srv(obj, section) : nullptr, addr, vma};
+    if (f.srv)
+        f.srv->request(vma);
+    if (!l.holding() && (!f.srv || f.srv->ready(vma))) {
+        render(l, f);
         return;
     }
-    auto& srvs = sym_srvs[obj];
-    auto it = srvs.try_emplace(
-            section ? *section : "",
-            obj->filename(),
-            section ? section->c_str() : nullptr).first;
-    auto answer = it->second.query(vma);
+    fields.push_back(f);
+    l.defer(first + fields.size() - 1);
+}
+
+void sym_printer::render(logger &l, const field &f) {
+    if (!f.srv) {
+        print_label(vm, l, f.addr, &last_func);
+        return;
+    }
+    auto answer = f.srv->query(f.vma);
     auto *filename = answer.filename;
-    if (*last_func != answer.func)
+    if (last_func != answer.func)
         l.format(" %s", answer.func->c_str());
     else if (filename)
         l.format(" %*s", int(answer.func->size()), "");
-    *last_func = answer.func;
+    last_func = answer.func;
     if (!filename)
         return;
     string_view short_fn(*filename);
@@ -122,84 +257,194 @@ static void print_sym(shared_ptr<memory_view> vm, logger& l, uint64_t addr,
 
 static void align_print(size_t *max, logger &l, size_t printed) {
     if (printed < *max)
-        l.format("%*s", (int)(*max - printed), "");
+        l.pad(*max - printed);
     else
         *max = printed;
 }
 
-static void replay(shared_ptr<memory_view> vm, nexusrv_msg_decoder *msg_decoder, FILE *fp) {
+/*
+ * Replay the trace from msg_decoder, and write to fp.
+ * If sync_limit is non-zero, stop right before the (sync_limit + 1)th SYNC
+ * If seek is given, start from the seek target instead of the beginning
+ * If ticks is non-zero, timestamps are extended from it, e.g., at the
+ * first SYNC of a segment
+ */
+static void replay(shared_ptr<memory_view> vm, nexusrv_msg_decoder *msg_decoder,
+                   FILE *fp, size_t sync_limit = 0,
+                   const trace_seek *seek = nullptr, uint64_t ticks = 0) {
     logger l(fp);
+    sym_printer syms(vm, l);
+    unique_ptr<replay_sink> output;
+    if (format == format_bin)
+        output = make_unique<evstream_sink>(fp);
+    else if (format == format_chrome)
+        output = make_unique<chrome_sink>(
+                fp, max<int>(msg_decoder->src_filter, 0),
+                [vm](uint64_t addr) { return query_func(vm, addr); });
+    else if (format == format_profile)
+        output = make_unique<profile_sink>(profile, profile_lock);
+    // nullptr for text output, or discard while seeking
+    replay_sink *sink = output.get();
+    discard_sink discard;
     nexusrv_trace_decoder trace_decoder = {};
     int32_t rc = nexusrv_trace_decoder_init(&trace_decoder, msg_decoder);
     if (rc < 0)
         error(-rc, 0, "decoder_init failed: %s",
               str_nexus_error(-rc));
+    if (ticks)
+        nexusrv_time_tracker_set(&trace_decoder.time_base,
+                                 &trace_decoder.time_tracker, ticks);
     uint64_t tnt_time = 0;
     uint64_t last_time = 0;
     optional<uint64_t> lastip;
-    const string *last_func = nullptr;
     size_t addr_printed = 0, inst_printed = 0;
+    size_t nsyncs = 0;
+    // Block retired without event, to chain the next block to
+    rv_inst_block *prevblock = nullptr;
+    /*
+     * The library stops at the last Sync or Indirect event before the
+     * target, or at the SYNC if there's a return stack. The rest is
+     * retired with the program to the target, without output.
+     */
+    bool seeking = false;
+    auto seek_reached = [&] {
+        if (seek->by_icnt)
+            return nexusrv_trace_retired_icnt(&trace_decoder) >= seek->target;
+        return nexusrv_trace_time(&trace_decoder) >= seek->target;
+    };
+    auto end_seek = [&] {
+        seeking = false;
+        sink = output.get();
+        if (sink) {
+            sink->write_sync(nexusrv_trace_time(&trace_decoder),
+                             *lastip, 0, true);
+            return;
+        }
+        l.newline();
+        if (seek->by_icnt)
+            l.format(FMT_TIME_OFFSET "SEEK I-CNT %" PRIu64 " to 0x%" PRIx64,
+                    nexusrv_trace_time(&trace_decoder),
+                    nexusrv_msg_decoder_offset(msg_decoder),
+                    nexusrv_trace_retired_icnt(&trace_decoder), *lastip);
+        else
+            l.format(FMT_TIME_OFFSET "SEEK TIME %" PRIu64 " to 0x%" PRIx64,
+                    nexusrv_trace_time(&trace_decoder),
+                    nexusrv_msg_decoder_offset(msg_decoder),
+                    seek->target, *lastip);
+        syms.print(*lastip);
+    };
+    if (seek) {
+        uint64_t addr;
+        rc = seek->by_icnt ?
+                nexusrv_trace_seek_icnt(&trace_decoder, seek->index,
+                                        seek->target, &addr) :
+                nexusrv_trace_seek_time(&trace_decoder, seek->index,
+                                        seek->target, &addr);
+        if (rc < 0)
+            error(-rc, 0, "trace_seek failed: %s",
+                  str_nexus_error(-rc));
+        lastip.emplace(addr);
+        seeking = true;
+        sink = &discard;
+    }
     for (;;) {
+        // Resume output at a known address
+        if (seeking && lastip.has_value() && seek_reached())
+            end_seek();
         nexusrv_msg msg;
         nexusrv_trace_indirect indir;
         nexusrv_trace_sync sync;
         nexusrv_trace_stop stop;
         nexusrv_trace_error err;
-        shared_ptr<rv_inst_block> instblock;
+        rv_inst_block *instblock = nullptr;
         unsigned event = NEXUSRV_Trace_Event_Sync;
+        // The next SYNC belongs to the next segment
+        if (!trace_decoder.synced && sync_limit && nsyncs == sync_limit)
+            goto done_trace;
         rc = nexusrv_trace_sync_reset(&trace_decoder, &sync);
         if (rc < 0)
             error(-rc, 0, "sync_reset failed: %s",
                   str_nexus_error(-rc));
         if (rc > 0) {
+            ++nsyncs;
             lastip.emplace(sync.addr);
+            if (sink) {
+                sink->write_sync(nexusrv_trace_time(&trace_decoder),
+                                 sync.addr, sync.sync);
+                goto check_time;
+            }
             l.newline();
             l.format(FMT_TIME_OFFSET " SYNC %u to 0x%" PRIx64,
                     nexusrv_trace_time(&trace_decoder),
                     nexusrv_msg_decoder_offset(msg_decoder),
                     sync.sync, *lastip);
-            print_sym(vm, l, *lastip, &last_func);
+            syms.print(*lastip);
             goto check_time;
         }
-        if (lastip.has_value()) {
-            auto it = insts.find(*lastip);
-            if (it == insts.end())
-                it = insts.emplace(*lastip,rv_inst_block::fetch(
-                        vm, *lastip, true)).first;
-            instblock = it->second;
+        if (lastip.has_value() && prevblock)
+            instblock = insts.chained(prevblock, *lastip);
+        if (lastip.has_value() && !instblock) {
+            instblock = insts.fetch(*vm, *lastip, true,
+                                    persistent_blocks.get());
+            if (prevblock && instblock)
+                insts.chain(prevblock, instblock);
         }
+        // Don't retire the block past the target I-CNT
+        if (seeking && instblock && seek->by_icnt &&
+            nexusrv_trace_retired_icnt(&trace_decoder) + instblock->icnt >
+            seek->target)
+            end_seek();
+        prevblock = nullptr;
         if (instblock) {
             event = NEXUSRV_Trace_Event_None;
             unsigned stack = nexusrv_trace_callstack_used(&trace_decoder);
-            try {
-                lastip.emplace(instblock->retire(&trace_decoder));
-            } catch (rv_inst_exc_event& exc_event) {
-                event = exc_event.event;
-                lastip.emplace(exc_event.addr);
-                assert(event != NEXUSRV_Trace_Event_None);
-                // It's possible the event is right after the inst block
-                assert(*lastip >= instblock->addr &&
-                       *lastip - instblock->addr <= instblock->icnt * 2);
-            } catch (rv_inst_exc_failed& failed) {
-                rc = failed.rc;
-                assert(rc < 0);
+            auto status = instblock->retire(&trace_decoder);
+            if (status.rc < 0) {
+                rc = status.rc;
                 goto handle_error;
             }
+            event = status.event;
+            lastip.emplace(status.next);
+            // It's possible the event is right after the inst block
+            assert(event == NEXUSRV_Trace_Event_None ||
+                   status.icnt <= instblock->icnt);
+            if (sink) {
+                if (event == NEXUSRV_Trace_Event_None) {
+                    sink->write_block(nexusrv_trace_time(&trace_decoder),
+                            instblock, status,
+                            nexusrv_trace_callstack_used(&trace_decoder));
+                    prevblock = instblock;
+                    continue;
+                }
+                sink->write_partial(nexusrv_trace_time(&trace_decoder),
+                                    instblock->addr, status.icnt);
+                goto handle_event;
+            }
             l.newline();
-            align_print(&addr_printed, l, l.format(
-                        FMT_TIME_OFFSET " 0x%" PRIx64 ",+%" PRIu32 "  ",
-                        nexusrv_trace_time(&trace_decoder),
-                        nexusrv_msg_decoder_offset(msg_decoder),
-                        instblock->addr, instblock->icnt));
+            {
+                // FMT_TIME_OFFSET " 0x%" PRIx64 ",+%" PRIu32 "  "
+                size_t printed = l.print("[");
+                printed += l.print_dec(nexusrv_trace_time(&trace_decoder));
+                printed += l.print("] +");
+                printed += l.print_dec(nexusrv_msg_decoder_offset(msg_decoder));
+                printed += l.print("  0x");
+                printed += l.print_hex(instblock->addr);
+                printed += l.print(",+");
+                printed += l.print_dec(instblock->icnt);
+                printed += l.print("  ");
+                align_print(&addr_printed, l, printed);
+            }
             if (event == NEXUSRV_Trace_Event_None) {
                 align_print(&inst_printed, l,
-                    l.print(instblock->to_string().c_str()));
+                    insts.print(l, *vm, instblock, status));
                 // Indent with stack depth
-                l.format(" │ %*s", stack, "");
-                print_sym(vm, l, instblock->addr, &last_func);
+                l.print(" │ ");
+                l.pad(stack);
+                syms.print(instblock->addr);
+                prevblock = instblock;
                 continue;
             }
-            auto insn = rv_inst_block::disasm1(vm, *lastip, true);
+            auto insn = disasm1(*vm, *lastip, true);
             align_print(&inst_printed, l, l.format(
                     "[retired %" PRIu64 "] %s%s%s",
                     (*lastip - instblock->addr) / 2,
@@ -222,7 +467,9 @@ handle_error:
         }
         if (lastip.has_value())
             lastip.emplace(*lastip + (uint32_t)rc * 2);
-        if (rc) {
+        if (rc && sink)
+            sink->write_retire(nexusrv_trace_time(&trace_decoder), rc);
+        else if (rc) {
             tnt_time = 0;
             l.newline();
             l.format(FMT_TIME_OFFSET "I-CNT %" PRIi32,
@@ -236,7 +483,8 @@ handle_event:
             case NEXUSRV_Trace_Event_DirectSync: {
                 /* Have no way to tell the branch target, reset lastip */
                 lastip.reset();
-                if (tnt_time != nexusrv_trace_time(&trace_decoder)) {
+                if (!sink &&
+                    tnt_time != nexusrv_trace_time(&trace_decoder)) {
                     l.newline();
                     l.format(FMT_TIME_OFFSET "TNT ",
                             nexusrv_trace_time(&trace_decoder),
@@ -249,6 +497,11 @@ handle_event:
                     error(-rc, 0, "next_tnt failed: %s",
                           str_nexus_error(-rc));
                 }
+                if (sink) {
+                    sink->write_tnt(nexusrv_trace_time(&trace_decoder),
+                                    rc > 0);
+                    break;
+                }
                 l.format("%c", rc > 0 ? '!' : '.');
                 break;
             }
@@ -262,6 +515,11 @@ handle_event:
                           str_nexus_error(-rc));
                 }
                 lastip.emplace(indir.target);
+                if (sink) {
+                    sink->write_indirect(nexusrv_trace_time(&trace_decoder),
+                                         indir);
+                    break;
+                }
                 l.newline();
                 l.format(FMT_TIME_OFFSET "INDIRECT%s%s to 0x%" PRIx64,
                         nexusrv_trace_time(&trace_decoder),
@@ -269,7 +527,7 @@ handle_event:
                         indir.interrupt ? " interrupt" : "",
                         indir.exception ? " exception" : "",
                         *lastip);
-                print_sym(vm, l, indir.target, &last_func);
+                syms.print(indir.target);
                 if (indir.ownership)
                     l.format(" fmt=%u priv=%u v=%u context=0x%" PRIx64,
                             indir.ownership_fmt,
@@ -279,6 +537,9 @@ handle_event:
                 break;
             }
             case NEXUSRV_Trace_Event_Sync: {
+                if (sync_limit && nsyncs == sync_limit)
+                    goto done_trace;
+                ++nsyncs;
                 rc = nexusrv_trace_next_sync(&trace_decoder, &sync);
                 if (rc < 0) {
                     l.flush();
@@ -286,12 +547,17 @@ handle_event:
                           str_nexus_error(-rc));
                 }
                 lastip.emplace(sync.addr);
+                if (sink) {
+                    sink->write_sync(nexusrv_trace_time(&trace_decoder),
+                                     sync.addr, sync.sync);
+                    break;
+                }
                 l.newline();
                 l.format(FMT_TIME_OFFSET "SYNC %u to 0x%" PRIx64,
                         nexusrv_trace_time(&trace_decoder),
                         nexusrv_msg_decoder_offset(msg_decoder),
                         sync.sync, *lastip);
-                print_sym(vm, l, sync.addr, &last_func);
+                syms.print(sync.addr);
                 break;
             }
             case NEXUSRV_Trace_Event_Stop: {
@@ -302,6 +568,11 @@ handle_event:
                     error(-rc, 0, "next_stop failed: %s",
                           str_nexus_error(-rc));
                 }
+                if (sink) {
+                    sink->write_stop(nexusrv_trace_time(&trace_decoder),
+                                     stop.evcode);
+                    break;
+                }
                 l.newline();
                 l.format(FMT_TIME_OFFSET "STOP evcode=%u",
                         nexusrv_trace_time(&trace_decoder),
@@ -317,6 +588,11 @@ handle_event:
                     error(-rc, 0, "next_error failed: %s",
                           str_nexus_error(-rc));
                 }
+                if (sink) {
+                    sink->write_error(nexusrv_trace_time(&trace_decoder),
+                                      err.etype, err.ecode);
+                    break;
+                }
                 l.newline();
                 l.format(FMT_TIME_OFFSET "ERROR etype=%u ecode=%u",
                         nexusrv_trace_time(&trace_decoder),
@@ -342,6 +618,9 @@ unknown_msg:
         }
         assert(rc > 0);
         nexusrv_trace_add_timestamp(&trace_decoder, msg.timestamp);
+        // Not representable in structured output
+        if (sink)
+            continue;
         l.flush();
         fprintf(fp, "[%" PRIu64 "] UNKNOWN MSG ", nexusrv_trace_time(&trace_decoder));
         nexusrv_print_msg(fp, &msg);
@@ -351,20 +630,260 @@ done_trace:
     nexusrv_trace_decoder_fini(&trace_decoder);
 }
 
+/*
+ * Load the index from filename, or build it by scanning the trace and
+ * save it to filename if it doesn't exist yet.
+ */
+static void prepare_index(nexusrv_msg_decoder *msg_decoder,
+                          const char *filename, nexusrv_trace_index *index) {
+    auto_fd fd(open(filename, O_RDONLY | O_CLOEXEC));
+    if (fd.fd >= 0) {
+        int rc = nexusrv_trace_index_load(index, fd.fd);
+        if (rc < 0)
+            error(-rc, 0, "Failed to load index %s: %s",
+                  filename, str_nexus_error(-rc));
+        if (index->src != msg_decoder->src_filter)
+            error(-1, 0, "Index %s is built for SRC %" PRIi16,
+                  filename, index->src);
+        return;
+    }
+    if (errno != ENOENT)
+        error(-1, errno, "Failed to open index %s", filename);
+    ssize_t rc = nexusrv_trace_index_scan(index, msg_decoder);
+    if (rc < 0)
+        error(-rc, 0, "index_scan failed: %s", str_nexus_error(-rc));
+    rc = nexusrv_msg_decoder_seek(msg_decoder, 0);
+    if (rc < 0)
+        error(-rc, errno, "msg_decoder_seek failed: %s",
+              str_nexus_error(-rc));
+    fd.reset(open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd.fd < 0)
+        error(-1, errno, "Failed to create index %s", filename);
+    rc = nexusrv_trace_index_save(index, fd.fd);
+    if (rc < 0)
+        error(-rc, errno, "Failed to save index %s", filename);
+}
+
+static vector<int16_t> split_cpus(const char *list) {
+    vector<int16_t> ret;
+    for (const char *str = list;;) {
+        char *end;
+        long cpu = strtol(str, &end, 0);
+        if (end == str || cpu < 0 || cpu > INT16_MAX ||
+            (*end && *end != ','))
+            error(-1, 0, "Invalid SRC list %s", list);
+        ret.push_back(cpu);
+        if (!*end)
+            return ret;
+        str = end + 1;
+    }
+}
+
+static int open_trace_at(const char *filename, off_t base) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        error(-1, errno, "Failed to open file %s", filename);
+    if (lseek(fd, base, SEEK_SET) != base)
+        error(-1, errno, "Failed to seek file %s", filename);
+    return fd;
+}
+
+/*
+ * Split the trace at SYNC Messages, replay the segments concurrently,
+ * and write the outputs in order. Segments are submitted in a sliding
+ * window to bound the memory held by the pending outputs.
+ */
+static void replay_parallel(shared_ptr<memory_view> vm,
+                            const nexusrv_hw_cfg *hwcfg,
+                            const char *filename, int fd, int16_t cpu,
+                            size_t bufsz, unsigned jobs, size_t segsz,
+                            FILE *fp) {
+    off_t base = lseek(fd, 0, SEEK_CUR);
+    if (base < 0)
+        error(-1, errno, "Parallel decoding requires a seekable trace file");
+    unique_ptr<uint8_t[]> buffer = make_unique<uint8_t[]>(bufsz);
+    nexusrv_msg_decoder msg_decoder = {};
+    nexusrv_msg_decoder_init(&msg_decoder,
+                             hwcfg, fd, cpu, buffer.get(), bufsz);
+    auto segments = split_trace_segments(&msg_decoder, segsz);
+    vector<promise<pair<char*, size_t> > > outputs(segments.size());
+    auto replay_segment = [&](size_t i) {
+        auto_fd seg_fd(open_trace_at(filename, base));
+        unique_ptr<uint8_t[]> seg_buffer = make_unique<uint8_t[]>(bufsz);
+        nexusrv_msg_decoder seg_decoder = {};
+        nexusrv_msg_decoder_init(&seg_decoder, hwcfg, seg_fd.fd, cpu,
+                                 seg_buffer.get(), bufsz);
+        int rc = nexusrv_msg_decoder_seek(&seg_decoder, segments[i].offset);
+        if (rc < 0)
+            error(-rc, errno, "msg_decoder_seek failed: %s",
+                  str_nexus_error(-rc));
+        char *out_buf = nullptr;
+        size_t out_len = 0;
+        FILE *out = open_memstream(&out_buf, &out_len);
+        if (!out)
+            error(-1, errno, "open_memstream failed");
+        // The last segment runs till the end of trace
+        replay(vm, &seg_decoder, out,
+               i + 1 < segments.size() ? segments[i].nsyncs : 0,
+               nullptr, segments[i].ticks);
+        fclose(out);
+        outputs[i].set_value(make_pair(out_buf, out_len));
+    };
+    work_stealing_pool pool(jobs);
+    size_t window = jobs * 2, submitted = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        for (; submitted < segments.size() &&
+               submitted < i + window; ++submitted)
+            pool.submit([&replay_segment, submitted] {
+                replay_segment(submitted);
+            });
+        auto [out_buf, out_len] = outputs[i].get_future().get();
+        if (out_len && fwrite(out_buf, out_len, 1, fp) != 1)
+            error(-1, errno, "Failed to write output");
+        free(out_buf);
+    }
+}
+
+static void write_header(FILE *fp) {
+    if (format == format_bin)
+        evstream_sink::write_header(fp);
+    else if (format == format_chrome)
+        chrome_sink::write_header(fp);
+}
+
+/*
+ * Replay the trace of one SRC (hart) from fd, split in segments and
+ * decoded in parallel if jobs > 1
+ */
+static void replay_hart(shared_ptr<memory_view> vm,
+                        const nexusrv_hw_cfg *hwcfg,
+                        const char *filename, int fd, int16_t cpu,
+                        size_t bufsz, unsigned jobs, size_t segsz,
+                        optional<trace_seek> seek, const char *index_file,
+                        FILE *fp) {
+    if (jobs > 1) {
+        replay_parallel(vm, hwcfg, filename, fd, cpu,
+                        bufsz, jobs, segsz, fp);
+        return;
+    }
+    unique_ptr<uint8_t[]> buffer = make_unique<uint8_t[]>(bufsz);
+    nexusrv_msg_decoder msg_decoder = {};
+    nexusrv_msg_decoder_init(&msg_decoder,
+                             hwcfg, fd, cpu, buffer.get(), bufsz);
+    nexusrv_trace_index index;
+    nexusrv_trace_index_init(&index);
+    if (index_file)
+        prepare_index(&msg_decoder, index_file, &index);
+    if (seek.has_value() && index_file)
+        seek->index = &index;
+    replay(vm, &msg_decoder, fp, 0,
+           seek.has_value() ? &*seek : nullptr);
+    nexusrv_trace_index_fini(&index);
+}
+
+/*
+ * Replay each SRC (hart) in its own thread, sharing the memory view
+ * and the block cache. The output of each SRC goes to {prefix}.{SRC}
+ * if prefix is given, otherwise to a temporary file, and all of them
+ * are merged to fp in the order of cpus after the replay.
+ */
+static void replay_harts(shared_ptr<memory_view> vm,
+                         const nexusrv_hw_cfg *hwcfg,
+                         const char *filename, int fd,
+                         const vector<int16_t> &cpus,
+                         size_t bufsz, unsigned jobs, size_t segsz,
+                         optional<trace_seek> seek, const char *index_file,
+                         const char *prefix, FILE *fp) {
+    off_t base = lseek(fd, 0, SEEK_CUR);
+    if (cpus.size() > 1 && base < 0)
+        error(-1, errno, "Replaying multiple SRCs requires a seekable trace file");
+    vector<auto_file> outputs;
+    for (auto cpu : cpus) {
+        FILE *out;
+        if (prefix) {
+            string out_name = cppfmt("%s.%d", prefix, cpu);
+            out = fopen(out_name.c_str(), "wb");
+            if (!out)
+                error(-1, errno, "Failed to create %s", out_name.c_str());
+            write_header(out);
+        } else {
+            out = tmpfile();
+            if (!out)
+                error(-1, errno, "Failed to create temporary file");
+        }
+        outputs.emplace_back(out, &fclose);
+    }
+    vector<thread> threads;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        threads.emplace_back([&, i] {
+            // The index is built for a particular SRC
+            string hart_index;
+            if (index_file && cpus.size() > 1)
+                hart_index = cppfmt("%s.%d", index_file, cpus[i]);
+            auto_fd hart_fd(i ? open_trace_at(filename, base) : dup(fd));
+            if (hart_fd.fd < 0)
+                error(-1, errno, "Failed to dup trace file");
+            replay_hart(vm, hwcfg, filename, hart_fd.fd, cpus[i],
+                        bufsz, jobs, segsz, seek,
+                        hart_index.empty() ? index_file : hart_index.c_str(),
+                        outputs[i].get());
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    if (prefix)
+        return;
+    write_header(fp);
+    char buffer[BUFSIZ];
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        FILE *out = outputs[i].get();
+        if (format == format_text && cpus.size() > 1)
+            fprintf(fp, "SRC %d:\n", cpus[i]);
+        rewind(out);
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), out)))
+            if (fwrite(buffer, n, 1, fp) != 1)
+                error(-1, errno, "Failed to write output");
+        if (ferror(out))
+            error(-1, errno, "Failed to read temporary file");
+    }
+}
+
+static void write_profile(shared_ptr<memory_view> vm, const char *prefix) {
+    auto resolve = [vm](uint64_t addr) { return query_func(vm, addr); };
+    string filename = cppfmt("%s.folded", prefix);
+    auto_file fp(fopen(filename.c_str(), "w"), &fclose);
+    if (!fp)
+        error(-1, errno, "Failed to create %s", filename.c_str());
+    profile.write_folded(fp.get(), resolve);
+    filename = cppfmt("%s.pb", prefix);
+    fp.reset(fopen(filename.c_str(), "wb"));
+    if (!fp)
+        error(-1, errno, "Failed to create %s", filename.c_str());
+    profile.write_pprof(fp.get(), resolve);
+}
+
 int main(int argc, char **argv) {
     nexusrv_hw_cfg hwcfg = {};
     const char *hwcfg_str = "generic64";
-    int16_t cpu = -1;
     size_t bufsz = DEFAULT_BUFFER_SIZE;
+    unsigned jobs = 1;
+    size_t segsz = DEFAULT_SEGMENT_SIZE;
     const char *sysfs = "/sys";
     const char *procfs = "/proc";
     vector<string> sysroot_dirs = { "/" };
     vector<string> dbg_dirs = { "/usr/lib/debug" };
+    optional<trace_seek> seek;
+    const char *index_file = nullptr;
+    const char *cachedir = nullptr;
+    const char *profile_prefix = nullptr;
+    const char *output_prefix = nullptr;
+    vector<int16_t> cpus;
     auto vm = make_shared<memory_view>();
     OPT_PARSE_BEGIN
     OPT_PARSE_H_HELP
     OPT_PARSE_W_HWCFG
-    OPT_PARSE_C_CPU
+    OPT_PARSE_C_CPUS
     OPT_PARSE_B_BUFSZ
     OPT_PARSE_U_UCORE
     OPT_PARSE_R_SYSROOT
@@ -372,7 +891,19 @@ int main(int argc, char **argv) {
     OPT_PARSE_P_PROCFS
     OPT_PARSE_Y_SYSFS
     OPT_PARSE_K_KCORE
+    OPT_PARSE_CAP_K_KBUNDLE
     OPT_PARSE_E_ELF
+    OPT_PARSE_J_JOBS
+    OPT_PARSE_G_SEGSZ
+    OPT_PARSE_T_SEEK_TIME
+    OPT_PARSE_N_SEEK_ICNT
+    OPT_PARSE_I_INDEX
+    OPT_PARSE_CAP_C_CACHEDIR
+    OPT_PARSE_F_FORMAT
+    OPT_PARSE_CAP_P_PROFILE
+    OPT_PARSE_O_OUTPUT
+    OPT_PARSE_A_ADDR2LINE
+    OPT_PARSE_CAP_M_MMAP
     OPT_PARSE_END
     if (argc == optind)
         error(-1, 0, "Insufficient arguments");
@@ -380,11 +911,36 @@ int main(int argc, char **argv) {
         error(-1, 0, "Invalid hwcfg string");
     char *filename = argv[optind];
     int fd = open_seek_file(filename, O_RDONLY | O_CLOEXEC);
-    unique_ptr<uint8_t[]> buffer = make_unique<uint8_t[]>(bufsz);
-    nexusrv_msg_decoder msg_decoder = {};
-    nexusrv_msg_decoder_init(&msg_decoder,
-                             &hwcfg, fd, cpu, buffer.get(), bufsz);
-    replay(vm, &msg_decoder, stdout);
+    if (cachedir)
+        persistent_blocks = make_unique<block_cache>(cachedir);
+    if (jobs > 1 && seek.has_value())
+        error(-1, 0, "Seeking is not supported with parallel decoding");
+    if (cpus.empty())
+        cpus.push_back(-1);
+    // The profile replaces the output, -f would be silently ignored
+    if (profile_prefix) {
+        if (format != format_text)
+            error(-1, 0, "--format can't be combined with --profile");
+        format = format_profile;
+    }
+    // The profile is written to {prefix}.folded and .pb, not per SRC
+    if (format == format_profile)
+        output_prefix = nullptr;
+    // The event stream doesn't tell SRCs apart
+    if (format == format_bin && cpus.size() > 1 && !output_prefix)
+        error(-1, 0, "Binary output of multiple SRCs requires --output");
+    if (cpus.size() > 1 || output_prefix)
+        replay_harts(vm, &hwcfg, filename, fd, cpus, bufsz, jobs, segsz,
+                     seek, index_file, output_prefix, stdout);
+    else {
+        write_header(stdout);
+        replay_hart(vm, &hwcfg, filename, fd, cpus[0], bufsz, jobs, segsz,
+                    seek, index_file, stdout);
+    }
+    if (persistent_blocks)
+        persistent_blocks->save();
+    if (profile_prefix)
+        write_profile(vm, profile_prefix);
     close(fd);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * segment.cpp - Split trace into independently decodable segments
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <error.h>
+extern "C" {
+#include <libnexus-rv/error.h>
+#include <libnexus-rv/trace-index.h>
+}
+#include "segment.h"
+
+using namespace std;
+
+vector<trace_segment> split_trace_segments(
+        nexusrv_msg_decoder *msg_decoder, size_t segsz) {
+    nexusrv_trace_index index;
+    nexusrv_trace_index_init(&index);
+    ssize_t rc = nexusrv_trace_index_scan(&index, msg_decoder);
+    if (rc < 0)
+        error(-rc, 0, "trace_index_scan failed: %s",
+              str_nexus_error(-rc));
+    vector<trace_segment> segments;
+    segments.push_back(trace_segment{0, 0, 0});
+    for (size_t i = 0; i < index.size; ++i) {
+        auto &entry = index.entries[i];
+        auto &last = segments.back();
+        if (entry.offset - last.offset >= segsz && last.nsyncs)
+            segments.push_back(trace_segment{entry.offset, 0, entry.ticks});
+        ++segments.back().nsyncs;
+    }
+    nexusrv_trace_index_fini(&index);
+    return segments;
+}
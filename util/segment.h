@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_SEGMENT_H
+#define LIBNEXUS_RV_SEGMENT_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+extern "C" {
+#include <libnexus-rv/msg-decoder.h>
+}
+
+/*
+ * A segment of the trace that can be decoded independently
+ *
+ * Except for the first one, a segment starts at a SYNC Message, where
+ * the address and the return stack are fully reset. The SYNC only has
+ * the TIMESTAMP bits, so the extended timestamp at the SYNC is recorded
+ * by the scan, and the time tracker is seeded with it. Hence, decoding
+ * segments concurrently produces the same events as decoding the whole
+ * trace sequentially. A segment ends right before the SYNC Message that
+ * starts the next segment.
+ */
+struct trace_segment {
+    size_t offset;    /* Byte offset of the first Message */
+    size_t nsyncs;    /* Number of SYNC Messages within the segment */
+    uint64_t ticks;   /* Extended timestamp after the first SYNC */
+};
+
+/*
+ * Scan the Messages from msg_decoder like the trace index, and split the
+ * trace at SYNC Messages into segments of at least segsz bytes.
+ */
+std::vector<trace_segment> split_trace_segments(
+        nexusrv_msg_decoder *msg_decoder, size_t segsz);
+
+#endif
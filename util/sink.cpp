@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ * sink.cpp - Structured output of replay
+ *
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#include <cerrno>
+#include <cinttypes>
+#include <error.h>
+extern "C" {
+#include <libnexus-rv/error.h>
+}
+#include "sink.h"
+
+using namespace std;
+
+static inline nexusrv_evstream_rec make_rec(uint8_t type, uint64_t time) {
+    nexusrv_evstream_rec rec = {};
+    rec.type = type;
+    rec.time = time;
+    return rec;
+}
+
+evstream_sink::evstream_sink(FILE *fp) : fp(fp) {
+    nexusrv_evstream_state_init(&state);
+}
+
+void evstream_sink::write_header(FILE *fp) {
+    uint8_t header[NEXUSRV_EVSTREAM_HEADER];
+    nexusrv_evstream_header(header);
+    if (fwrite(header, sizeof(header), 1, fp) != 1)
+        error(-1, errno, "Failed to write output");
+}
+
+void evstream_sink::write(const nexusrv_evstream_rec &rec) {
+    uint8_t buffer[NEXUSRV_EVSTREAM_MAX_RECORD];
+    ssize_t rc = nexusrv_evstream_encode(&state, buffer,
+                                         sizeof(buffer), &rec);
+    if (rc < 0)
+        error(-rc, 0, "evstream_encode failed: %s",
+              str_nexus_error(-rc));
+    if (fwrite(buffer, rc, 1, fp) != 1)
+        error(-1, errno, "Failed to write output");
+}
+
+void evstream_sink::write_block(uint64_t time, const rv_inst_block *block,
+                                const rv_inst_status &status,
+                                unsigned stack) {
+    auto rec = make_rec(NEXUSRV_Evstream_Block, time);
+    rec.flags = (status.taken ? NEXUSRV_EVSTREAM_TAKEN : 0) |
+                (status.implicit ? NEXUSRV_EVSTREAM_IMPLICIT : 0) |
+                (status.coswap ? NEXUSRV_EVSTREAM_COSWAP : 0);
+    rec.kind = block->kind;
+    rec.icnt = block->icnt;
+    rec.stack = stack;
+    rec.addr = block->addr;
+    switch (block->kind) {
+        // The target is not known from the program
+        case NEXUSRV_ITYPE_Indirect_Jump:
+        case NEXUSRV_ITYPE_Indirect_Call:
+        case NEXUSRV_ITYPE_Function_Return:
+        case NEXUSRV_ITYPE_Coroutine_Swap:
+        case NEXUSRV_ITYPE_Trap_Return:
+        case NEXUSRV_ITYPE_Exception:
+            rec.flags |= NEXUSRV_EVSTREAM_TARGET;
+            rec.target = status.next;
+    }
+    write(rec);
+}
+
+void evstream_sink::write_partial(uint64_t time, uint64_t addr,
+                                  uint32_t icnt) {
+    auto rec = make_rec(NEXUSRV_Evstream_Partial, time);
+    rec.icnt = icnt;
+    rec.addr = addr;
+    write(rec);
+}
+
+void evstream_sink::write_retire(uint64_t time, uint32_t icnt) {
+    auto rec = make_rec(NEXUSRV_Evstream_Retire, time);
+    rec.icnt = icnt;
+    write(rec);
+}
+
+void evstream_sink::write_tnt(uint64_t time, bool taken) {
+    auto rec = make_rec(NEXUSRV_Evstream_TNT, time);
+    rec.flags = taken ? NEXUSRV_EVSTREAM_TAKEN : 0;
+    write(rec);
+}
+
+void evstream_sink::write_indirect(uint64_t time,
+                                   const nexusrv_trace_indirect &indir) {
+    auto rec = make_rec(NEXUSRV_Evstream_Indirect, time);
+    rec.flags = (indir.interrupt ? NEXUSRV_EVSTREAM_INTERRUPT : 0) |
+                (indir.exception ? NEXUSRV_EVSTREAM_EXCEPTION : 0);
+    if (indir.ownership) {
+        rec.flags |= NEXUSRV_EVSTREAM_OWNERSHIP;
+        rec.code = indir.ownership_fmt |
+                   indir.ownership_priv << 2 |
+                   indir.ownership_v << 4;
+        rec.data = indir.context;
+    }
+    rec.addr = indir.target;
+    write(rec);
+}
+
+void evstream_sink::write_sync(uint64_t time, uint64_t addr, unsigned sync,
+                               bool seek) {
+    auto rec = make_rec(NEXUSRV_Evstream_Sync, time);
+    rec.flags = seek ? NEXUSRV_EVSTREAM_SEEK : 0;
+    rec.code = sync;
+    rec.addr = addr;
+    write(rec);
+}
+
+void evstream_sink::write_stop(uint64_t time, unsigned evcode) {
+    auto rec = make_rec(NEXUSRV_Evstream_Stop, time);
+    rec.code = evcode;
+    write(rec);
+}
+
+void evstream_sink::write_error(uint64_t time, unsigned etype,
+                                uint32_t ecode) {
+    auto rec = make_rec(NEXUSRV_Evstream_Error, time);
+    rec.code = etype;
+    rec.data = ecode;
+    write(rec);
+}
+
+chrome_sink::chrome_sink(FILE *fp, int tid, resolver resolve) :
+    fp(fp), tid(tid), resolve(std::move(resolve)), depth(0), last_time(0),
+    in_gap(false) {}
+
+chrome_sink::~chrome_sink() {
+    end_all(last_time);
+}
+
+void chrome_sink::write_header(FILE *fp) {
+    fputs("[\n", fp);
+}
+
+static void print_json_str(FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (; *str; ++str) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            fputc('\\', fp);
+        if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+// Chrome trace-event timestamps are in microseconds
+#define FMT_CHROME_TS "%" PRIu64 ".%03u"
+#define ARG_CHROME_TS(TIME) (TIME) / 1000, unsigned((TIME) % 1000)
+
+void chrome_sink::begin(uint64_t time, uint64_t target, const char *cat) {
+    auto *func = resolve(target);
+    fputs("{\"name\":", fp);
+    if (func)
+        print_json_str(fp, func->c_str());
+    else
+        fprintf(fp, "\"0x%" PRIx64 "\"", target);
+    fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"B\",\"ts\":" FMT_CHROME_TS
+                ",\"pid\":0,\"tid\":%d},\n",
+            cat, ARG_CHROME_TS(time), tid);
+    ++depth;
+    last_time = time;
+}
+
+void chrome_sink::end(uint64_t time) {
+    // Returning from functions called before the trace started
+    if (!depth)
+        return;
+    fprintf(fp, "{\"ph\":\"E\",\"ts\":" FMT_CHROME_TS
+                ",\"pid\":0,\"tid\":%d},\n",
+            ARG_CHROME_TS(time), tid);
+    --depth;
+    last_time = time;
+}
+
+void chrome_sink::end_all(uint64_t time) {
+    while (depth)
+        end(time);
+    in_gap = false;
+}
+
+void chrome_sink::instant(uint64_t time, const char *name) {
+    fprintf(fp, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":"
+                FMT_CHROME_TS ",\"pid\":0,\"tid\":%d},\n",
+            name, ARG_CHROME_TS(time), tid);
+    last_time = time;
+}
+
+// Slice of lost trace, ended at the next SYNC by end_all
+void chrome_sink::gap(uint64_t time, const char *name) {
+    fprintf(fp, "{\"name\":\"%s\",\"cat\":\"gap\",\"ph\":\"B\",\"ts\":"
+                FMT_CHROME_TS ",\"pid\":0,\"tid\":%d},\n",
+            name, ARG_CHROME_TS(time), tid);
+    ++depth;
+    in_gap = true;
+    last_time = time;
+}
+
+void chrome_sink::write_block(uint64_t time, const rv_inst_block *block,
+                              const rv_inst_status &status, unsigned) {
+    switch (block->kind) {
+        case NEXUSRV_ITYPE_Direct_Call:
+        case NEXUSRV_ITYPE_Indirect_Call:
+            begin(time, status.next, "call");
+            break;
+        case NEXUSRV_ITYPE_Function_Return:
+        case NEXUSRV_ITYPE_Trap_Return:
+            end(time);
+            break;
+        case NEXUSRV_ITYPE_Coroutine_Swap:
+            if (status.coswap)
+                end(time);
+            begin(time, status.next, "call");
+            break;
+        case NEXUSRV_ITYPE_Exception:
+            begin(time, status.next, "exception");
+            break;
+    }
+}
+
+void chrome_sink::write_indirect(uint64_t time,
+                                 const nexusrv_trace_indirect &indir) {
+    if (indir.interrupt || indir.exception)
+        begin(time, indir.target, indir.interrupt ? "interrupt" : "exception");
+}
+
+void chrome_sink::write_sync(uint64_t time, uint64_t, unsigned, bool seek) {
+    // The end of the gap after STOP or ERROR marks the SYNC, if any
+    bool gap = in_gap;
+    end_all(time);
+    if (!gap)
+        instant(time, seek ? "SEEK" : "SYNC");
+}
+
+void chrome_sink::write_stop(uint64_t time, unsigned) {
+    end_all(time);
+    gap(time, "STOP");
+}
+
+void chrome_sink::write_error(uint64_t time, unsigned, uint32_t) {
+    end_all(time);
+    gap(time, "ERROR");
+}
@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: Apache 2.0
+/*
+ *  Copyright (C) 2025, Bo Gan <ganboing@gmail.com>
+ */
+
+#ifndef LIBNEXUS_RV_SINK_H
+#define LIBNEXUS_RV_SINK_H
+
+#include <cstdio>
+#include <string>
+#include <functional>
+extern "C" {
+#include <libnexus-rv/error.h>
+#include <libnexus-rv/trace-decoder.h>
+#include <libnexus-rv/event-stream.h>
+}
+#include "inst.h"
+
+/*
+ * Structured output of replay, as an alternative to the text log.
+ * Time is nexusrv_trace_time of the decoder at the event.
+ */
+struct replay_sink {
+    virtual ~replay_sink() {}
+    // Block retired fully, stack is the return stack depth after it
+    virtual void write_block(uint64_t time, const rv_inst_block *block,
+                             const rv_inst_status &status,
+                             unsigned stack) = 0;
+    // Block stopped by the following event after icnt
+    virtual void write_partial(uint64_t time, uint64_t addr,
+                               uint32_t icnt) = 0;
+    virtual void write_retire(uint64_t time, uint32_t icnt) = 0;
+    virtual void write_tnt(uint64_t time, bool taken) = 0;
+    virtual void write_indirect(uint64_t time,
+                                const nexusrv_trace_indirect &indir) = 0;
+    virtual void write_sync(uint64_t time, uint64_t addr, unsigned sync,
+                            bool seek = false) = 0;
+    virtual void write_stop(uint64_t time, unsigned evcode) = 0;
+    virtual void write_error(uint64_t time, unsigned etype,
+                             uint32_t ecode) = 0;
+};
+
+// Drops everything, e.g., while fast-forwarding to the seek target
+struct discard_sink : replay_sink {
+    void write_block(uint64_t, const rv_inst_block *,
+                     const rv_inst_status &, unsigned) override {}
+    void write_partial(uint64_t, uint64_t, uint32_t) override {}
+    void write_retire(uint64_t, uint32_t) override {}
+    void write_tnt(uint64_t, bool) override {}
+    void write_indirect(uint64_t, const nexusrv_trace_indirect &) override {}
+    void write_sync(uint64_t, uint64_t, unsigned, bool) override {}
+    void write_stop(uint64_t, unsigned) override {}
+    void write_error(uint64_t, unsigned, uint32_t) override {}
+};
+
+// Records of libnexus-rv/event-stream.h
+struct evstream_sink : replay_sink {
+    explicit evstream_sink(FILE *fp);
+    static void write_header(FILE *fp);
+    void write_block(uint64_t time, const rv_inst_block *block,
+                     const rv_inst_status &status, unsigned stack) override;
+    void write_partial(uint64_t time, uint64_t addr, uint32_t icnt) override;
+    void write_retire(uint64_t time, uint32_t icnt) override;
+    void write_tnt(uint64_t time, bool taken) override;
+    void write_indirect(uint64_t time,
+                        const nexusrv_trace_indirect &indir) override;
+    void write_sync(uint64_t time, uint64_t addr, unsigned sync,
+                    bool seek) override;
+    void write_stop(uint64_t time, unsigned evcode) override;
+    void write_error(uint64_t time, unsigned etype, uint32_t ecode) override;
+private:
+    void write(const nexusrv_evstream_rec &rec);
+    FILE *fp;
+    nexusrv_evstream_state state;
+};
+
+/*
+ * Chrome trace-event JSON (Array Format), viewable in Perfetto UI
+ *
+ * Calls and traps begin a slice named by the function of the target, and
+ * returns end it. The slices of a hart are in the thread of its SRC.
+ * The call stack is lost at SYNC, STOP and ERROR, so all open slices are
+ * ended there. The gap of trace after STOP or ERROR is a slice of its
+ * own, ended by the next SYNC, which is an instant event otherwise.
+ * Timestamps are nanoseconds written as microseconds, so they count in
+ * 1000 timer ticks if the timer frequency of the HW config is unknown.
+ * Events are written as they come, and the closing bracket
+ * is optional in Array Format, so segments can be concatenated.
+ */
+struct chrome_sink : replay_sink {
+    typedef std::function<const std::string*(uint64_t)> resolver;
+    chrome_sink(FILE *fp, int tid, resolver resolve);
+    ~chrome_sink();
+    static void write_header(FILE *fp);
+    void write_block(uint64_t time, const rv_inst_block *block,
+                     const rv_inst_status &status, unsigned stack) override;
+    void write_partial(uint64_t, uint64_t, uint32_t) override {}
+    void write_retire(uint64_t, uint32_t) override {}
+    void write_tnt(uint64_t, bool) override {}
+    void write_indirect(uint64_t time,
+                        const nexusrv_trace_indirect &indir) override;
+    void write_sync(uint64_t time, uint64_t addr, unsigned sync,
+                    bool seek) override;
+    void write_stop(uint64_t time, unsigned evcode) override;
+    void write_error(uint64_t time, unsigned etype, uint32_t ecode) override;
+private:
+    void begin(uint64_t time, uint64_t target, const char *cat);
+    void end(uint64_t time);
+    void end_all(uint64_t time);
+    void instant(uint64_t time, const char *name);
+    void gap(uint64_t time, const char *name);
+    FILE *fp;
+    int tid;
+    resolver resolve;
+    unsigned depth;
+    uint64_t last_time;
+    // The gap slice is the outermost open one
+    bool in_gap;
+};
+
+#endif
@@ -24,8 +24,40 @@ const char *exe_addr2line = []{
    return DEFAULT_ADDR2LINE;
 }();
 
-sym_server::sym_server(const char *filename, const char *section) :
-read_fp(nullptr, fclose), write_fp(nullptr, fclose) {
+bool sym_use_addr2line = false;
+
+/*
+ * Fail in the forked child, which must not run the exit() handlers, or
+ * use stdio locks, copied from the parent
+ */
+static void child_fail(const char *msg) {
+    [[maybe_unused]] ssize_t rc = write(STDERR_FILENO, msg, strlen(msg));
+    _exit(127);
+}
+
+sym_server::sym_server(shared_ptr<obj_file> obj, const char *section) :
+obj(obj), by_section(section), read_fp(nullptr, fclose),
+write_fp(nullptr, fclose) {
+    if (!sym_use_addr2line) {
+        if (section) {
+            auto &sects = obj->get_sec_by_name();
+            auto it = sects.find(section);
+            if (it != sects.end())
+                this->section = it->second;
+            return;
+        }
+        lock_guard<mutex> guard(bfd_lock);
+        bfd_map_over_sections(obj->get_bfd(),
+                [](bfd*, asection *sect, void *srv) {
+            // Debug files have code sections as NOBITS, thus no SEC_LOAD
+            if (!(bfd_section_flags(sect) & SEC_ALLOC) ||
+                !bfd_section_size(sect))
+                return;
+            static_cast<sym_server*>(srv)->sections.emplace(
+                    bfd_section_vma(sect), sect);
+        }, this);
+        return;
+    }
     union {
         struct {
             int client_r;
@@ -47,51 +79,178 @@ read_fp(nullptr, fclose), write_fp(nullptr, fclose) {
         close(fds.server_w);
         read_fp.reset(fdopen(fds.client_r, "r"));
         write_fp.reset(fdopen(fds.client_w, "w"));
-        setlinebuf(write_fp.get());
+        // Flushed by send() in batches
+        setvbuf(write_fp.get(), nullptr, _IOFBF, 1 << 16);
+        reader = thread(&sym_server::read_answers, this);
     } else {
         // The child is the server
         close(fds.client_r);
         close(fds.client_w);
         if (dup2(fds.server_r, STDIN_FILENO) < 0 ||
             dup2(fds.server_w, STDOUT_FILENO) < 0)
-            error(-1, errno, "dup2 failed");
+            child_fail("dup2 failed\n");
         close(fds.server_r);
         close(fds.server_w);
-        const char *args[] = {exe_addr2line, "-f", "-e", filename,
+        const char *args[] = {exe_addr2line, "-f", "-e", obj->filename(),
                               nullptr, nullptr, nullptr};
         if (section) {
             args[4] = "-j";
             args[5] = section;
         }
         execvp(exe_addr2line, (char**)args);
-        error(-1, errno, "exec addr2line failed");
+        child_fail("exec addr2line failed\n");
+    }
+}
+
+sym_server::~sym_server() {
+    if (reader.joinable()) {
+        // addr2line exits on EOF, and then the reader
+        write_fp.reset();
+        reader.join();
     }
+    free(line);
 }
 
 sym_answer sym_server::query(uint64_t addr) {
+    if (!reader.joinable()) {
+        lock_guard<mutex> guard(lock);
+        auto it = cached.find(addr);
+        if (it == cached.end())
+            it = cached.emplace(addr, query_bfd(addr)).first;
+        return it->second;
+    }
+    request(addr);
+    unique_lock<mutex> guard(lock);
     auto it = cached.find(addr);
     if (it != cached.end())
         return it->second;
+    uint64_t seq = pending.at(addr);
+    guard.unlock();
+    send_batch(seq);
+    guard.lock();
+    answered.wait(guard, [&] {
+        it = cached.find(addr);
+        return it != cached.end();
+    });
+    return it->second;
+}
+
+void sym_server::request(uint64_t addr) {
+    if (!reader.joinable())
+        return;
+    // In the same order as inflight
+    lock_guard<mutex> send_guard(send_lock);
+    {
+        lock_guard<mutex> guard(lock);
+        if (cached.count(addr) || !pending.emplace(addr, requested).second)
+            return;
+        inflight.push_back(addr);
+    }
     fprintf(write_fp.get(), "0x%" PRIx64 "\n", addr);
-    ssize_t rc = getline(&line, &linesz, read_fp.get());
-    if (rc <= 0)
-        error(-1, errno, "getline failed (function)");
-    const string *func = &*strings.emplace(line, rc - 1).first;
-    rc = getline(&line, &linesz, read_fp.get());
-    if (rc <= 0)
-        error(-1, errno, "getline failed (filename/notes)");
-    auto cpos = strrchr(line, ':');
-    const string *filename = nullptr;
-    unsigned long lineno = 0;
-    const string *note = nullptr;
-    if (cpos) {
-        filename = &*strings.emplace(line, cpos).first;
-        lineno = strtoul(cpos + 1, &cpos, 10);
-        if (cpos != line + rc - 1)
-            note = &*strings.emplace(cpos, line + rc - 1).first;
+    if (++requested - sent >= batch)
+        send();
+}
+
+bool sym_server::ready(uint64_t addr) {
+    if (!reader.joinable())
+        return true;
+    uint64_t seq;
+    {
+        lock_guard<mutex> guard(lock);
+        if (cached.count(addr))
+            return true;
+        seq = pending.at(addr);
     }
-    it = cached.emplace(addr, sym_answer{func, filename, lineno, note}).first;
-    return it->second;
+    // Not answered, maybe because it's still in the batch
+    send_batch(seq);
+    return false;
+}
+
+// send_lock must be held
+void sym_server::send() {
+    if (fflush(write_fp.get()))
+        error(-1, errno, "Failed to write to addr2line");
+    sent = requested;
+}
+
+// Send the batch of the request with sequence seq, if not yet
+void sym_server::send_batch(uint64_t seq) {
+    lock_guard<mutex> guard(send_lock);
+    if (seq >= sent)
+        send();
+}
+
+// Reader thread of addr2line answers, two lines per address
+void sym_server::read_answers() {
+    for (;;) {
+        ssize_t rc = getline(&line, &linesz, read_fp.get());
+        if (rc <= 0) {
+            lock_guard<mutex> guard(lock);
+            if (inflight.empty())
+                return;
+            error(-1, errno, "getline failed (function)");
+        }
+        string func(line, rc - 1);
+        rc = getline(&line, &linesz, read_fp.get());
+        if (rc <= 0)
+            error(-1, errno, "getline failed (filename/notes)");
+        auto cpos = strrchr(line, ':');
+        lock_guard<mutex> guard(lock);
+        const string *filename = nullptr;
+        unsigned long lineno = 0;
+        const string *note = nullptr;
+        if (cpos) {
+            filename = &*strings.emplace(line, cpos).first;
+            lineno = strtoul(cpos + 1, &cpos, 10);
+            if (cpos != line + rc - 1)
+                note = &*strings.emplace(cpos, line + rc - 1).first;
+        }
+        uint64_t addr = inflight.front();
+        inflight.pop_front();
+        pending.erase(addr);
+        cached.emplace(addr, sym_answer{&*strings.emplace(move(func)).first,
+                                        filename, lineno, note});
+        answered.notify_all();
+    }
+}
+
+// Same answer as addr2line -f, without inlined frames, lock must be held
+sym_answer sym_server::query_bfd(uint64_t addr) {
+    asection *sect = section;
+    uint64_t offset = addr;
+    if (!by_section) {
+        sect = nullptr;
+        auto it = sections.upper_bound(addr);
+        if (it != sections.begin() &&
+            addr - (--it)->first < bfd_section_size(it->second)) {
+            sect = it->second;
+            offset = addr - it->first;
+        }
+    } else if (sect && offset >= bfd_section_size(sect))
+        sect = nullptr;
+    const char *filename = nullptr, *func = nullptr;
+    unsigned lineno = 0, discriminator = 0;
+    string func_str = "??", filename_str = "??";
+    if (sect) {
+        lock_guard<mutex> guard(bfd_lock);
+        if (bfd_find_nearest_line_discriminator(
+                obj->get_bfd(), sect, obj->get_symtab(), offset,
+                &filename, &func, &lineno, &discriminator)) {
+            // Owned by bfd, copy before releasing the lock
+            if (func && *func)
+                func_str = func;
+            if (filename)
+                filename_str = filename;
+        } else
+            discriminator = 0;
+    }
+    const string *note = nullptr;
+    if (discriminator)
+        note = &*strings.emplace(
+                cppfmt(" (discriminator %u)", discriminator)).first;
+    return sym_answer{&*strings.emplace(move(func_str)).first,
+                      &*strings.emplace(move(filename_str)).first,
+                      lineno, note};
 }
 
 void sym_iterate_kallsyms(FILE *fp, const function<
@@ -11,7 +11,12 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <functional>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "misc.h"
+#include "objfile.h"
 
 struct sym_answer {
     const std::string *func;
@@ -20,15 +25,56 @@ struct sym_answer {
     const std::string *note;
 };
 
+// Use external addr2line instead of reading the line table in-process
+extern bool sym_use_addr2line;
+
+/*
+ * Function and source line of addresses in an object
+ *
+ * If section is given, addresses are offsets in the section, otherwise
+ * VMAs. Lines are looked up with bfd_find_nearest_line on the object,
+ * or by an addr2line process if sym_use_addr2line is set. Either way,
+ * answers are cached, and the strings are owned by the server.
+ *
+ * addr2line is queried asynchronously: request() queues addresses in
+ * the pipe, sent in batches, and a reader thread parses the answers in
+ * the order of requests. ready() tells if an address is answered, so
+ * the caller can go on without waiting. All methods can be called by
+ * concurrent threads, e.g., parallel replay workers sharing a server.
+ */
 struct sym_server {
-    sym_server(const char *filename, const char *section = nullptr);
+    sym_server(std::shared_ptr<obj_file> obj, const char *section = nullptr);
     sym_answer query(uint64_t addr);
-    inline ~sym_server() {
-        free(line);
-    }
+    void request(uint64_t addr);
+    bool ready(uint64_t addr);
+    ~sym_server();
 private:
+    // Addresses requested in a batch before being sent
+    static constexpr uint64_t batch = 256;
+    sym_answer query_bfd(uint64_t addr);
+    void read_answers();
+    void send();
+    void send_batch(uint64_t seq);
+    std::shared_ptr<obj_file> obj;
+    bool by_section;
+    asection *section = nullptr;
+    // Allocated sections by VMA, if not by_section
+    std::map<uint64_t, asection*> sections;
     std::unordered_set<std::string> strings;
     std::unordered_map<uint64_t, sym_answer> cached;
+    // Guards strings and cached, and below for addr2line
+    std::mutex lock;
+    // Held while writing to addr2line, never taken by the reader
+    std::mutex send_lock;
+    std::condition_variable answered;
+    // Sequence of requested but not answered addresses
+    std::unordered_map<uint64_t, uint64_t> pending;
+    // Requested addresses in order, popped by the reader
+    std::deque<uint64_t> inflight;
+    // Under send_lock
+    uint64_t requested = 0;
+    uint64_t sent = 0;
+    std::thread reader;
     char *line = nullptr;
     size_t linesz = 0;
     auto_file read_fp;
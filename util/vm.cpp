@@ -14,45 +14,117 @@ using namespace std;
 void memory_view::load_core(shared_ptr<core_file> coredump) {
     for (auto& [vma, sect] : coredump->get_sect_by_vma()) {
         auto [sec_it, sec_inserted] = loaded_sections.emplace(vma,
-                loaded_section{coredump, sect});
+                loaded_section{vma, coredump, sect, nullptr, 0});
         if (!sec_inserted)
             error(-1, 0, "overlapping section at %" PRIx64 " %s vs %s",
                   vma, sec_it->second.asection->name, sect->name);
+        if (!sect->size)
+            continue;
+        uint64_t last = vma + sect->size - 1;
+        for (uint64_t top = vma >> top_shift; ; ++top) {
+            map_range(page_table[top], top_shift, top << top_shift,
+                      vma, last, &sec_it->second);
+            if (top == last >> top_shift)
+                break;
+        }
+    }
+}
+
+/*
+ * Map [first, last] of section in entry, which covers 1 << shift bytes
+ * from base. Sections don't overlap, so only pages can be shared.
+ */
+void memory_view::map_range(page_entry &entry, unsigned shift, uint64_t base,
+                            uint64_t first, uint64_t last,
+                            loaded_section *section) {
+    uint64_t end = base + ((1ULL << shift) - 1);
+    if (first <= base && last >= end) {
+        entry.section = section;
+        return;
+    }
+    if (shift == page_shift) {
+        entry.shared = entry.section || entry.shared;
+        entry.section = entry.shared ? nullptr : section;
+        return;
+    }
+    if (!entry.node)
+        entry.node = make_unique<array<page_entry, 1 << level_bits> >();
+    shift -= level_bits;
+    uint64_t from = max(first, base), to = min(last, end);
+    for (uint64_t i = (from - base) >> shift; i <= (to - base) >> shift; ++i)
+        map_range((*entry.node)[i], shift, base + (i << shift),
+                  first, last, section);
+}
+
+// Section containing vma, lock must be held
+memory_view::loaded_section *memory_view::find_section(uint64_t vma) {
+    if (last_hit && vma - last_hit->vma < last_hit->asection->size)
+        return last_hit;
+    auto it = page_table.find(vma >> top_shift);
+    if (it == page_table.end())
+        return nullptr;
+    const page_entry *entry = &it->second;
+    for (unsigned shift = top_shift; !entry->section; ) {
+        if (entry->shared) {
+            auto sec_it = loaded_sections.upper_bound(vma);
+            if (sec_it == loaded_sections.begin())
+                return nullptr;
+            --sec_it;
+            if (vma - sec_it->first >= sec_it->second.asection->size)
+                return nullptr;
+            return last_hit = &sec_it->second;
+        }
+        if (!entry->node)
+            return nullptr;
+        shift -= level_bits;
+        entry = &(*entry->node)[(vma >> shift) & ((1 << level_bits) - 1)];
     }
+    // A page partially covered by the section
+    if (vma - entry->section->vma >= entry->section->asection->size)
+        return nullptr;
+    return last_hit = entry->section;
 }
 
 pair<const uint8_t*, size_t> memory_view::try_map(uint64_t vma) {
-    auto it = loaded_sections.upper_bound(vma);
-    if (it == loaded_sections.begin())
+    /*
+     * Mapped sections stay till the core is unloaded, so the section
+     * last mapped by this thread is reused without taking the lock.
+     * Bounded by the mapped size, which can be short of the section.
+     */
+    thread_local struct {
+        uint64_t generation;
+        uint64_t vma;
+        const uint8_t *data;
+        size_t mapped;
+    } last_mapped;
+    if (last_mapped.generation == generation &&
+        vma - last_mapped.vma < last_mapped.mapped)
+        return make_pair(vma - last_mapped.vma + last_mapped.data,
+                         last_mapped.mapped - (vma - last_mapped.vma));
+    lock_guard<mutex> guard(lock);
+    auto *sect = find_section(vma);
+    if (!sect)
         return make_pair(nullptr, 0);
-    --it;
-    if (vma - it->first >= it->second.asection->size)
-        return make_pair(nullptr, 0);
-    auto [addr, sz] = it->second.core->mmap(it->second.asection->filepos);
-    if (!addr)
-        error(-1, 0, "failed to map section %s", it->second.asection->name);
-    if (vma - it->first >= sz)
+    if (!sect->data) {
+        auto [addr, sz] = sect->core->mmap(sect->asection->filepos);
+        if (!addr)
+            error(-1, 0, "failed to map section %s", sect->asection->name);
+        sect->data = (const uint8_t*)addr;
+        sect->mapped = sz;
+    }
+    if (vma - sect->vma >= sect->mapped)
         error(-1, 0, "trying to map beyond section limit");
-    return make_pair(vma - it->first + (uint8_t*)addr, sz - (vma - it->first));
+    last_mapped = {generation, sect->vma, sect->data, sect->mapped};
+    return make_pair(vma - sect->vma + sect->data,
+                     sect->mapped - (vma - sect->vma));
 }
 
-tuple<shared_ptr<obj_file>, const string*, uint64_t> memory_view::query_sym(uint64_t vma) {
-    auto it = loaded_sections.upper_bound(vma);
-    if (it == loaded_sections.begin())
-        return no_map_or_sym;
-    --it;
-    if (vma - it->first >= it->second.asection->size)
-        return no_map_or_sym;
-    auto core = it->second.core;
-    auto [fn1, fileoff] = core->get_file_backing(vma);
-    auto [fn2, filesection, sectionvma] = core->get_file_vma(vma);
-    // Use file offset if present
-    auto filename = fn1 ? fn1 : fn2;
-    if (!filename)
-        return no_map_or_sym;
+// Binary and debug file backing the core, lock must be held
+pair<shared_ptr<obj_file>, shared_ptr<obj_file> >
+memory_view::backed_files(shared_ptr<core_file> core, const string *filename) {
     auto& cache = backed_file_cache[core];
-    auto it2 = cache.find(filename);
-    if (it2 == cache.end()) {
+    auto it = cache.find(filename);
+    if (it == cache.end()) {
         auto obj_store = core->obj_store();
         shared_ptr<obj_file> bin = obj_store->get(filename->c_str()), dbg = nullptr;
         if (bin) {
@@ -63,9 +135,24 @@ tuple<shared_ptr<obj_file>, const string*, uint64_t> memory_view::query_sym(uint
         }
         if (!dbg)
             dbg = obj_store->get_dbg(filename->c_str());
-        it2 = cache.emplace(filename, make_pair(bin, dbg)).first;
+        it = cache.emplace(filename, make_pair(bin, dbg)).first;
     }
-    auto [bin, dbg] = it2->second;
+    return it->second;
+}
+
+tuple<shared_ptr<obj_file>, const string*, uint64_t> memory_view::query_sym(uint64_t vma) {
+    lock_guard<mutex> guard(lock);
+    auto *sect = find_section(vma);
+    if (!sect)
+        return no_map_or_sym;
+    auto core = sect->core;
+    auto [fn1, fileoff] = core->get_file_backing(vma);
+    auto [fn2, filesection, sectionvma] = core->get_file_vma(vma);
+    // Use file offset if present
+    auto filename = fn1 ? fn1 : fn2;
+    if (!filename)
+        return no_map_or_sym;
+    auto [bin, dbg] = backed_files(core, filename);
     if (fn1) {
         // Use file offset if present
         // Binary must be found to produce the correct VMA from offset
@@ -80,12 +167,41 @@ tuple<shared_ptr<obj_file>, const string*, uint64_t> memory_view::query_sym(uint
 }
 
 tuple<const string*, const string*, uint64_t> memory_view::query_label(uint64_t vma) {
-    auto it = loaded_sections.upper_bound(vma);
-    if (it == loaded_sections.begin())
-        return no_map_or_sym;
-    --it;
-    if (vma - it->first >= it->second.asection->size)
+    lock_guard<mutex> guard(lock);
+    auto *sect = find_section(vma);
+    if (!sect)
         return no_map_or_sym;
-    auto core = it->second.core;
+    auto core = sect->core;
     return core->get_label(vma);
-}
\ No newline at end of file
+}
+
+/*
+ * Binary file and the file offset of vma
+ * Return nullptr if vma isn't backed by a binary file
+ */
+tuple<shared_ptr<obj_file>, uint64_t> memory_view::query_file(uint64_t vma) {
+    lock_guard<mutex> guard(lock);
+    auto *sect = find_section(vma);
+    if (!sect)
+        return no_map;
+    auto core = sect->core;
+    auto [fn1, fileoff] = core->get_file_backing(vma);
+    if (fn1) {
+        auto bin = backed_files(core, fn1).first;
+        if (!bin)
+            return no_map;
+        return make_tuple(bin, fileoff);
+    }
+    auto [fn2, filesection, sectionvma] = core->get_file_vma(vma);
+    if (!fn2)
+        return no_map;
+    auto bin = backed_files(core, fn2).first;
+    if (!bin)
+        return no_map;
+    auto offset = filesection ?
+            bin->section_to_fileoff(*filesection, sectionvma) :
+            bin->va_to_fileoff(sectionvma);
+    if (!offset)
+        return no_map;
+    return make_tuple(bin, *offset);
+}
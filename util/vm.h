@@ -6,22 +6,59 @@
 #ifndef LIBNEXUS_RV_VM_H
 #define LIBNEXUS_RV_VM_H
 
+#include <array>
+#include <atomic>
 #include <string_view>
 #include <unordered_map>
+#include <memory>
+#include <mutex>
 #include "objfile.h"
 #include "linux.h"
 
 struct memory_view {
+    inline memory_view() : generation(++generations) {}
     void load_core(std::shared_ptr<core_file> coredump);
     std::pair<const uint8_t*, size_t> try_map(uint64_t vma);
     std::tuple<std::shared_ptr<obj_file>, const std::string*, uint64_t> query_sym(uint64_t vma);
     std::tuple<const std::string*, const std::string*, uint64_t> query_label(uint64_t vma);
+    std::tuple<std::shared_ptr<obj_file>, uint64_t> query_file(uint64_t vma);
 private:
+    std::pair<std::shared_ptr<obj_file>, std::shared_ptr<obj_file> >
+        backed_files(std::shared_ptr<core_file> core, const std::string *filename);
     struct loaded_section {
+        uint64_t vma;
         std::shared_ptr<core_file> core;
         bfd_section *asection;
+        // Mapped by try_map on first use
+        const uint8_t *data;
+        size_t mapped;
     };
+    loaded_section *find_section(uint64_t vma);
+    /*
+     * Sections by address range, filled by load_core. Each level splits
+     * its range in 1 << level_bits, down to pages. An entry is either
+     * covered by one section, split further by node, or unmapped if
+     * neither. Pages of multiple sections are shared, and looked up in
+     * loaded_sections instead. The top level is hashed by 1 GiB ranges.
+     */
+    static constexpr unsigned page_shift = 12;
+    static constexpr unsigned level_bits = 9;
+    static constexpr unsigned top_shift = page_shift + 2 * level_bits;
+    struct page_entry {
+        loaded_section *section = nullptr;
+        std::unique_ptr<std::array<page_entry, 1 << level_bits> > node;
+        bool shared = false;
+    };
+    void map_range(page_entry &entry, unsigned shift, uint64_t base,
+                   uint64_t first, uint64_t last, loaded_section *section);
+    // Serializes mapping and bfd accesses from concurrent replay workers
+    std::mutex lock;
     std::map<uint64_t, loaded_section> loaded_sections;
+    std::unordered_map<uint64_t, page_entry> page_table;
+    loaded_section *last_hit = nullptr;
+    // Unique among all views, even if allocated at the same address
+    static inline std::atomic<uint64_t> generations;
+    const uint64_t generation;
     std::unordered_map<std::shared_ptr<core_file>,
         std::unordered_map<const std::string*, std::pair<
             std::shared_ptr<obj_file>,